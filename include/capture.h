@@ -9,6 +9,10 @@ struct Capture {
     char dev[64];
     int width;
     int height;
+    // Frames per second once initialized, 0 when unknown
+    int fps;
+    // Frames held by the caller at once, plus the ones being filled
+    int buffers;
 };
 
 Capture * capture_create();
@@ -16,6 +20,8 @@ int capture_init(Capture *c);
 int capture_flush(Capture *c);
 Buffer* capture_grab(Capture *c);
 int capture_release_buffer(Capture* c, Buffer* b);
+int capture_set_fps(Capture* c, int fps);
+int capture_set_size(Capture* c, int width, int height);
 int capture_destroy(Capture *c);
 
 #endif
@@ -0,0 +1,72 @@
+#ifndef __CLIENT_H__
+#define __CLIENT_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#include "buffer.h"
+#include "variant.h"
+
+typedef enum {
+    CLIENT_TEXT,
+    CLIENT_BINARY,
+    CLIENT_WEBSOCKET,
+    // Binary protocol on the Unix socket, frames passed as memfds
+    CLIENT_LOCAL,
+    // HTTP/1.1 snapshots
+    CLIENT_HTTP
+} ClientProtocol;
+
+typedef struct Client Client;
+
+struct Client {
+    int fd;
+    ClientProtocol protocol;
+    // Received bytes not parsed yet
+    Buffer* input;
+    int eof;
+    // Close once the output is sent
+    int closing;
+    // Live frames pushed after the last one sent
+    int streaming;
+    uint32_t last_seq;
+    // Command waiting for a frame newer than last_seq, 0 when none.
+    // The frame is sent while compressed.
+    int waiting;
+    uint32_t offset;
+    // Encoding of the frame the waiting binary client gets
+    Variant variant;
+    // Last frame of a burst, the frames after last_seq up to it are
+    // sent in sequence. 0 when none.
+    uint32_t burst_last;
+    // HTTP connection kept after the response
+    int keep_alive;
+    // Bytes in flight, and the latest live frame waiting for them
+    Buffer* output;
+    uint32_t sent;
+    Buffer* pending;
+    // Descriptors going with the first byte of output and pending, -1
+    // when none
+    int output_fd;
+    int pending_fd;
+    // Responses with descriptors waiting behind output, in order, as
+    // descriptor, header length and header
+    Buffer* queued;
+    // Live frames replaced before being sent
+    uint32_t drops;
+    // Last time the output moved
+    time_t progress;
+};
+
+Client* client_create(int fd);
+int client_read(Client* c);
+int client_consume(Client* c, int n);
+int client_send(Client* c, const uint8_t* header, int hlen, const Buffer* data);
+int client_send_fd(Client* c, const uint8_t* header, int hlen, int fd, int live);
+int client_push(Client* c, const uint8_t* header, int hlen, const Buffer* data);
+int client_flush(Client* c);
+int client_idle(Client* c);
+void client_reset(Client* c);
+int client_destroy(Client* c);
+
+#endif
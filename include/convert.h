@@ -0,0 +1,22 @@
+#ifndef __CONVERT_H__
+#define __CONVERT_H__
+
+#include <stdint.h>
+
+// Converters from the pixel formats of the cameras to YUYV, the frame
+// format of the rest of the server. Every format has its own loop,
+// generated from the same macro, without branches per pixel.
+
+// stride is the bytes per line of the luma, out is width * height * 2
+typedef void (*ConvertFunc)(const uint8_t* in, int stride, int width, int height, uint8_t* out);
+
+// Preference of a V4L2 format, lower is cheaper, -1 when unsupported
+int convert_rank(uint32_t fourcc);
+// NULL for YUYV and the unsupported formats
+ConvertFunc convert_find(uint32_t fourcc);
+// Bytes per line of the luma, for drivers that don't give it
+int convert_stride(uint32_t fourcc, int width);
+// Bytes of a frame, luma and chroma planes, that the converter reads
+int convert_size(uint32_t fourcc, int stride, int height);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "buffer.h"
+
+typedef struct Frame Frame;
+
+struct Frame {
+    uint32_t seq;
+    // Capture time
+    struct timeval timestamp;
+    // Microseconds spent in jpeg_compress()
+    uint32_t encode_time;
+    Buffer* jpeg;
+    // Raw copy, to encode other variants on request
+    Buffer* raw;
+    // Size of the raw frame, it changes with the capture mode
+    int width;
+    int height;
+};
+
+Frame* frame_create();
+int frame_destroy(Frame* f);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stdint.h>
+
+// HTTP/1.1 on the text port: GET or HEAD of the snapshot, on a
+// keep-alive connection, and the WebSocket upgrade.
+
+// Biggest request accepted, headers included
+#define HTTP_MAX_REQUEST 4096
+
+#define HTTP_SNAPSHOT "/snapshot"
+
+typedef struct HttpRequest HttpRequest;
+
+struct HttpRequest {
+    char method[8];
+    char path[64];
+    // HTTP/1.1 keeps the connection unless "Connection: close", 1.0
+    // only with "Connection: keep-alive"
+    int keep_alive;
+    // Upgrade to WebSocket
+    int upgrade;
+    // If-None-Match, empty when missing
+    char etag[64];
+};
+
+int http_is_request(const uint8_t* data, int len);
+int http_parse_request(const uint8_t* data, int len, HttpRequest* r);
+const char* http_header(const char* request, const char* name, int* vlen);
+int http_etag_matches(const HttpRequest* r, const char* etag);
+int http_write_header(char* out, int size, int status, const char* etag, int length, int keep_alive);
+
+#endif
@@ -3,20 +3,70 @@
 
 #include "buffer.h"
 
+typedef enum {
+    JPEG_MODE_COLOR,
+    JPEG_MODE_GRAY
+} JPEGMode;
+
+typedef enum {
+    // The encoder's own: 4:2:0 with libjpeg, 4:2:2 with the YUYV one
+    JPEG_SAMPLING_DEFAULT,
+    // Chroma at half the width, like the YUYV frames
+    JPEG_SAMPLING_422,
+    // Chroma at half the width and height, averaging the row pairs
+    JPEG_SAMPLING_420
+} JPEGSampling;
+
+// Huffman table as written in DHT: codes of each length, 1 to 16 bits,
+// then the symbols in the order of their codes
+typedef struct {
+    uint8_t bits[16];
+    uint8_t values[256];
+} JPEGHuffmanTable;
+
+// Tables of the luma (0) and of the chroma (1)
+typedef struct {
+    JPEGHuffmanTable dc[2];
+    JPEGHuffmanTable ac[2];
+} JPEGHuffman;
+
+// Crop windows must be aligned to the biggest MCU
+#define JPEG_MCU_SIZE 16
 
 typedef struct JPEGEncoder JPEGEncoder;
 
+// Called while compressing, after every row of MCUs, with the bytes
+// of the output that are final
+typedef void (*JPEGProgress)(JPEGEncoder* encoder, uint32_t bytes);
+
 struct JPEGEncoder {
     int width;
     int height;
     int quality;
+    JPEGMode mode;
+    // Chroma subsampling in color. Ignored by the OMX encoder.
+    JPEGSampling sampling;
+    // Huffman tables, the standard ones when NULL. They must code every
+    // symbol. Ignored by the OMX encoder.
+    const JPEGHuffman* huffman;
+    // Crop window, a zero size encodes the full frame
+    int crop_x;
+    int crop_y;
+    int crop_width;
+    int crop_height;
     Buffer* output;
     Buffer* input;
+    // When set, a restart marker ends every row of MCUs and the rows
+    // are reported as they are compressed. Ignored by the OMX encoder.
+    JPEGProgress progress;
+    void* progress_arg;
 };
 
 JPEGEncoder* jpeg_create_encoder();
 int jpeg_init(JPEGEncoder* encoder);
 int jpeg_compress(JPEGEncoder* encoder);
+// Whether the frames may change size after jpeg_init()
+int jpeg_resizable(const JPEGEncoder* encoder);
 int jpeg_destroy_encoder(JPEGEncoder* encoder);
 
 #endif
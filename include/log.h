@@ -2,6 +2,7 @@
 #define __LOG_H__
 
 #include <stdio.h>
+#include <sys/time.h>
 
 // Log levels
 #define LEVEL_NONE  0
@@ -0,0 +1,8 @@
+#ifndef __MEMFD_H__
+#define __MEMFD_H__
+
+#include "buffer.h"
+
+int memfd_from_buffer(const char* name, const Buffer* b);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef __MULTICAST_H__
+#define __MULTICAST_H__
+
+#include <stdint.h>
+
+#include "frame.h"
+
+// Every frame is fragmented in datagrams, each one with a header:
+// magic(4)="RWM1" packet(4) seq(4) timestamp(8) size(4) index(2) count(2)
+// All the fields are big endian. The packet number counts every
+// datagram sent, so the receivers see the datagrams lost. The frames
+// skipped to keep the rate leave gaps in seq only. The fragment index
+// gives the offset in the frame, every fragment but the last one is
+// full.
+
+#define MCAST_MAGIC 0x52574D31
+#define MCAST_HEADER_SIZE 28
+// Fits a 1500 bytes MTU with the IP and UDP headers
+#define MCAST_DATAGRAM_SIZE 1472
+#define MCAST_PAYLOAD_SIZE (MCAST_DATAGRAM_SIZE - MCAST_HEADER_SIZE)
+
+typedef struct MulticastHeader MulticastHeader;
+
+struct MulticastHeader {
+    uint32_t packet;
+    uint32_t seq;
+    // Capture time, microseconds since the epoch
+    uint64_t timestamp;
+    uint32_t size;
+    uint16_t index;
+    uint16_t count;
+};
+
+typedef struct Multicast Multicast;
+
+struct Multicast {
+    // Group (or any unicast address) and port
+    char address[64];
+    int port;
+    // Address of the outgoing interface, empty for the default one
+    char interface[64];
+    int ttl;
+    // Kbit/s, 0 sends the bursts unpaced
+    int rate;
+};
+
+Multicast* multicast_create();
+int multicast_init(Multicast* m);
+int multicast_send(Multicast* m, const Frame* f);
+int multicast_destroy(Multicast* m);
+
+int multicast_write_header(uint8_t* out, const MulticastHeader* h);
+int multicast_parse_header(const uint8_t* data, int len, MulticastHeader* h);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+#include <stdint.h>
+
+// Binary protocol, a connection switches to it with the 'b' command
+// and stays open. Requests can be pipelined, the responses are sent
+// in the same order. All the fields are big endian.
+//
+// Request:  cmd(1) flags(1) length(2) payload(length)
+// Response: magic(4) cmd(1) status(1) format(1) flags(1) seq(4)
+//           timestamp(8) encode_time(4) size(4) payload(size)
+//
+// Request payloads:
+//   'g', 'q', 's': none
+//   'f': none, or quality(1) for a lower quality requantized frame
+//   'r': x(2) y(2) width(2) height(2)
+//   't': transform(1)
+//   'h': timestamp(8), microseconds since the epoch
+//   'p': none, with the live flag the live frames follow the window
+//   'n': seq(4), the response is the first frame published after it
+//   'm': width(2) height(2), the response is the first frame at the
+//        capture size the driver takes
+//   'c': count(2), a response for each of the next count frames
+//        grabbed, with the more flag up to the last one
+
+#define PROTO_MAGIC 0x52574631
+#define PROTO_REQUEST_SIZE 4
+#define PROTO_RESPONSE_SIZE 28
+#define PROTO_MAX_PAYLOAD 256
+
+// Response status
+#define PROTO_OK    0
+#define PROTO_ERROR 1
+
+// Request flags
+#define PROTO_FLAG_LIVE 0x01
+
+// Response flags, more frames follow for the same request
+#define PROTO_FLAG_MORE 0x01
+
+// Response formats
+#define PROTO_FORMAT_NONE      0
+#define PROTO_FORMAT_JPEG      1
+#define PROTO_FORMAT_JPEG_GRAY 2
+#define PROTO_FORMAT_TEXT      3
+
+typedef struct Request Request;
+
+struct Request {
+    uint8_t cmd;
+    uint8_t flags;
+    uint16_t length;
+    const uint8_t* payload;
+};
+
+typedef struct Response Response;
+
+struct Response {
+    uint8_t cmd;
+    uint8_t status;
+    uint8_t format;
+    uint8_t flags;
+    uint32_t seq;
+    // Capture time, microseconds since the epoch
+    uint64_t timestamp;
+    // Microseconds
+    uint32_t encode_time;
+    uint32_t size;
+};
+
+int protocol_parse_request(const uint8_t* data, int len, Request* r);
+int protocol_write_response(uint8_t* out, const Response* r);
+uint16_t protocol_get_u16(const uint8_t* p);
+uint32_t protocol_get_u32(const uint8_t* p);
+uint64_t protocol_get_u64(const uint8_t* p);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef __RECORDER_H__
+#define __RECORDER_H__
+
+#include <stdint.h>
+
+#include "buffer.h"
+#include "frame.h"
+
+typedef struct RecordEntry RecordEntry;
+
+// Index entry, one per recorded frame
+struct RecordEntry {
+    // Capture time, microseconds since the epoch
+    uint64_t timestamp;
+    uint32_t seq;
+    uint32_t segment;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t encode_time;
+    uint32_t mode;
+};
+
+typedef struct Recorder Recorder;
+
+// Called by the writer thread once a lookup is done
+typedef void (*RecorderFound)(Recorder* r);
+
+struct Recorder {
+    char path[256];
+    // Bytes per segment file
+    uint32_t segment_size;
+    // Seconds of frames kept
+    int retention;
+    RecorderFound found;
+    void* found_arg;
+};
+
+Recorder* recorder_create();
+int recorder_init(Recorder* r);
+int recorder_append(Recorder* r, const Frame* f, int mode);
+// The frames are read by the writer thread, the lookups are taken once
+// found() is called. A closed owner cancels its lookup.
+int recorder_lookup(Recorder* r, uint64_t timestamp, void* owner);
+void* recorder_result(Recorder* r, RecordEntry* e, Buffer** data, int* status);
+void recorder_cancel(Recorder* r, void* owner);
+int recorder_destroy(Recorder* r);
+
+#endif
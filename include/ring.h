@@ -0,0 +1,37 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdint.h>
+
+#include "buffer.h"
+#include "frame.h"
+
+typedef struct RingEntry RingEntry;
+
+struct RingEntry {
+    uint32_t seq;
+    // Capture time, microseconds since the epoch
+    uint64_t timestamp;
+    uint32_t encode_time;
+    int mode;
+    uint32_t offset;
+    uint32_t size;
+};
+
+typedef struct Ring Ring;
+
+struct Ring {
+    // Bytes of the arena
+    uint32_t size;
+    // Milliseconds of frames kept, 0 keeps as many as fit
+    int duration;
+};
+
+Ring* ring_create();
+int ring_init(Ring* r);
+int ring_append(Ring* r, const Frame* f, int mode);
+uint32_t ring_last_seq(Ring* r);
+int ring_get(Ring* r, uint32_t after, RingEntry* e, Buffer* out);
+int ring_destroy(Ring* r);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef __SHM_H__
+#define __SHM_H__
+
+#include "buffer.h"
+#include "frame.h"
+#include "shm_reader.h"
+
+typedef struct Shm Shm;
+
+struct Shm {
+    // POSIX shared memory name, like /rpi-webcam
+    char name[64];
+    int slots;
+    int width;
+    int height;
+};
+
+Shm* shm_create();
+int shm_init(Shm* s);
+int shm_fits(Shm* s, int width, int height);
+int shm_publish(Shm* s, const Frame* f, const Buffer* raw, int mode);
+int shm_destroy(Shm* s);
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef __SHM_READER_H__
+#define __SHM_READER_H__
+
+#include <stdint.h>
+
+// Shared memory ring of the last frames, raw YUYV and JPEG, published
+// by rpi-webcam -S name. The reader gets pointers into the mapping, no
+// copies and no system calls, and checks afterwards that the slot was
+// not overwritten meanwhile (seqlock).
+//
+// Layout: a header page followed by the slots, each one a ShmSlot
+// followed by the raw frame and the JPEG, page aligned.
+
+#define SHM_MAGIC 0x52575331
+#define SHM_VERSION 2
+#define SHM_PAGE 4096
+
+// 'YUYV'
+#define SHM_FORMAT_YUYV 0x56595559
+
+typedef struct ShmHeader ShmHeader;
+
+struct ShmHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    // Bytes of each slot, header included
+    uint32_t slot_size;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
+    // Capacity of the raw and JPEG areas of a slot
+    uint32_t raw_capacity;
+    uint32_t jpeg_capacity;
+    // Slot of the last frame published
+    uint32_t latest;
+};
+
+typedef struct ShmSlot ShmSlot;
+
+struct ShmSlot {
+    // Odd while the slot is written
+    uint32_t lock;
+    uint32_t seq;
+    // Capture time, microseconds since the epoch
+    uint64_t timestamp;
+    uint32_t encode_time;
+    uint32_t mode;
+    uint32_t raw_size;
+    uint32_t jpeg_size;
+    // Size of this frame, the header has the size at startup
+    uint32_t width;
+    uint32_t height;
+};
+
+typedef struct ShmFrame ShmFrame;
+
+struct ShmFrame {
+    uint32_t seq;
+    uint64_t timestamp;
+    uint32_t encode_time;
+    uint32_t mode;
+    uint32_t width;
+    uint32_t height;
+    // Point into the mapping, valid while shm_reader_check() says so
+    const uint8_t* raw;
+    uint32_t raw_size;
+    const uint8_t* jpeg;
+    uint32_t jpeg_size;
+
+    const ShmSlot* slot;
+    uint32_t lock;
+};
+
+typedef struct ShmReader ShmReader;
+
+ShmReader* shm_reader_open(const char* name);
+int shm_reader_latest(ShmReader* r, ShmFrame* f);
+int shm_reader_check(ShmReader* r, const ShmFrame* f);
+int shm_reader_close(ShmReader* r);
+
+#endif
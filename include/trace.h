@@ -0,0 +1,28 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+// Spans of the work done on every frame, kept per thread in memory
+// and dumped in the Chrome trace event format (chrome://tracing or
+// ui.perfetto.dev). Every thread writes only its own buffer, without
+// locks; the oldest spans are overwritten. While tracing is not
+// initialized the calls do nothing.
+
+// Spans kept per thread
+#define TRACE_EVENTS 16384
+// Threads traced
+#define TRACE_THREADS 16
+
+// Microseconds of the monotonic clock, the start of a span
+uint64_t trace_now();
+
+int trace_init(int events);
+int trace_set_thread_name(const char* name);
+// Span of the current thread from start until now, the name must be
+// a literal. The frame sequence is 0 for work not bound to a frame.
+void trace_span(const char* name, uint32_t seq, uint64_t start);
+int trace_dump(const char* path);
+int trace_destroy();
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef __TRANSFORM_H__
+#define __TRANSFORM_H__
+
+#include "buffer.h"
+#include "jpeg.h"
+
+typedef enum {
+    JPEG_TRANSFORM_NONE,
+    JPEG_TRANSFORM_ROT90,
+    JPEG_TRANSFORM_ROT180,
+    JPEG_TRANSFORM_ROT270,
+    JPEG_TRANSFORM_FLIP_H,
+    JPEG_TRANSFORM_FLIP_V
+} JPEGTransform;
+
+int jpeg_transform_parse(const char* name, JPEGTransform* t);
+int jpeg_transform(const Buffer* input, Buffer* output, JPEGTransform t);
+// Lower quality of an encoded frame, without decoding it to pixels
+int jpeg_requantize(const Buffer* input, Buffer* output, int quality);
+// Huffman tables fitted to the symbols of an encoded frame, they still
+// code every symbol for the frames that follow
+int jpeg_huffman_tables(const Buffer* input, JPEGHuffman* h);
+
+#endif
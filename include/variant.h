@@ -0,0 +1,37 @@
+#ifndef __VARIANT_H__
+#define __VARIANT_H__
+
+#include "buffer.h"
+#include "jpeg.h"
+#include "transform.h"
+
+typedef struct Variant Variant;
+
+// Encoding requested by a client for the current frame
+struct Variant {
+    JPEGMode mode;
+    // Crop window, a zero size is the full frame
+    int x;
+    int y;
+    int width;
+    int height;
+    // Lossless transform applied to the encoded window
+    JPEGTransform transform;
+    // Lower quality requantized from the encoded window, 0 is the
+    // quality of the producer
+    int quality;
+};
+
+typedef struct VariantCache VariantCache;
+
+struct VariantCache {
+    int size;
+};
+
+VariantCache* variant_cache_create(int size);
+Buffer* variant_cache_get(VariantCache* c, const Variant* v);
+Buffer* variant_cache_put(VariantCache* c, const Variant* v);
+int variant_cache_clear(VariantCache* c);
+int variant_cache_destroy(VariantCache* c);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef __WEBSOCKET_H__
+#define __WEBSOCKET_H__
+
+#include <stdint.h>
+
+// WebSocket (RFC 6455) upgrade of a connection, every frame is pushed
+// to the browser as a binary message.
+
+// Opcodes
+#define WS_OP_TEXT   0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE  0x8
+#define WS_OP_PING   0x9
+#define WS_OP_PONG   0xA
+
+// Largest frame header: flags(1) length(1) extended length(8)
+#define WS_MAX_HEADER 10
+
+// Control frame payloads can't be bigger
+#define WS_MAX_CONTROL 125
+
+typedef struct WebSocketFrame WebSocketFrame;
+
+struct WebSocketFrame {
+    uint8_t opcode;
+    uint64_t length;
+    // Unmasked in place
+    uint8_t* payload;
+};
+
+int websocket_handshake(const uint8_t* data, int len, char* response, int size);
+int websocket_write_header(uint8_t* out, uint8_t opcode, uint64_t length);
+int websocket_parse_frame(uint8_t* data, int len, WebSocketFrame* f);
+
+#endif
@@ -46,7 +46,7 @@ int buffer_copy(Buffer* d, const Buffer* s) {
         return -1;
     }
     d->used = s->used;
-    memccpy(d->data, s->data, s->used, 1);
+    memcpy(d->data, s->data, s->used);
     return 0;
 }
 
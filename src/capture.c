@@ -7,8 +7,10 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <time.h>
 
 #include "capture.h"
+#include "convert.h"
 #include "log.h"
 
 typedef enum {
@@ -22,6 +24,12 @@ typedef enum {
     DESTROY
 } CaptureStatus;
 
+// The "test" device generates a moving pattern, at most this size
+#define TEST_DEVICE "test"
+#define TEST_MAX_WIDTH 1280
+#define TEST_MAX_HEIGHT 720
+#define TEST_FPS 30
+
 typedef struct ICapture ICapture;
 
 struct ICapture {
@@ -30,6 +38,20 @@ struct ICapture {
     int nbuf;
     Buffer** cbuffer;
     CaptureStatus status;
+
+    // Frames of other formats are converted to YUYV, one buffer per
+    // V4L2 buffer used in turn
+    uint32_t format;
+    ConvertFunc convert;
+    int stride;
+    Buffer** converted;
+    uint32_t nconverted;
+
+    // Test pattern
+    int test;
+    Buffer* pattern;
+    uint32_t frame;
+    struct timespec next;
 };
 
 static int xioctl(int fd, int request, void *arg) {
@@ -38,6 +60,105 @@ static int xioctl(int fd, int request, void *arg) {
     return r;
 }
 
+// Color bars, each frame adds a bar moving across them. The buffers
+// are only reallocated when the size grows.
+static int test_pattern(ICapture* ic) {
+    if (ic->c.width > TEST_MAX_WIDTH) ic->c.width = TEST_MAX_WIDTH;
+    if (ic->c.height > TEST_MAX_HEIGHT) ic->c.height = TEST_MAX_HEIGHT;
+    // Whole macropixels
+    ic->c.width &= ~1;
+    LOG_TRACE("Test pattern: Width=%5d, Height=%5d", ic->c.width, ic->c.height);
+
+    static const uint8_t bars[8][3] = {
+        {235, 128, 128}, {210, 16, 146}, {170, 166, 16}, {145, 54, 34},
+        {106, 202, 222}, {81, 90, 240}, {41, 240, 110}, {16, 128, 128}
+    };
+
+    uint32_t size = ic->c.width * ic->c.height * 2;
+    if (ic->pattern == NULL) {
+        ic->pattern = buffer_create();
+    }
+    if (ic->pattern == NULL || 0 > buffer_resize(ic->pattern, size, 0)) {
+        LOG_ERROR("Allocating test pattern");
+        return -1;
+    }
+
+    int x, y;
+    for (y = 0; y < ic->c.height; y++) {
+        uint8_t* line = ic->pattern->data + y * ic->c.width * 2;
+        for (x = 0; x < ic->c.width; x += 2) {
+            const uint8_t* bar = bars[x * 8 / ic->c.width];
+            // Some texture so the frames are not trivial to encode
+            uint8_t noise = ((x * 7 + y * 13) ^ (x * y)) & 7;
+            line[2 * x] = bar[0] + noise;
+            line[2 * x + 1] = bar[1];
+            line[2 * x + 2] = bar[0] + noise;
+            line[2 * x + 3] = bar[2];
+        }
+    }
+    ic->pattern->used = size;
+
+    int i;
+    for (i = 0; i < ic->nbuf; i++) {
+        if (0 > buffer_resize(ic->cbuffer[i], size, 0)) {
+            LOG_ERROR("Allocating Buffer[%d]", i);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int test_init(ICapture* ic) {
+    if (0 != test_pattern(ic)) {
+        return -1;
+    }
+
+    ic->c.fps = TEST_FPS;
+    clock_gettime(CLOCK_MONOTONIC, &ic->next);
+    ic->status = IDLE;
+    return 0;
+}
+
+static Buffer* test_grab(ICapture* ic) {
+    // Paced like a camera
+    long period = 1000000000L / ic->c.fps;
+    ic->next.tv_nsec += period;
+    if (ic->next.tv_nsec >= 1000000000L) {
+        ic->next.tv_nsec -= 1000000000L;
+        ic->next.tv_sec++;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > ic->next.tv_sec || (now.tv_sec == ic->next.tv_sec && now.tv_nsec > ic->next.tv_nsec)) {
+        // Late, no burst to catch up
+        ic->next = now;
+    } else {
+        while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ic->next, NULL));
+    }
+
+    Buffer* b = ic->cbuffer[ic->frame % ic->nbuf];
+    memcpy(b->data, ic->pattern->data, ic->pattern->used);
+    b->used = ic->pattern->used;
+
+    int bar = (ic->frame * 8) % ic->c.width;
+    int width = ic->c.width - bar < 32 ? ic->c.width - bar : 32;
+    int y;
+    for (y = 0; y < ic->c.height; y++) {
+        uint8_t* p = b->data + (y * ic->c.width + bar) * 2;
+        int x;
+        for (x = 0; x < width; x += 2) {
+            p[2 * x] = 235;
+            p[2 * x + 1] = 128;
+            p[2 * x + 2] = 235;
+            p[2 * x + 3] = 128;
+        }
+    }
+    ic->frame++;
+
+    return b;
+}
+
 Capture* capture_create() {
     LOG_TRACE("Create Capture Context");
     ICapture* ic = calloc(1, sizeof (ICapture));
@@ -45,7 +166,7 @@ Capture* capture_create() {
     strcpy(ic->c.dev, "/dev/video0");
     ic->c.width = 320;
     ic->c.height = 240;
-    ic->nbuf = 3;
+    ic->c.buffers = 3;
     ic->fd = -1;
     ic->status = UNINITIALIZED;
     return (Capture*) ic;
@@ -71,57 +192,36 @@ int capture_start(Capture* c) {
     return 0;
 }
 
-int capture_init(Capture* c) {
-    ICapture* ic = (ICapture*) c;
-
-    LOG_TRACE("Init Capture");
-    if (ic->status != UNINITIALIZED) return -1;
-    ic->status = INITIALIZING;
-
-    // Buffers
-    LOG_TRACE("Allocate Buffers");
-    ic->cbuffer = (Buffer**) calloc(ic->nbuf, sizeof (Buffer*));
-    if (ic->cbuffer == NULL) {
-        LOG_ERROR("Allocating buffers array");
-        return -1;
-    }
-    memset(ic->cbuffer, 0, ic->nbuf * sizeof (Buffer*));
-
-    int i;
-    for (i = 0; i < ic->nbuf; i++) {
-        ic->cbuffer[i] = buffer_create();
-        if (ic->cbuffer[i] == NULL) {
-            LOG_ERROR("Allocating Buffer[%d]", i);
-            return -1;
+// The supported format cheapest to encode, 0 when none
+static uint32_t negotiate_format(ICapture* ic) {
+    uint32_t best = 0;
+    int best_rank = -1;
+
+    struct v4l2_fmtdesc desc;
+    memset(&desc, 0, sizeof (struct v4l2_fmtdesc));
+    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    while (0 == xioctl(ic->fd, VIDIOC_ENUM_FMT, &desc)) {
+        int rank = convert_rank(desc.pixelformat);
+        LOG_TRACE("Format %.4s: %s%s", (char*) &desc.pixelformat, desc.description, rank < 0 ? " (unsupported)" : "");
+        if (rank >= 0 && (best_rank < 0 || rank < best_rank)) {
+            best = desc.pixelformat;
+            best_rank = rank;
         }
+        desc.index++;
     }
 
-    // Open Device
-    LOG_TRACE("Open device: %s", ic->c.dev);
-    ic->fd = open(ic->c.dev, O_RDWR);
-    if (ic->fd == -1) {
-        // couldn't find capture device
-        LOG_ERROR("Opening Video device");
-        return -1;
-    }
-
-    // Capabilities
-    LOG_TRACE("Query Capabilities");
-    struct v4l2_capability caps;
-    memset(&caps, 0, sizeof (struct v4l2_capability));
-    if (-1 == xioctl(ic->fd, VIDIOC_QUERYCAP, &caps)) {
-        LOG_ERROR("Querying Capabilites");
-        return -1;
-    }
+    return best;
+}
 
-    // Format
-    LOG_TRACE("Set Format");
+// Sets the size, the driver takes the nearest one it supports
+static int set_format(ICapture* ic) {
+    LOG_TRACE("Set Format %.4s", (char*) &ic->format);
     struct v4l2_format fmt;
     memset(&fmt, 0, sizeof (struct v4l2_format));
     fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     fmt.fmt.pix.width = ic->c.width;
     fmt.fmt.pix.height = ic->c.height;
-    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+    fmt.fmt.pix.pixelformat = ic->format;
     fmt.fmt.pix.field = V4L2_FIELD_ANY;
 
     if (-1 == xioctl(ic->fd, VIDIOC_S_FMT, &fmt)) {
@@ -129,10 +229,37 @@ int capture_init(Capture* c) {
         return -1;
     }
 
+    if (fmt.fmt.pix.pixelformat != ic->format) {
+        LOG_ERROR("Pixel format %.4s not taken", (char*) &ic->format);
+        return -1;
+    }
+
     ic->c.width = fmt.fmt.pix.width;
     ic->c.height = fmt.fmt.pix.height;
     LOG_TRACE("Width=%5d, Height=%5d", ic->c.width, ic->c.height);
 
+    if (convert_find(ic->format) != NULL) {
+        // Whole macropixels
+        ic->c.width &= ~1;
+        ic->stride = fmt.fmt.pix.bytesperline;
+        if (ic->stride == 0) {
+            ic->stride = convert_stride(ic->format, ic->c.width);
+        }
+    }
+
+    return 0;
+}
+
+// Maps and queues the driver buffers for the current size
+static int map_buffers(ICapture* ic) {
+    int i;
+    for (i = 0; ic->converted != NULL && i < ic->nbuf; i++) {
+        if (0 > buffer_resize(ic->converted[i], ic->c.width * ic->c.height * 2, 0)) {
+            LOG_ERROR("Allocating converted frame");
+            return -1;
+        }
+    }
+
     // Request Buffer
     LOG_TRACE("Request %d Buffers", ic->nbuf);
     struct v4l2_requestbuffers req;
@@ -178,6 +305,127 @@ int capture_init(Capture* c) {
         }
     }
 
+    return 0;
+}
+
+// Gives the driver buffers back, the format can't change while mapped
+static int unmap_buffers(ICapture* ic) {
+    int i;
+    for (i = 0; i < ic->nbuf; i++) {
+        if (ic->cbuffer[i]->data != NULL) {
+            if (-1 == munmap(ic->cbuffer[i]->data, ic->cbuffer[i]->size)) {
+                LOG_ERROR("Unmap Buffer");
+                return -1;
+            }
+            ic->cbuffer[i]->data = NULL;
+            ic->cbuffer[i]->size = 0;
+        }
+    }
+
+    struct v4l2_requestbuffers req;
+    memset(&req, 0, sizeof (struct v4l2_requestbuffers));
+    req.count = 0;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (-1 == xioctl(ic->fd, VIDIOC_REQBUFS, &req)) {
+        LOG_ERROR("Freeing Buffers");
+        return -1;
+    }
+
+    return 0;
+}
+
+int capture_init(Capture* c) {
+    ICapture* ic = (ICapture*) c;
+
+    LOG_TRACE("Init Capture");
+    if (ic->status != UNINITIALIZED) return -1;
+    ic->status = INITIALIZING;
+    ic->test = (strcmp(ic->c.dev, TEST_DEVICE) == 0);
+    ic->nbuf = ic->c.buffers;
+
+    // Buffers
+    LOG_TRACE("Allocate Buffers");
+    ic->cbuffer = (Buffer**) calloc(ic->nbuf, sizeof (Buffer*));
+    if (ic->cbuffer == NULL) {
+        LOG_ERROR("Allocating buffers array");
+        return -1;
+    }
+    memset(ic->cbuffer, 0, ic->nbuf * sizeof (Buffer*));
+
+    int i;
+    for (i = 0; i < ic->nbuf; i++) {
+        ic->cbuffer[i] = buffer_create();
+        if (ic->cbuffer[i] == NULL) {
+            LOG_ERROR("Allocating Buffer[%d]", i);
+            return -1;
+        }
+    }
+
+    if (ic->test) {
+        return test_init(ic);
+    }
+
+    // Open Device
+    LOG_TRACE("Open device: %s", ic->c.dev);
+    ic->fd = open(ic->c.dev, O_RDWR);
+    if (ic->fd == -1) {
+        // couldn't find capture device
+        LOG_ERROR("Opening Video device");
+        return -1;
+    }
+
+    // Capabilities
+    LOG_TRACE("Query Capabilities");
+    struct v4l2_capability caps;
+    memset(&caps, 0, sizeof (struct v4l2_capability));
+    if (-1 == xioctl(ic->fd, VIDIOC_QUERYCAP, &caps)) {
+        LOG_ERROR("Querying Capabilites");
+        return -1;
+    }
+
+    // Format
+    LOG_TRACE("Negotiate Format");
+    uint32_t format = negotiate_format(ic);
+    if (format == 0) {
+        LOG_ERROR("No supported pixel format");
+        return -1;
+    }
+
+    ic->format = format;
+    if (0 != set_format(ic)) {
+        return -1;
+    }
+
+    // Frame rate
+    struct v4l2_streamparm parm;
+    memset(&parm, 0, sizeof (struct v4l2_streamparm));
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (0 == xioctl(ic->fd, VIDIOC_G_PARM, &parm) && parm.parm.capture.timeperframe.numerator > 0) {
+        ic->c.fps = parm.parm.capture.timeperframe.denominator / parm.parm.capture.timeperframe.numerator;
+    }
+    LOG_TRACE("FPS=%d", ic->c.fps);
+
+    ic->convert = convert_find(format);
+    if (ic->convert != NULL) {
+        ic->converted = (Buffer**) calloc(ic->nbuf, sizeof (Buffer*));
+        if (ic->converted == NULL) {
+            LOG_ERROR("Allocating converted frames array");
+            return -1;
+        }
+        for (i = 0; i < ic->nbuf; i++) {
+            ic->converted[i] = buffer_create();
+            if (ic->converted[i] == NULL) {
+                LOG_ERROR("Allocating converted frame");
+                return -1;
+            }
+        }
+    }
+
+    if (0 != map_buffers(ic)) {
+        return -1;
+    }
+
     ic->status = INITIALIZED;
 
     LOG_TRACE("Starting Capture");
@@ -193,6 +441,7 @@ int capture_flush(Capture* c) {
 
     LOG_TRACE("Flush Buffers");
     if (ic->status != IDLE) return -1;
+    if (ic->test) return 0;
     ic->status = GRABBING;
 
     struct v4l2_buffer buf;
@@ -241,11 +490,29 @@ int capture_flush(Capture* c) {
     return 0;
 }
 
+// Converts the frame to YUYV and gives its buffer back to the driver
+static Buffer* convert_frame(ICapture* ic, Buffer* b) {
+    Buffer* out = NULL;
+    if (b->used < convert_size(ic->format, ic->stride, ic->c.height)) {
+        LOG_ERROR("Frame too short: %u bytes", b->used);
+    } else {
+        out = ic->converted[ic->nconverted++ % ic->nbuf];
+        ic->convert(b->data, ic->stride, ic->c.width, ic->c.height, out->data);
+        out->used = ic->c.width * ic->c.height * 2;
+    }
+
+    if (0 != capture_release_buffer((Capture*) ic, b)) {
+        return NULL;
+    }
+    return out;
+}
+
 Buffer* capture_grab(Capture* c) {
     ICapture* ic = (ICapture*) c;
 
     LOG_TRACE("Grab Frame");
     if (ic->status != IDLE) return NULL;
+    if (ic->test) return test_grab(ic);
     ic->status = GRABBING;
 
     // Wait Frame
@@ -277,13 +544,23 @@ Buffer* capture_grab(Capture* c) {
 
     ic->status = IDLE;
 
+    if (ic->convert != NULL) {
+        return convert_frame(ic, ic->cbuffer[buf.index]);
+    }
+
     return ic->cbuffer[buf.index];
 }
 
 int capture_release_buffer(Capture* c, Buffer* b) {
     ICapture* ic = (ICapture*) c;
 
-    int i = 0;
+    // Already given back when converted
+    int i;
+    for (i = 0; ic->converted != NULL && i < ic->nbuf; i++) {
+        if (ic->converted[i] == b) return 0;
+    }
+
+    i = 0;
     while (i < ic->nbuf && ic->cbuffer[i] != b) {
         i++;
     }
@@ -293,6 +570,8 @@ int capture_release_buffer(Capture* c, Buffer* b) {
         return -1;
     }
 
+    if (ic->test) return 0;
+
     // reQueue Buffer
     struct v4l2_buffer buf;
     memset(&buf, 0, sizeof (struct v4l2_buffer));
@@ -308,11 +587,32 @@ int capture_release_buffer(Capture* c, Buffer* b) {
     return 0;
 }
 
+static int set_parm(ICapture* ic, int fps) {
+    struct v4l2_streamparm parm;
+    memset(&parm, 0, sizeof (struct v4l2_streamparm));
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    parm.parm.capture.timeperframe.numerator = 1;
+    parm.parm.capture.timeperframe.denominator = fps;
+    if (-1 == xioctl(ic->fd, VIDIOC_S_PARM, &parm)) {
+        return -1;
+    }
+
+    // The driver takes the nearest rate it supports
+    if (parm.parm.capture.timeperframe.numerator > 0) {
+        ic->c.fps = parm.parm.capture.timeperframe.denominator / parm.parm.capture.timeperframe.numerator;
+    }
+    return 0;
+}
+
 int capture_stop(Capture* c) {
     ICapture* ic = (ICapture*) c;
 
     LOG_TRACE("Stop Capture");
     if (ic->status != IDLE) return -1;
+    if (ic->test) {
+        ic->status = INITIALIZED;
+        return 0;
+    }
     ic->status = STOPPING;
 
     struct v4l2_buffer buf;
@@ -321,6 +621,8 @@ int capture_stop(Capture* c) {
     buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     if (-1 == xioctl(ic->fd, VIDIOC_STREAMOFF, &buf.type)) {
         LOG_ERROR("Stop Capture");
+        // Still streaming
+        ic->status = IDLE;
         return -1;
     }
 
@@ -329,6 +631,87 @@ int capture_stop(Capture* c) {
     return 0;
 }
 
+// Changes the frame interval. Drivers that don't change it while
+// streaming (EBUSY) get the stream restarted.
+int capture_set_fps(Capture* c, int fps) {
+    ICapture* ic = (ICapture*) c;
+
+    LOG_TRACE("Set FPS %d", fps);
+    if (ic->status != IDLE || fps <= 0) return -1;
+    if (ic->test) {
+        ic->c.fps = fps;
+        return 0;
+    }
+
+    if (0 == set_parm(ic, fps)) return 0;
+    if (errno != EBUSY) {
+        LOG_ERROR("Setting Frame Rate");
+        return -1;
+    }
+
+    if (0 != capture_stop(c)) {
+        return -1;
+    }
+    int ret = 0;
+    if (0 != set_parm(ic, fps)) {
+        LOG_ERROR("Setting Frame Rate");
+        // Restart at the previous rate
+        ret = -1;
+    }
+
+    // STREAMOFF took back every buffer
+    struct v4l2_buffer buf;
+    int i;
+    for (i = 0; i < ic->nbuf; i++) {
+        memset(&buf, 0, sizeof (struct v4l2_buffer));
+        buf.index = i;
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        if (-1 == xioctl(ic->fd, VIDIOC_QBUF, &buf)) {
+            LOG_ERROR("Queue Buffer");
+            ret = -1;
+        }
+    }
+
+    // Streaming again whatever failed, with the buffers queued
+    if (0 != capture_start(c)) {
+        return -1;
+    }
+    return ret;
+}
+
+// Changes the size of the frames, the stream is restarted with new
+// driver buffers. Every buffer must have been released.
+int capture_set_size(Capture* c, int width, int height) {
+    ICapture* ic = (ICapture*) c;
+
+    LOG_TRACE("Set Size %dx%d", width, height);
+    if (ic->status != IDLE || width <= 0 || height <= 0) return -1;
+    int old_width = ic->c.width;
+    int old_height = ic->c.height;
+    ic->c.width = width;
+    ic->c.height = height;
+    if (ic->test) {
+        return test_pattern(ic);
+    }
+
+    if (0 != capture_stop(c) || 0 != unmap_buffers(ic)) {
+        return -1;
+    }
+
+    int ret = set_format(ic);
+    if (ret != 0) {
+        // Restart at the previous size
+        ic->c.width = old_width;
+        ic->c.height = old_height;
+    }
+
+    if (0 != map_buffers(ic) || 0 != capture_start(c)) {
+        return -1;
+    }
+    return ret;
+}
+
 int capture_destroy(Capture* c) {
     ICapture* ic = (ICapture*) c;
 
@@ -347,7 +730,7 @@ int capture_destroy(Capture* c) {
     if (ic->cbuffer != NULL) {
         for (i = 0; i < ic->nbuf; i++) {
             if (ic->cbuffer[i] != NULL) {
-                if (ic->cbuffer[i]->data != NULL) {
+                if (ic->cbuffer[i]->data != NULL && !ic->test) {
                     if (-1 == munmap(ic->cbuffer[i]->data, ic->cbuffer[i]->size)) {
                         LOG_ERROR("Unmap Buffer");
                         return -1;
@@ -366,6 +749,21 @@ int capture_destroy(Capture* c) {
         ic->cbuffer = NULL;
     }
 
+    if (ic->pattern != NULL) {
+        buffer_destroy(ic->pattern);
+        ic->pattern = NULL;
+    }
+
+    if (ic->converted != NULL) {
+        for (i = 0; i < ic->nbuf; i++) {
+            if (ic->converted[i] != NULL) {
+                buffer_destroy(ic->converted[i]);
+            }
+        }
+        free(ic->converted);
+        ic->converted = NULL;
+    }
+
     // Close Device
     LOG_TRACE("Close Device");
     if (ic->fd > 0) {
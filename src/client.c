@@ -0,0 +1,414 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "client.h"
+#include "log.h"
+
+#define READ_SIZE 1024
+
+Client* client_create(int fd) {
+    Client* c = calloc(1, sizeof (Client));
+    if (c == NULL) {
+        LOG_ERROR("Creating Client");
+        return NULL;
+    }
+
+    c->fd = fd;
+    c->protocol = CLIENT_TEXT;
+    c->progress = time(NULL);
+    c->output_fd = -1;
+    c->pending_fd = -1;
+    c->input = buffer_create();
+    c->output = buffer_create();
+    c->pending = buffer_create();
+    c->queued = buffer_create();
+    if (c->input == NULL || c->output == NULL || c->pending == NULL || c->queued == NULL) {
+        LOG_ERROR("Creating Client buffers");
+        c->fd = -1;
+        client_destroy(c);
+        return NULL;
+    }
+
+    // Slow clients must not block the server
+    if (0 > fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) {
+        LOG_ERROR("Configuring Client socket");
+        c->fd = -1;
+        client_destroy(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+int client_read(Client* c) {
+    if (0 > buffer_resize(c->input, c->input->used + READ_SIZE, 0)) {
+        LOG_ERROR("Error Resizing Client input");
+        return -1;
+    }
+
+    ssize_t r = read(c->fd, c->input->data + c->input->used, READ_SIZE);
+    if (r < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+            errno = 0;
+            return 0;
+        }
+        LOG_ERROR("Error reading from client");
+        return -1;
+    }
+
+    if (r == 0) {
+        c->eof = 1;
+    }
+
+    c->input->used += r;
+    return r;
+}
+
+int client_consume(Client* c, int n) {
+    if (n > c->input->used) n = c->input->used;
+    memmove(c->input->data, c->input->data + n, c->input->used - n);
+    c->input->used -= n;
+    return 0;
+}
+
+int client_idle(Client* c) {
+    return c->output->used == 0;
+}
+
+// Closing resets the connection, the peer gets an error rather than
+// the end of the data
+void client_reset(Client* c) {
+    struct linger l;
+    l.l_onoff = 1;
+    l.l_linger = 0;
+    if (0 != setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &l, sizeof (l))) {
+        LOG_WARN("Setting linger");
+        errno = 0;
+    }
+}
+
+// Sends without blocking, returns the bytes sent
+static ssize_t send_iov(Client* c, struct iovec* iov, int niov) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof (msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = niov;
+
+    ssize_t w = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+    if (w < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+            errno = 0;
+            return 0;
+        }
+        LOG_ERROR("Error sending to client");
+        return -1;
+    }
+
+    if (w > 0) {
+        c->progress = time(NULL);
+    }
+
+    return w;
+}
+
+static int append(Buffer* b, const uint8_t* data, uint32_t len) {
+    if (0 > buffer_resize(b, b->used + len, 0)) {
+        LOG_ERROR("Error Resizing Client output");
+        return -1;
+    }
+    memcpy(b->data + b->used, data, len);
+    b->used += len;
+    return 0;
+}
+
+// Writes directly when nothing is in flight, only what the socket
+// does not take is copied to the buffer
+static int queue(Client* c, Buffer* b, const uint8_t* header, int hlen, const Buffer* data) {
+    uint32_t dlen = data != NULL ? data->used : 0;
+    ssize_t w = 0;
+
+    if (client_idle(c)) {
+        struct iovec iov[2];
+        iov[0].iov_base = (void*) header;
+        iov[0].iov_len = header != NULL ? hlen : 0;
+        iov[1].iov_base = data != NULL ? data->data : NULL;
+        iov[1].iov_len = dlen;
+        w = send_iov(c, iov, 2);
+        if (w < 0) {
+            return -1;
+        }
+        c->progress = time(NULL);
+    }
+
+    b->used = 0;
+    if (w < hlen) {
+        if (0 > append(b, header + w, hlen - w)) return -1;
+        w = hlen;
+    }
+    if (w - hlen < dlen) {
+        if (0 > append(b, data->data + (w - hlen), dlen - (w - hlen))) return -1;
+    }
+
+    return 0;
+}
+
+int client_send(Client* c, const uint8_t* header, int hlen, const Buffer* data) {
+    if (!client_idle(c)) {
+        // Responses are never dropped
+        if (0 > append(c->output, header, hlen)) return -1;
+        if (data != NULL && 0 > append(c->output, data->data, data->used)) return -1;
+        return 0;
+    }
+
+    c->sent = 0;
+    return queue(c, c->output, header, hlen, data);
+}
+
+// Sends without blocking with the descriptor, returns the bytes sent.
+// The descriptor goes with the first byte, none when fd is -1.
+static ssize_t send_fd(Client* c, const uint8_t* data, int len, int fd) {
+    if (fd < 0) {
+        struct iovec iov;
+        iov.iov_base = (void*) data;
+        iov.iov_len = len;
+        return send_iov(c, &iov, 1);
+    }
+
+    union {
+        struct cmsghdr h;
+        char data[CMSG_SPACE(sizeof (int))];
+    } control;
+    memset(&control, 0, sizeof (control));
+
+    struct iovec iov;
+    iov.iov_base = (void*) data;
+    iov.iov_len = len;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data;
+    msg.msg_controllen = sizeof (control.data);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof (int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof (int));
+
+    ssize_t w = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+    if (w < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+            errno = 0;
+            return 0;
+        }
+        LOG_ERROR("Error sending descriptor to client");
+        return -1;
+    }
+
+    if (w > 0) {
+        c->progress = time(NULL);
+    }
+
+    return w;
+}
+
+// Keeps a copy of the descriptor until its header is sent, the caller
+// may close it meanwhile
+static int keep_fd(int* slot, int fd) {
+    if (*slot >= 0) {
+        close(*slot);
+    }
+    if (fd < 0) {
+        *slot = -1;
+        return 0;
+    }
+    *slot = dup(fd);
+    if (*slot < 0) {
+        LOG_ERROR("Error keeping descriptor for client");
+        return -1;
+    }
+    return 0;
+}
+
+// Queues a response behind the one in flight, with a copy of its
+// descriptor
+static int queue_fd(Client* c, const uint8_t* header, int hlen, int fd) {
+    int record[2] = {-1, hlen};
+    if (0 > keep_fd(&record[0], fd)) return -1;
+    if (0 > append(c->queued, (const uint8_t*) record, sizeof (record))
+            || 0 > append(c->queued, header, hlen)) {
+        if (record[0] >= 0) close(record[0]);
+        return -1;
+    }
+    return 0;
+}
+
+// Moves the first queued response to output, returns 0 when none
+static int dequeue_fd(Client* c) {
+    if (c->queued->used == 0) {
+        return 0;
+    }
+
+    int record[2];
+    memcpy(record, c->queued->data, sizeof (record));
+    if (0 > append(c->output, c->queued->data + sizeof (record), record[1])) return -1;
+    c->output_fd = record[0];
+
+    uint32_t n = sizeof (record) + record[1];
+    memmove(c->queued->data, c->queued->data + n, c->queued->used - n);
+    c->queued->used -= n;
+    return 1;
+}
+
+// The header goes at once when nothing is in flight, or waits with a
+// copy of the descriptor, -1 for none. Like client_push() only the
+// latest live one waits; the responses are never dropped and queue in
+// order.
+int client_send_fd(Client* c, const uint8_t* header, int hlen, int fd, int live) {
+    if (!client_idle(c)) {
+        if (!live) {
+            return queue_fd(c, header, hlen, fd);
+        }
+        if (c->pending->used > 0) {
+            c->drops++;
+            LOG_TRACE("Client %d drops a frame (%u)", c->fd, c->drops);
+        }
+        c->pending->used = 0;
+        if (0 > append(c->pending, header, hlen)) return -1;
+        return keep_fd(&c->pending_fd, fd);
+    }
+
+    ssize_t w = send_fd(c, header, hlen, fd);
+    if (w < 0) {
+        return -1;
+    }
+
+    c->sent = 0;
+    c->output->used = 0;
+    if (0 > append(c->output, header + w, hlen - w)) return -1;
+    // Not even the first byte, the descriptor waits with the header
+    return w == 0 ? keep_fd(&c->output_fd, fd) : 0;
+}
+
+int client_push(Client* c, const uint8_t* header, int hlen, const Buffer* data) {
+    if (client_idle(c)) {
+        c->sent = 0;
+        return queue(c, c->output, header, hlen, data);
+    }
+
+    // Only the latest live frame waits, the previous one is dropped
+    if (c->pending->used > 0) {
+        c->drops++;
+        LOG_TRACE("Client %d drops a frame (%u)", c->fd, c->drops);
+    }
+    c->pending->used = 0;
+    if (0 > append(c->pending, header, hlen)) return -1;
+    if (data != NULL && 0 > append(c->pending, data->data, data->used)) return -1;
+
+    return 0;
+}
+
+int client_flush(Client* c) {
+    while (!client_idle(c)) {
+        ssize_t w;
+        if (c->output_fd >= 0) {
+            w = send_fd(c, c->output->data + c->sent, c->output->used - c->sent, c->output_fd);
+        } else {
+            struct iovec iov;
+            iov.iov_base = c->output->data + c->sent;
+            iov.iov_len = c->output->used - c->sent;
+            w = send_iov(c, &iov, 1);
+        }
+        if (w < 0) {
+            return -1;
+        }
+        if (w == 0) {
+            return 0;
+        }
+        if (c->output_fd >= 0) {
+            close(c->output_fd);
+            c->output_fd = -1;
+        }
+
+        c->sent += w;
+        if (c->sent < c->output->used) {
+            return 0;
+        }
+
+        // In flight done, the queued responses and then the pending
+        // frame go next
+        c->sent = 0;
+        c->output->used = 0;
+        int r = dequeue_fd(c);
+        if (r < 0) {
+            return -1;
+        }
+        if (r > 0) {
+            continue;
+        }
+        Buffer* tmp = c->output;
+        c->output = c->pending;
+        c->pending = tmp;
+        c->output_fd = c->pending_fd;
+        c->pending_fd = -1;
+    }
+
+    return 0;
+}
+
+int client_destroy(Client* c) {
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+
+    if (c->input != NULL) {
+        buffer_destroy(c->input);
+        c->input = NULL;
+    }
+
+    if (c->output != NULL) {
+        buffer_destroy(c->output);
+        c->output = NULL;
+    }
+
+    if (c->pending != NULL) {
+        buffer_destroy(c->pending);
+        c->pending = NULL;
+    }
+
+    if (c->output_fd >= 0) {
+        close(c->output_fd);
+        c->output_fd = -1;
+    }
+
+    if (c->pending_fd >= 0) {
+        close(c->pending_fd);
+        c->pending_fd = -1;
+    }
+
+    if (c->queued != NULL) {
+        uint32_t i = 0;
+        while (i < c->queued->used) {
+            int record[2];
+            memcpy(record, c->queued->data + i, sizeof (record));
+            if (record[0] >= 0) {
+                close(record[0]);
+            }
+            i += sizeof (record) + record[1];
+        }
+        buffer_destroy(c->queued);
+        c->queued = NULL;
+    }
+
+    free(c);
+
+    return 0;
+}
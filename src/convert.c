@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <linux/videodev2.h>
+
+#include "convert.h"
+
+// One loop per format: the rows set the luma and chroma pointers of
+// each line, then Y0, Y1, U and V pick the bytes of every pixel pair.
+// The loops have no branches, so the compiler vectorizes them (-O3).
+#define CONVERTER(name, ROWS, Y0, Y1, U, V) \
+static void name(const uint8_t* restrict in, int stride, int width, int height, uint8_t* restrict out) { \
+    const uint8_t* chroma = in + stride * height; \
+    int row; \
+    for (row = 0; row < height; row++) { \
+        const uint8_t* py; \
+        const uint8_t* pu; \
+        const uint8_t* pv; \
+        ROWS; \
+        uint8_t* o = out + row * width * 2; \
+        int x; \
+        for (x = 0; x < width / 2; x++) { \
+            o[4 * x] = Y0; \
+            o[4 * x + 1] = U; \
+            o[4 * x + 2] = Y1; \
+            o[4 * x + 3] = V; \
+        } \
+        (void) chroma; (void) pu; (void) pv; \
+    } \
+}
+
+// Packed 4:2:2, offsets of Y, U and V in the macropixel
+#define PACKED(name, y, u, v) CONVERTER(name, \
+    py = in + row * stride; pu = py; pv = py, \
+    py[4 * x + y], py[4 * x + y + 2], pu[4 * x + u], pv[4 * x + v])
+
+// Semi-planar 4:2:0, a plane of interleaved chroma after the luma
+#define SEMIPLANAR(name, u, v) CONVERTER(name, \
+    py = in + row * stride; pu = chroma + row / 2 * stride; pv = pu, \
+    py[2 * x], py[2 * x + 1], pu[2 * x + u], pv[2 * x + v])
+
+// Planar 4:2:0, two chroma planes of half the stride
+#define PLANAR(name, first, second) CONVERTER(name, \
+    py = in + row * stride; \
+    const uint8_t* c1 = chroma + row / 2 * (stride / 2); \
+    const uint8_t* c2 = chroma + height / 2 * (stride / 2) + row / 2 * (stride / 2); \
+    pu = first; pv = second, \
+    py[2 * x], py[2 * x + 1], pu[x], pv[x])
+
+PACKED(convert_uyvy, 1, 0, 2)
+PACKED(convert_yvyu, 0, 3, 1)
+PACKED(convert_vyuy, 1, 2, 0)
+SEMIPLANAR(convert_nv12, 0, 1)
+SEMIPLANAR(convert_nv21, 1, 0)
+PLANAR(convert_yuv420, c1, c2)
+PLANAR(convert_yvu420, c2, c1)
+
+// Luma only, neutral chroma
+CONVERTER(convert_grey,
+    py = in + row * stride; pu = NULL; pv = NULL,
+    py[2 * x], py[2 * x + 1], 128, 128)
+
+typedef struct {
+    uint32_t fourcc;
+    ConvertFunc convert;
+    // Bytes per pixel of the luma lines
+    int bytes;
+    // Chroma lines of the luma stride after every two luma lines
+    int chroma;
+} ConvertFormat;
+
+// By preference: the encoders take YUYV as is, the other 4:2:2 formats
+// only move bytes, 4:2:0 repeats the chroma lines and grey has none
+static const ConvertFormat formats[] = {
+    {V4L2_PIX_FMT_YUYV, NULL, 2, 0},
+    {V4L2_PIX_FMT_UYVY, convert_uyvy, 2, 0},
+    {V4L2_PIX_FMT_YVYU, convert_yvyu, 2, 0},
+    {V4L2_PIX_FMT_VYUY, convert_vyuy, 2, 0},
+    {V4L2_PIX_FMT_NV12, convert_nv12, 1, 1},
+    {V4L2_PIX_FMT_NV21, convert_nv21, 1, 1},
+    {V4L2_PIX_FMT_YUV420, convert_yuv420, 1, 1},
+    {V4L2_PIX_FMT_YVU420, convert_yvu420, 1, 1},
+    {V4L2_PIX_FMT_GREY, convert_grey, 1, 0}
+};
+
+#define NFORMATS (sizeof (formats) / sizeof (formats[0]))
+
+int convert_rank(uint32_t fourcc) {
+    int i;
+    for (i = 0; i < NFORMATS; i++) {
+        if (formats[i].fourcc == fourcc) return i;
+    }
+    return -1;
+}
+
+ConvertFunc convert_find(uint32_t fourcc) {
+    int i = convert_rank(fourcc);
+    return i < 0 ? NULL : formats[i].convert;
+}
+
+int convert_stride(uint32_t fourcc, int width) {
+    int i = convert_rank(fourcc);
+    return i < 0 ? 0 : formats[i].bytes * width;
+}
+
+int convert_size(uint32_t fourcc, int stride, int height) {
+    int i = convert_rank(fourcc);
+    return i < 0 ? 0 : stride * height + formats[i].chroma * stride * ((height + 1) / 2);
+}
@@ -0,0 +1,39 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame.h"
+#include "log.h"
+
+Frame* frame_create() {
+    Frame* f = calloc(1, sizeof (Frame));
+    if (f == NULL) {
+        LOG_ERROR("Creating Frame");
+        return NULL;
+    }
+
+    f->jpeg = buffer_create();
+    f->raw = buffer_create();
+    if (f->jpeg == NULL || f->raw == NULL) {
+        LOG_ERROR("Creating Frame buffers");
+        frame_destroy(f);
+        return NULL;
+    }
+
+    return f;
+}
+
+int frame_destroy(Frame* f) {
+    if (f->jpeg != NULL) {
+        buffer_destroy(f->jpeg);
+        f->jpeg = NULL;
+    }
+
+    if (f->raw != NULL) {
+        buffer_destroy(f->raw);
+        f->raw = NULL;
+    }
+
+    free(f);
+
+    return 0;
+}
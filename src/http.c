@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http.h"
+#include "log.h"
+
+// Also true for the start of a request not fully received
+int http_is_request(const uint8_t* data, int len) {
+    return len > 0 && (memcmp(data, "GET ", len < 4 ? len : 4) == 0
+            || memcmp(data, "HEAD ", len < 5 ? len : 5) == 0);
+}
+
+// Value of a header line, NULL when missing
+const char* http_header(const char* request, const char* name, int* vlen) {
+    int nlen = strlen(name);
+    const char* p = strstr(request, "\r\n");
+    while (p != NULL && p[2] != '\r') {
+        p += 2;
+        if (strncasecmp(p, name, nlen) == 0 && p[nlen] == ':') {
+            const char* v = p + nlen + 1;
+            v += strspn(v, " \t");
+            const char* end = strstr(v, "\r\n");
+            while (end > v && (end[-1] == ' ' || end[-1] == '\t')) end--;
+            *vlen = end - v;
+            return v;
+        }
+        p = strstr(p, "\r\n");
+    }
+    return NULL;
+}
+
+// Comma separated list of tokens, like Connection
+static int has_token(const char* v, int vlen, const char* token) {
+    int tlen = strlen(token);
+    const char* end = v + vlen;
+    while (v < end) {
+        v += strspn(v, " \t,");
+        const char* next = memchr(v, ',', end - v);
+        if (next == NULL) next = end;
+        const char* e = next;
+        while (e > v && (e[-1] == ' ' || e[-1] == '\t')) e--;
+        if (e - v == tlen && strncasecmp(v, token, tlen) == 0) return 1;
+        v = next;
+    }
+    return 0;
+}
+
+// Returns the bytes of the request, 0 until it is fully received and
+// -1 when it is not valid
+int http_parse_request(const uint8_t* data, int len, HttpRequest* r) {
+    const uint8_t* end = NULL;
+    int i;
+    for (i = 0; i + 4 <= len && i + 4 <= HTTP_MAX_REQUEST; i++) {
+        if (memcmp(data + i, "\r\n\r\n", 4) == 0) {
+            end = data + i + 4;
+            break;
+        }
+    }
+    if (end == NULL) {
+        if (len > HTTP_MAX_REQUEST) {
+            LOG_WARN("HTTP request too long");
+            return -1;
+        }
+        return 0;
+    }
+
+    char request[HTTP_MAX_REQUEST + 1];
+    int rlen = end - data;
+    memcpy(request, data, rlen);
+    request[rlen] = '\0';
+
+    memset(r, 0, sizeof (HttpRequest));
+    int major, minor;
+    if (4 != sscanf(request, "%7s %63s HTTP/%d.%d", r->method, r->path, &major, &minor)) {
+        LOG_WARN("HTTP request line not valid");
+        return -1;
+    }
+
+    int vlen;
+    const char* v = http_header(request, "Connection", &vlen);
+    if (major == 1 && minor >= 1) {
+        r->keep_alive = (v == NULL || !has_token(v, vlen, "close"));
+    } else {
+        r->keep_alive = (v != NULL && has_token(v, vlen, "keep-alive"));
+    }
+
+    v = http_header(request, "Upgrade", &vlen);
+    r->upgrade = (v != NULL && vlen == 9 && strncasecmp(v, "websocket", 9) == 0);
+
+    v = http_header(request, "If-None-Match", &vlen);
+    if (v != NULL && vlen < sizeof (r->etag)) {
+        memcpy(r->etag, v, vlen);
+        r->etag[vlen] = '\0';
+    }
+
+    return rlen;
+}
+
+// If-None-Match is "*" or a list of quoted tags, weak ones included
+int http_etag_matches(const HttpRequest* r, const char* etag) {
+    if (strcmp(r->etag, "*") == 0) return 1;
+    int elen = strlen(etag);
+    const char* p = r->etag;
+    while ((p = strstr(p, etag)) != NULL) {
+        if (p[elen] == '\0' || p[elen] == ',' || p[elen] == ' ') return 1;
+        p += elen;
+    }
+    return 0;
+}
+
+// The body of 200 is a JPEG of length bytes
+int http_write_header(char* out, int size, int status, const char* etag, int length, int keep_alive) {
+    const char* reason;
+    switch (status) {
+        case 200: reason = "OK";
+            break;
+        case 304: reason = "Not Modified";
+            break;
+        case 404: reason = "Not Found";
+            break;
+        case 405: reason = "Method Not Allowed";
+            break;
+        case 503: reason = "Service Unavailable";
+            break;
+        default: reason = "Bad Request";
+    }
+
+    int n = snprintf(out, size, "HTTP/1.1 %d %s\r\n", status, reason);
+    if (status == 200) {
+        n += snprintf(out + n, size - n, "Content-Type: image/jpeg\r\n");
+    }
+    if (etag != NULL) {
+        // Revalidated on every request, the frame changes any time
+        n += snprintf(out + n, size - n, "ETag: %s\r\nCache-Control: no-cache\r\n", etag);
+    }
+    if (status != 304) {
+        n += snprintf(out + n, size - n, "Content-Length: %d\r\n", length);
+    }
+    n += snprintf(out + n, size - n, "Connection: %s\r\n\r\n", keep_alive ? "keep-alive" : "close");
+
+    if (n >= size) {
+        LOG_ERROR("HTTP header too long");
+        return -1;
+    }
+    return n;
+}
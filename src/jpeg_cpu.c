@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <jpeglib.h>
 #include <sys/time.h>
@@ -29,6 +30,10 @@ int jpeg_init(JPEGEncoder* encoder) {
     return 0;
 }
 
+int jpeg_resizable(const JPEGEncoder* encoder) {
+    return 1;
+}
+
 int jpeg_destroy_encoder(JPEGEncoder* encoder) {
     IJPEGEncoder* ctx = (IJPEGEncoder*)encoder;
     if (ctx->line != NULL) {
@@ -41,21 +46,39 @@ int jpeg_destroy_encoder(JPEGEncoder* encoder) {
     return 0;
 }
 
-static void transform_yuv422_to_yuv444_line(unsigned char* yuyv, unsigned char* yuv, int width) {
-    unsigned char y0, y1, u, v;
+// Rows of the planes given to libjpeg as raw data, the chroma of 4:2:0
+// is the average of two rows. No branches, vectorized (-O3).
+static void split_luma(const uint8_t* restrict yuyv, uint8_t* restrict y, int width) {
+    int x;
+    for (x = 0; x < width; x++) {
+        y[x] = yuyv[2 * x];
+    }
+}
+
+static void split_chroma(const uint8_t* restrict r0, const uint8_t* restrict r1,
+        uint8_t* restrict u, uint8_t* restrict v, int pairs) {
     int x;
-    for (x = 0; x < width / 2; x++) {
-        y0 = yuyv[4 * x + 0];
-        u = yuyv[4 * x + 1];
-        y1 = yuyv[4 * x + 2];
-        v = yuyv[4 * x + 3];
-
-        yuv[6 * x + 0] = y0;
-        yuv[6 * x + 1] = u;
-        yuv[6 * x + 2] = v;
-        yuv[6 * x + 3] = y1;
-        yuv[6 * x + 4] = u;
-        yuv[6 * x + 5] = v;
+    for (x = 0; x < pairs; x++) {
+        u[x] = (r0[4 * x + 1] + r1[4 * x + 1] + 1) >> 1;
+        v[x] = (r0[4 * x + 3] + r1[4 * x + 3] + 1) >> 1;
+    }
+}
+
+// Repeats the last sample up to the MCU border
+static void pad_row(uint8_t* row, int used, int size) {
+    memset(row + used, row[used - 1], size - used);
+}
+
+// Replaces the standard tables set by jpeg_set_defaults()
+static void set_huffman(j_compress_ptr cinfo, const JPEGHuffman* h) {
+    int i;
+    for (i = 0; i < 2; i++) {
+        JHUFF_TBL* dc = cinfo->dc_huff_tbl_ptrs[i];
+        JHUFF_TBL* ac = cinfo->ac_huff_tbl_ptrs[i];
+        memcpy(dc->bits + 1, h->dc[i].bits, 16);
+        memcpy(dc->huffval, h->dc[i].values, 256);
+        memcpy(ac->bits + 1, h->ac[i].bits, 16);
+        memcpy(ac->huffval, h->ac[i].values, 256);
     }
 }
 
@@ -94,13 +117,28 @@ void jpeg_custom_mem_dest(IJPEGEncoder* jctx, j_compress_ptr cinfo, jpeg_destina
 
 int jpeg_compress(JPEGEncoder* encoder) {
     IJPEGEncoder* jctx = (IJPEGEncoder*) encoder;
+    int stride = 2 * jctx->e.width;
     int width = jctx->e.width;
     int height = jctx->e.height;
     int quality = jctx->e.quality;
+    int gray = jctx->e.mode == JPEG_MODE_GRAY;
 
-    buffer_resize(jctx->line, 3 * width, 0);
-    unsigned char* linebuf = jctx->line->data;
     unsigned char* inbuf = jctx->e.input->data;
+    if (jctx->e.crop_width > 0 && jctx->e.crop_height > 0) {
+        // Only read the rows and columns inside the window
+        width = jctx->e.crop_width;
+        height = jctx->e.crop_height;
+        inbuf += stride * jctx->e.crop_y + 2 * jctx->e.crop_x;
+    }
+
+    // Luma rows of a MCU row: 16 in 4:2:0, 8 in 4:2:2 and gray. The
+    // planes are padded to whole MCUs, libjpeg doesn't pad raw data.
+    int v_samp = jctx->e.sampling == JPEG_SAMPLING_422 || gray ? 1 : 2;
+    int lines = v_samp * DCTSIZE;
+    int luma_width = (width + 15) & ~15;
+    int chroma_width = gray ? 0 : luma_width / 2;
+    buffer_resize(jctx->line, lines * luma_width + 2 * DCTSIZE * chroma_width, 0);
+    unsigned char* linebuf = jctx->line->data;
 
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
@@ -113,17 +151,65 @@ int jpeg_compress(JPEGEncoder* encoder) {
 
     cinfo.image_width = width;
     cinfo.image_height = height;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_YCbCr;
+    if (gray) {
+        // Only the luma, a single component
+        cinfo.input_components = 1;
+        cinfo.in_color_space = JCS_GRAYSCALE;
+    } else {
+        cinfo.input_components = 3;
+        cinfo.in_color_space = JCS_YCbCr;
+    }
 
     jpeg_set_defaults(&cinfo);
     jpeg_set_quality(&cinfo, quality, TRUE);
+    if (jctx->e.huffman != NULL) {
+        set_huffman(&cinfo, jctx->e.huffman);
+    }
+    // Planes already subsampled, no 4:4:4 rows to downsample again
+    cinfo.raw_data_in = TRUE;
+    if (!gray) {
+        cinfo.comp_info[0].h_samp_factor = 2;
+        cinfo.comp_info[0].v_samp_factor = v_samp;
+    }
+    if (jctx->e.progress != NULL) {
+        cinfo.restart_in_rows = 1;
+    }
 
     jpeg_start_compress(&cinfo, TRUE);
 
-    while (cinfo.next_scanline < cinfo.image_height) {
-        transform_yuv422_to_yuv444_line(inbuf + 2 * width * cinfo.next_scanline, linebuf, width);
-        jpeg_write_scanlines(&cinfo, &linebuf, 1);
+    JSAMPROW y_rows[2 * DCTSIZE], u_rows[DCTSIZE], v_rows[DCTSIZE];
+    JSAMPARRAY planes[3] = {y_rows, u_rows, v_rows};
+    int i;
+    for (i = 0; i < lines; i++) {
+        y_rows[i] = linebuf + i * luma_width;
+    }
+    for (i = 0; i < DCTSIZE; i++) {
+        u_rows[i] = linebuf + lines * luma_width + i * chroma_width;
+        v_rows[i] = u_rows[i] + DCTSIZE * chroma_width;
+    }
+
+    int pairs = (width + 1) / 2;
+    int row;
+    for (row = 0; row < height; row += lines) {
+        // The rows past the bottom repeat the last one
+        for (i = 0; i < lines; i++) {
+            int y = row + i < height ? row + i : height - 1;
+            split_luma(inbuf + stride * y, y_rows[i], width);
+            pad_row(y_rows[i], width, luma_width);
+        }
+        // Gray only has the luma plane
+        for (i = 0; !gray && i < DCTSIZE; i++) {
+            int y0 = row + i * v_samp < height ? row + i * v_samp : height - 1;
+            int y1 = y0 + v_samp - 1 < height ? y0 + v_samp - 1 : height - 1;
+            split_chroma(inbuf + stride * y0, inbuf + stride * y1, u_rows[i], v_rows[i], pairs);
+            pad_row(u_rows[i], pairs, chroma_width);
+            pad_row(v_rows[i], pairs, chroma_width);
+        }
+        jpeg_write_raw_data(&cinfo, planes, lines);
+
+        if (jctx->e.progress != NULL) {
+            jctx->e.progress(encoder, jctx->e.output->size - cinfo.dest->free_in_buffer);
+        }
     }
 
     jpeg_finish_compress(&cinfo);
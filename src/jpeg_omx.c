@@ -16,7 +16,12 @@ struct IJPEGEncoder {
 
     ILCLIENT_T* client;
     COMPONENT_T* component;
+    OMX_BUFFERHEADERTYPE* ibuf;
+    OMX_BUFFERHEADERTYPE* obuf;
     sem_t semaphore;
+    // Size of the input port
+    int width;
+    int height;
 };
 
 static void omx_buffer_fill_done(void* data, COMPONENT_T* comp) {
@@ -79,6 +84,8 @@ int jpeg_init(JPEGEncoder* encoder) {
         return -1;
     }
 
+    ctx->width = ctx->e.width;
+    ctx->height = ctx->e.height;
     def.format.image.nFrameWidth = ctx->e.width;
     def.format.image.nFrameHeight = ctx->e.height;
     def.format.image.eCompressionFormat = OMX_IMAGE_CodingUnused;
@@ -152,19 +159,28 @@ int jpeg_compress(JPEGEncoder* encoder) {
     Buffer* input = ctx->e.input;
     Buffer* output = ctx->e.output;
 
-    static OMX_BUFFERHEADERTYPE* ibuf = NULL;
-    static OMX_BUFFERHEADERTYPE* obuf = NULL;
-
     output->used = 0;
 
-    if (ibuf == NULL) {
-        ibuf = ilclient_get_input_buffer(ctx->component, 340, 1);
-        if (ibuf == NULL) {
+    if (ctx->e.crop_width > 0 || ctx->e.crop_height > 0) {
+        // The port size is fixed in jpeg_init()
+        LOG_ERROR("Crop window not supported");
+        return -1;
+    }
+
+    if (ctx->e.width != ctx->width || ctx->e.height != ctx->height) {
+        LOG_ERROR("Frame size %dx%d, the port is %dx%d", ctx->e.width, ctx->e.height, ctx->width, ctx->height);
+        return -1;
+    }
+
+    if (ctx->ibuf == NULL) {
+        ctx->ibuf = ilclient_get_input_buffer(ctx->component, 340, 1);
+        if (ctx->ibuf == NULL) {
             LOG_ERROR("Getting the input buffer");
             return -1;
         }
     }
 
+    OMX_BUFFERHEADERTYPE* ibuf = ctx->ibuf;
     ibuf->nFilledLen = input->used;
     if (ibuf->nFilledLen > ibuf->nAllocLen) {
         ibuf->nFilledLen = ibuf->nAllocLen;
@@ -178,15 +194,20 @@ int jpeg_compress(JPEGEncoder* encoder) {
     }
     
     tmp += i;
-    for (i = 0; i < ibuf->nFilledLen / 4; i++) {
-        // U
-        tmp[i] = input->data[i * 4 + 1];
-    }
-    
-    tmp += i;
-    for (i = 0; i < ibuf->nFilledLen / 4; i++) {
-        // V
-        tmp[i] = input->data[i * 4 + 3];
+    if (ctx->e.mode == JPEG_MODE_GRAY) {
+        // The encoder has no grayscale input, use neutral chroma
+        memset(tmp, 128, 2 * (ibuf->nFilledLen / 4));
+    } else {
+        for (i = 0; i < ibuf->nFilledLen / 4; i++) {
+            // U
+            tmp[i] = input->data[i * 4 + 1];
+        }
+
+        tmp += i;
+        for (i = 0; i < ibuf->nFilledLen / 4; i++) {
+            // V
+            tmp[i] = input->data[i * 4 + 3];
+        }
     }
 
     if (OMX_ErrorNone != OMX_EmptyThisBuffer(ILC_GET_HANDLE(ctx->component), ibuf)) {
@@ -195,14 +216,15 @@ int jpeg_compress(JPEGEncoder* encoder) {
     }
 
     do {
-        if (obuf == NULL) {
-            obuf = ilclient_get_output_buffer(ctx->component, 341, 1);
-            if (obuf == NULL) {
+        if (ctx->obuf == NULL) {
+            ctx->obuf = ilclient_get_output_buffer(ctx->component, 341, 1);
+            if (ctx->obuf == NULL) {
                 LOG_ERROR("Getting the output buffer");
                 return -1;
             }
         }
 
+        OMX_BUFFERHEADERTYPE* obuf = ctx->obuf;
         obuf->nFilledLen = 0;
 
         if (OMX_ErrorNone != OMX_FillThisBuffer(ILC_GET_HANDLE(ctx->component), obuf)) {
@@ -218,10 +240,15 @@ int jpeg_compress(JPEGEncoder* encoder) {
 
         LOG_TRACE("OBuffer size %d", obuf->nFilledLen);
         LOG_TRACE("OBuffer Flags %d", obuf->nFlags);
-    } while (obuf->nFilledLen == 81920);
+    } while (ctx->obuf->nFilledLen == 81920);
+
+    ctx->obuf->nFilledLen = 0;
 
-    obuf->nFilledLen = 0;
+    return 0;
+}
 
+// The size of the input port is set once, in jpeg_init()
+int jpeg_resizable(const JPEGEncoder* encoder) {
     return 0;
 }
 
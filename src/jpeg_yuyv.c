@@ -0,0 +1,786 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "log.h"
+#include "jpeg.h"
+
+// Baseline JPEG encoder for the YUYV frames of the capture. The 4:2:2
+// samples map directly to MCUs of two luma blocks and one block of
+// each chroma (H2V1), nothing is resampled. In 4:2:0 the MCUs have
+// four luma blocks (H2V2) and the chroma of the row pairs is averaged
+// while loading, a third less blocks to transform. The MCU is loaded a
+// row of 16 pixels per vector, split and level shifted with shuffles
+// and masks, and the integer DCT works on 8 columns at once with
+// vectors, like the slow-but-accurate libjpeg one. The zeros are found
+// with vector compares too. The Huffman tables are the standard ones,
+// unless the caller tunes them.
+
+// 8 lanes of 32 bits, NEON or SSE/AVX depending on the target
+typedef int32_t v8si __attribute__ ((vector_size(32)));
+
+#define CONST_BITS 13
+#define PASS1_BITS 2
+
+#define FIX_0_298631336 2446
+#define FIX_0_390180644 3196
+#define FIX_0_541196100 4433
+#define FIX_0_765366865 6270
+#define FIX_0_899976223 7373
+#define FIX_1_175875602 9633
+#define FIX_1_501321110 12299
+#define FIX_1_847759065 15137
+#define FIX_1_961570560 16069
+#define FIX_2_053119869 16819
+#define FIX_2_562915447 20995
+#define FIX_3_072711026 25172
+
+// Quantization by multiplying with the reciprocal
+#define RECIP_BITS 18
+
+// Worst case of an encoded block, with every byte stuffed
+#define MAX_BLOCK_BYTES 512
+
+typedef struct HuffTable HuffTable;
+
+struct HuffTable {
+    const uint8_t* bits;
+    const uint8_t* values;
+    uint16_t code[256];
+    uint8_t size[256];
+};
+
+typedef struct BitWriter BitWriter;
+
+struct BitWriter {
+    uint64_t acc;
+    int n;
+    uint8_t* out;
+};
+
+typedef struct IJPEGEncoder IJPEGEncoder;
+
+struct IJPEGEncoder {
+    JPEGEncoder e;
+    // Quality of the tables below
+    int quality;
+    // Zigzag order, as written in DQT
+    uint8_t qt[2][64];
+    // Reciprocals in the order of the DCT output, see dct_block()
+    v8si recip[2][8];
+    HuffTable dc[2];
+    HuffTable ac[2];
+    // The codes are of the caller's tables
+    int tuned;
+};
+
+static const uint8_t std_luma_qt[64] = {
+    16, 11, 10, 16, 24, 40, 51, 61,
+    12, 12, 14, 19, 26, 58, 60, 55,
+    14, 13, 16, 24, 40, 57, 69, 56,
+    14, 17, 22, 29, 51, 87, 80, 62,
+    18, 22, 37, 56, 68, 109, 103, 77,
+    24, 35, 55, 64, 81, 104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101,
+    72, 92, 95, 98, 112, 100, 103, 99
+};
+
+static const uint8_t std_chroma_qt[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99,
+    18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99,
+    47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99
+};
+
+// Natural index of each zigzag position
+static const uint8_t zigzag[64] = {
+    0, 1, 8, 16, 9, 2, 3, 10,
+    17, 24, 32, 25, 18, 11, 4, 5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+// Zigzag order of the transposed DCT output
+static const uint8_t zigzag_t[64] = {
+    0, 8, 1, 2, 9, 16, 24, 17,
+    10, 3, 4, 11, 18, 25, 32, 40,
+    33, 26, 19, 12, 5, 6, 13, 20,
+    27, 34, 41, 48, 56, 49, 42, 35,
+    28, 21, 14, 7, 15, 22, 29, 36,
+    43, 50, 57, 58, 51, 44, 37, 30,
+    23, 31, 38, 45, 52, 59, 60, 53,
+    46, 39, 47, 54, 61, 62, 55, 63
+};
+
+// Zigzag positions of the bits of each byte of a mask in the order of
+// the DCT output, see zigzag_mask()
+static uint64_t zigzag_bits[8][256];
+
+// Built by the first encoder, before the others run
+static void build_zigzag_bits() {
+    if (zigzag_bits[0][1] != 0) return;
+
+    int position[64];
+    int i;
+    for (i = 0; i < 64; i++) {
+        position[zigzag_t[i]] = i;
+    }
+
+    int byte, b;
+    for (byte = 0; byte < 8; byte++) {
+        for (b = 0; b < 256; b++) {
+            uint64_t bits = 0;
+            for (i = 0; i < 8; i++) {
+                if (b & (1 << i)) {
+                    bits |= (uint64_t) 1 << position[8 * byte + i];
+                }
+            }
+            zigzag_bits[byte][b] = bits;
+        }
+    }
+}
+
+static const uint8_t dc_luma_bits[16] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+static const uint8_t dc_chroma_bits[16] = {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+static const uint8_t dc_values[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+
+static const uint8_t ac_luma_bits[16] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+static const uint8_t ac_luma_values[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+static const uint8_t ac_chroma_bits[16] = {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+static const uint8_t ac_chroma_values[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+// Codes of every symbol, from the code lengths (JPEG Annex C)
+static void huff_build(HuffTable* h, const uint8_t* bits, const uint8_t* values) {
+    h->bits = bits;
+    h->values = values;
+    memset(h->size, 0, sizeof (h->size));
+
+    uint16_t code = 0;
+    int k = 0;
+    int len;
+    for (len = 1; len <= 16; len++) {
+        int i;
+        for (i = 0; i < bits[len - 1]; i++) {
+            h->code[values[k]] = code++;
+            h->size[values[k]] = len;
+            k++;
+        }
+        code <<= 1;
+    }
+}
+
+// Tables scaled like jpeg_set_quality() does
+static void build_tables(IJPEGEncoder* ctx) {
+    int quality = ctx->e.quality;
+    if (quality <= 0) quality = 1;
+    if (quality > 100) quality = 100;
+    int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+
+    int t;
+    for (t = 0; t < 2; t++) {
+        const uint8_t* base = t == 0 ? std_luma_qt : std_chroma_qt;
+        int i;
+        for (i = 0; i < 64; i++) {
+            int n = zigzag[i];
+            int q = (base[n] * scale + 50) / 100;
+            if (q < 1) q = 1;
+            if (q > 255) q = 255;
+            ctx->qt[t][i] = q;
+
+            // The DCT output is scaled by 8 and transposed
+            int divisor = q * 8;
+            ctx->recip[t][n % 8][n / 8] = ((1 << RECIP_BITS) + divisor / 2) / divisor;
+        }
+    }
+
+    ctx->quality = ctx->e.quality;
+}
+
+JPEGEncoder* jpeg_create_encoder() {
+    IJPEGEncoder* ctx;
+    // Aligned for the vectors of the tables
+    if (0 != posix_memalign((void**) &ctx, sizeof (v8si), sizeof (IJPEGEncoder))) {
+        LOG_ERROR("Creating JPEG encoder");
+        return NULL;
+    }
+    memset(ctx, 0, sizeof (IJPEGEncoder));
+    return (JPEGEncoder*) ctx;
+}
+
+static void standard_huffman(IJPEGEncoder* ctx) {
+    huff_build(&ctx->dc[0], dc_luma_bits, dc_values);
+    huff_build(&ctx->dc[1], dc_chroma_bits, dc_values);
+    huff_build(&ctx->ac[0], ac_luma_bits, ac_luma_values);
+    huff_build(&ctx->ac[1], ac_chroma_bits, ac_chroma_values);
+    ctx->tuned = 0;
+}
+
+// The caller's tables may change between frames, their codes are
+// built again for every one
+static void select_huffman(IJPEGEncoder* ctx) {
+    const JPEGHuffman* h = ctx->e.huffman;
+    if (h == NULL) {
+        if (ctx->tuned) {
+            standard_huffman(ctx);
+        }
+        return;
+    }
+
+    int i;
+    for (i = 0; i < 2; i++) {
+        huff_build(&ctx->dc[i], h->dc[i].bits, h->dc[i].values);
+        huff_build(&ctx->ac[i], h->ac[i].bits, h->ac[i].values);
+    }
+    ctx->tuned = 1;
+}
+
+int jpeg_init(JPEGEncoder* encoder) {
+    IJPEGEncoder* ctx = (IJPEGEncoder*) encoder;
+
+    standard_huffman(ctx);
+    build_tables(ctx);
+    build_zigzag_bits();
+
+    return 0;
+}
+
+int jpeg_resizable(const JPEGEncoder* encoder) {
+    return 1;
+}
+
+int jpeg_destroy_encoder(JPEGEncoder* encoder) {
+    free(encoder);
+    return 0;
+}
+
+// One dimensional DCT of 8 vectors, every lane is a column. The
+// first pass keeps PASS1_BITS more of precision, the second one
+// removes them, leaving the output scaled by 8.
+static inline void dct_pass(v8si* d, int first) {
+    v8si tmp0 = d[0] + d[7];
+    v8si tmp7 = d[0] - d[7];
+    v8si tmp1 = d[1] + d[6];
+    v8si tmp6 = d[1] - d[6];
+    v8si tmp2 = d[2] + d[5];
+    v8si tmp5 = d[2] - d[5];
+    v8si tmp3 = d[3] + d[4];
+    v8si tmp4 = d[3] - d[4];
+
+    int shift = first ? CONST_BITS - PASS1_BITS : CONST_BITS + PASS1_BITS;
+    int round = 1 << (shift - 1);
+
+    // Even part
+    v8si tmp10 = tmp0 + tmp3;
+    v8si tmp13 = tmp0 - tmp3;
+    v8si tmp11 = tmp1 + tmp2;
+    v8si tmp12 = tmp1 - tmp2;
+
+    if (first) {
+        d[0] = (tmp10 + tmp11) << PASS1_BITS;
+        d[4] = (tmp10 - tmp11) << PASS1_BITS;
+    } else {
+        d[0] = (tmp10 + tmp11 + (1 << (PASS1_BITS - 1))) >> PASS1_BITS;
+        d[4] = (tmp10 - tmp11 + (1 << (PASS1_BITS - 1))) >> PASS1_BITS;
+    }
+
+    v8si z1 = (tmp12 + tmp13) * FIX_0_541196100;
+    d[2] = (z1 + tmp13 * FIX_0_765366865 + round) >> shift;
+    d[6] = (z1 - tmp12 * FIX_1_847759065 + round) >> shift;
+
+    // Odd part
+    z1 = tmp4 + tmp7;
+    v8si z2 = tmp5 + tmp6;
+    v8si z3 = tmp4 + tmp6;
+    v8si z4 = tmp5 + tmp7;
+    v8si z5 = (z3 + z4) * FIX_1_175875602;
+
+    tmp4 = tmp4 * FIX_0_298631336;
+    tmp5 = tmp5 * FIX_2_053119869;
+    tmp6 = tmp6 * FIX_3_072711026;
+    tmp7 = tmp7 * FIX_1_501321110;
+    z1 = z1 * -FIX_0_899976223;
+    z2 = z2 * -FIX_2_562915447;
+    z3 = z3 * -FIX_1_961570560 + z5;
+    z4 = z4 * -FIX_0_390180644 + z5;
+
+    d[7] = (tmp4 + z1 + z3 + round) >> shift;
+    d[5] = (tmp5 + z2 + z4 + round) >> shift;
+    d[3] = (tmp6 + z2 + z3 + round) >> shift;
+    d[1] = (tmp7 + z1 + z4 + round) >> shift;
+}
+
+// Interleaves rows of 1, 2 and 4 lanes
+static inline void transpose(v8si* d) {
+    const v8si lo1 = {0, 8, 2, 10, 4, 12, 6, 14};
+    const v8si hi1 = {1, 9, 3, 11, 5, 13, 7, 15};
+    const v8si lo2 = {0, 1, 8, 9, 4, 5, 12, 13};
+    const v8si hi2 = {2, 3, 10, 11, 6, 7, 14, 15};
+    const v8si lo4 = {0, 1, 2, 3, 8, 9, 10, 11};
+    const v8si hi4 = {4, 5, 6, 7, 12, 13, 14, 15};
+    v8si t[8];
+    int i;
+    for (i = 0; i < 8; i += 2) {
+        t[i] = __builtin_shuffle(d[i], d[i + 1], lo1);
+        t[i + 1] = __builtin_shuffle(d[i], d[i + 1], hi1);
+    }
+    for (i = 0; i < 8; i += 4) {
+        d[i] = __builtin_shuffle(t[i], t[i + 2], lo2);
+        d[i + 1] = __builtin_shuffle(t[i + 1], t[i + 3], lo2);
+        d[i + 2] = __builtin_shuffle(t[i], t[i + 2], hi2);
+        d[i + 3] = __builtin_shuffle(t[i + 1], t[i + 3], hi2);
+    }
+    for (i = 0; i < 4; i++) {
+        t[i] = __builtin_shuffle(d[i], d[i + 4], lo4);
+        t[i + 4] = __builtin_shuffle(d[i], d[i + 4], hi4);
+    }
+    for (i = 0; i < 8; i++) {
+        d[i] = t[i];
+    }
+}
+
+// DCT and quantization of a level shifted block, d[row] holds the
+// columns in its lanes. The output is transposed: d[u][v] is the
+// coefficient of the vertical frequency v and horizontal frequency u.
+// Always inlined, so the block stays in registers after the load.
+static inline __attribute__ ((always_inline)) void dct_block(v8si* d, const v8si* recip) {
+    dct_pass(d, 1);
+    transpose(d);
+    dct_pass(d, 0);
+
+    int i;
+    for (i = 0; i < 8; i++) {
+        // Rounded to the nearest away from zero, like libjpeg
+        v8si sign = d[i] >> 31;
+        v8si a = (d[i] ^ sign) - sign;
+        a = (a * recip[i] + (1 << (RECIP_BITS - 1))) >> RECIP_BITS;
+        d[i] = (a ^ sign) - sign;
+    }
+}
+
+static inline void flush_word(BitWriter* w) {
+    w->n -= 32;
+    uint32_t word = (uint32_t) (w->acc >> w->n);
+    uint32_t inv = ~word;
+    if (((inv - 0x01010101) & ~inv & 0x80808080) == 0) {
+        // No 0xFF byte, the common case
+        w->out[0] = word >> 24;
+        w->out[1] = word >> 16;
+        w->out[2] = word >> 8;
+        w->out[3] = word;
+        w->out += 4;
+        return;
+    }
+
+    int i;
+    for (i = 24; i >= 0; i -= 8) {
+        uint8_t b = word >> i;
+        *w->out++ = b;
+        if (b == 0xFF) {
+            *w->out++ = 0;
+        }
+    }
+}
+
+// Up to 32 bits at once
+static inline void put_bits(BitWriter* w, uint32_t bits, int len) {
+    w->acc = (w->acc << len) | bits;
+    w->n += len;
+    if (w->n >= 32) {
+        flush_word(w);
+    }
+}
+
+// Pads the last byte with ones
+static void flush_bits(BitWriter* w) {
+    put_bits(w, 0x7F, 7);
+    while (w->n >= 8) {
+        w->n -= 8;
+        uint8_t b = w->acc >> w->n;
+        *w->out++ = b;
+        if (b == 0xFF) {
+            *w->out++ = 0;
+        }
+    }
+    w->n = 0;
+}
+
+static inline int bit_size(int32_t a) {
+    return a == 0 ? 0 : 32 - __builtin_clz(a);
+}
+
+// A bit for every non zero coefficient in zigzag order. The rows are
+// compared at once and their bits gathered in the lanes, then moved to
+// the zigzag order a byte at a time.
+static inline uint64_t zigzag_mask(const v8si* d) {
+    const v8si bit = {1, 2, 4, 8, 16, 32, 64, 128};
+    v8si lo = ((d[0] != 0) & bit) | ((d[1] != 0) & (bit << 8))
+            | ((d[2] != 0) & (bit << 16)) | ((d[3] != 0) & (bit << 24));
+    v8si hi = ((d[4] != 0) & bit) | ((d[5] != 0) & (bit << 8))
+            | ((d[6] != 0) & (bit << 16)) | ((d[7] != 0) & (bit << 24));
+
+    // Lanes 0 to 3 for the first rows, 4 to 7 for the last ones
+    const v8si first = {0, 1, 2, 3, 8, 9, 10, 11};
+    const v8si second = {4, 5, 6, 7, 12, 13, 14, 15};
+    const v8si pairs = {2, 3, 0, 1, 6, 7, 4, 5};
+    const v8si odd = {1, 0, 3, 2, 5, 4, 7, 6};
+    v8si m = __builtin_shuffle(lo, hi, first) | __builtin_shuffle(lo, hi, second);
+    m |= __builtin_shuffle(m, pairs);
+    m |= __builtin_shuffle(m, odd);
+    uint64_t natural = (uint32_t) m[0] | (uint64_t) (uint32_t) m[4] << 32;
+
+    uint64_t zigzag = 0;
+    int i;
+    for (i = 0; i < 8; i++) {
+        zigzag |= zigzag_bits[i][(natural >> (8 * i)) & 0xFF];
+    }
+    return zigzag;
+}
+
+static void encode_block(BitWriter* w, v8si* d, int* pred, const HuffTable* dc, const HuffTable* ac) {
+    const int32_t* coef = (const int32_t*) d;
+
+    // A bit for every non zero AC in zigzag order, the zeros are skipped
+    uint64_t nonzero = zigzag_mask(d) & ~(uint64_t) 1;
+    int i;
+
+    // The DC is coded as the difference with the previous block
+    int32_t diff = coef[0] - *pred;
+    *pred = coef[0];
+    int32_t a = diff < 0 ? -diff : diff;
+    int size = bit_size(a);
+    uint32_t extra = (diff < 0 ? diff - 1 : diff) & ((1 << size) - 1);
+    put_bits(w, ((uint32_t) dc->code[size] << size) | extra, dc->size[size] + size);
+
+    int last = 0;
+    while (nonzero != 0) {
+        i = __builtin_ctzll(nonzero);
+        nonzero &= nonzero - 1;
+        int run = i - last - 1;
+        last = i;
+
+        while (run > 15) {
+            put_bits(w, ac->code[0xF0], ac->size[0xF0]);
+            run -= 16;
+        }
+
+        int32_t v = coef[zigzag_t[i]];
+        a = v < 0 ? -v : v;
+        size = 32 - __builtin_clz(a);
+        extra = (v < 0 ? v - 1 : v) & ((1 << size) - 1);
+        int symbol = (run << 4) | size;
+        put_bits(w, ((uint32_t) ac->code[symbol] << size) | extra, ac->size[symbol] + size);
+    }
+
+    if (last < 63) {
+        // End of block
+        put_bits(w, ac->code[0], ac->size[0]);
+    }
+}
+
+// The 8 macropixels (Y0 U Y1 V) of a row of 16 pixels, little endian
+static inline void load_row(v8si* m, const uint8_t* yuyv) {
+    memcpy(m, yuyv, sizeof (v8si));
+}
+
+// Luma of a block, from a YUYV row of 16 pixels: 0 for the left half,
+// 1 for the right one
+static inline void load_luma(v8si* d, const uint8_t* yuyv, int stride, int half) {
+    const v8si left = {0, 8, 1, 9, 2, 10, 3, 11};
+    const v8si right = {4, 12, 5, 13, 6, 14, 7, 15};
+    int y;
+    for (y = 0; y < 8; y++) {
+        v8si m;
+        load_row(&m, yuyv + y * stride);
+        v8si y0 = m & 0xFF;
+        v8si y1 = (m >> 16) & 0xFF;
+        d[y] = (half ? __builtin_shuffle(y0, y1, right) : __builtin_shuffle(y0, y1, left)) - 128;
+    }
+}
+
+// Chroma of a block, from a YUYV row of 16 pixels: 8 for U, 24 for V
+static inline void load_chroma(v8si* d, const uint8_t* yuyv, int stride, int shift) {
+    int y;
+    for (y = 0; y < 8; y++) {
+        v8si m;
+        load_row(&m, yuyv + y * stride);
+        d[y] = ((m >> shift) & 0xFF) - 128;
+    }
+}
+
+// Chroma of a 4:2:0 block, averaging two YUYV rows of 16 pixels
+static inline void load_chroma_420(v8si* d, const uint8_t* yuyv, int stride, int shift) {
+    int y;
+    for (y = 0; y < 8; y++) {
+        v8si m0, m1;
+        load_row(&m0, yuyv + 2 * y * stride);
+        load_row(&m1, yuyv + (2 * y + 1) * stride);
+        d[y] = ((((m0 >> shift) & 0xFF) + ((m1 >> shift) & 0xFF) + 1) >> 1) - 128;
+    }
+}
+
+// Copies a partial MCU repeating the last row and pixel pair
+static const uint8_t* pad_mcu(uint8_t* pad, int pad_stride, const uint8_t* src, int stride,
+        int width, int height, int rows) {
+    int pairs = (width + 1) / 2;
+    int y, x;
+    for (y = 0; y < rows; y++) {
+        const uint8_t* row = src + (y < height ? y : height - 1) * stride;
+        uint8_t* out = pad + y * pad_stride;
+        memcpy(out, row, 4 * pairs);
+        for (x = pairs; x < pad_stride / 4; x++) {
+            memcpy(out + 4 * x, row + 4 * (pairs - 1), 4);
+        }
+    }
+    return pad;
+}
+
+static int write_u16(uint8_t* out, int v) {
+    out[0] = v >> 8;
+    out[1] = v;
+    return 2;
+}
+
+static int write_dht(uint8_t* out, int class_id, const HuffTable* h) {
+    int count = 0;
+    int i;
+    for (i = 0; i < 16; i++) {
+        count += h->bits[i];
+    }
+
+    int n = 0;
+    out[n++] = class_id;
+    memcpy(out + n, h->bits, 16);
+    n += 16;
+    memcpy(out + n, h->values, count);
+    return n + count;
+}
+
+static int write_headers(IJPEGEncoder* ctx, uint8_t* out, int width, int height, int gray, int v_samp, int restart) {
+    int ncomp = gray ? 1 : 3;
+    int ntables = gray ? 1 : 2;
+    int n = 0;
+    int i;
+
+    // SOI and JFIF 1.1, no density
+    static const uint8_t jfif[] = {
+        0xFF, 0xD8, 0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x00,
+        0x00, 0x01, 0x00, 0x01, 0x00, 0x00
+    };
+    memcpy(out, jfif, sizeof (jfif));
+    n += sizeof (jfif);
+
+    out[n++] = 0xFF;
+    out[n++] = 0xDB;
+    n += write_u16(out + n, 2 + 65 * ntables);
+    for (i = 0; i < ntables; i++) {
+        out[n++] = i;
+        memcpy(out + n, ctx->qt[i], 64);
+        n += 64;
+    }
+
+    out[n++] = 0xFF;
+    out[n++] = 0xC0;
+    n += write_u16(out + n, 8 + 3 * ncomp);
+    out[n++] = 8;
+    n += write_u16(out + n, height);
+    n += write_u16(out + n, width);
+    out[n++] = ncomp;
+    for (i = 0; i < ncomp; i++) {
+        out[n++] = i + 1;
+        // Luma H2V1 or H2V2 with the chroma, H1V1 alone
+        out[n++] = i > 0 || gray ? 0x11 : 0x20 | v_samp;
+        out[n++] = i > 0 ? 1 : 0;
+    }
+
+    out[n++] = 0xFF;
+    out[n++] = 0xC4;
+    int len = n;
+    n += 2;
+    for (i = 0; i < ntables; i++) {
+        n += write_dht(out + n, 0x00 | i, &ctx->dc[i]);
+        n += write_dht(out + n, 0x10 | i, &ctx->ac[i]);
+    }
+    write_u16(out + len, n - len);
+
+    if (restart > 0) {
+        out[n++] = 0xFF;
+        out[n++] = 0xDD;
+        n += write_u16(out + n, 4);
+        n += write_u16(out + n, restart);
+    }
+
+    out[n++] = 0xFF;
+    out[n++] = 0xDA;
+    n += write_u16(out + n, 6 + 2 * ncomp);
+    out[n++] = ncomp;
+    for (i = 0; i < ncomp; i++) {
+        out[n++] = i + 1;
+        out[n++] = i > 0 ? 0x11 : 0x00;
+    }
+    // Spectral selection and approximation of baseline
+    out[n++] = 0;
+    out[n++] = 63;
+    out[n++] = 0;
+
+    return n;
+}
+
+int jpeg_compress(JPEGEncoder* encoder) {
+    IJPEGEncoder* ctx = (IJPEGEncoder*) encoder;
+    int stride = 2 * ctx->e.width;
+    int width = ctx->e.width;
+    int height = ctx->e.height;
+    int gray = ctx->e.mode == JPEG_MODE_GRAY;
+
+    if (ctx->quality != ctx->e.quality) {
+        build_tables(ctx);
+    }
+    select_huffman(ctx);
+
+    const uint8_t* inbuf = ctx->e.input->data;
+    if (ctx->e.crop_width > 0 && ctx->e.crop_height > 0) {
+        width = ctx->e.crop_width;
+        height = ctx->e.crop_height;
+        inbuf += stride * ctx->e.crop_y + 2 * ctx->e.crop_x;
+    }
+
+    // MCUs of 16x8 pixels in 4:2:2, 16x16 in 4:2:0, 8x8 in grayscale
+    int v_samp = !gray && ctx->e.sampling == JPEG_SAMPLING_420 ? 2 : 1;
+    int mcu_width = gray ? 8 : 16;
+    int mcu_height = 8 * v_samp;
+    int mcus = (width + mcu_width - 1) / mcu_width;
+    int rows = (height + mcu_height - 1) / mcu_height;
+    int blocks = gray ? 1 : 2 * v_samp + 2;
+
+    Buffer* out = ctx->e.output;
+    if (0 > buffer_resize(out, 1024 + mcus * blocks * MAX_BLOCK_BYTES, 0)) {
+        LOG_ERROR("Error resizing JPEG output");
+        return -1;
+    }
+    // Restart markers between the MCU rows when they are reported
+    int restart = ctx->e.progress != NULL;
+    out->used = write_headers(ctx, out->data, width, height, gray, v_samp, restart ? mcus : 0);
+
+    uint8_t pad[16 * 32];
+    v8si d[8] __attribute__ ((aligned(32)));
+    int pred[3] = {0, 0, 0};
+    BitWriter w;
+    w.acc = 0;
+    w.n = 0;
+
+    int row;
+    for (row = 0; row < rows; row++) {
+        // Room for a row of MCUs in the worst case
+        uint32_t need = out->used + mcus * blocks * MAX_BLOCK_BYTES + 16;
+        if (need > out->size && 0 > buffer_resize(out, need * 2, 0)) {
+            LOG_ERROR("Error resizing JPEG output");
+            return -1;
+        }
+        w.out = out->data + out->used;
+
+        int mcu;
+        for (mcu = 0; mcu < mcus; mcu++) {
+            const uint8_t* src = inbuf + row * mcu_height * stride + mcu * mcu_width * 2;
+            int src_stride = stride;
+            int w_left = width - mcu * mcu_width;
+            int h_left = height - row * mcu_height;
+            // The rows are loaded 16 pixels wide, also the gray ones
+            if (w_left < 16 || h_left < mcu_height) {
+                src = pad_mcu(pad, 32, src, stride, w_left < 16 ? w_left : 16,
+                        h_left < mcu_height ? h_left : mcu_height, mcu_height);
+                src_stride = 32;
+            }
+
+            load_luma(d, src, src_stride, 0);
+            dct_block(d, ctx->recip[0]);
+            encode_block(&w, d, &pred[0], &ctx->dc[0], &ctx->ac[0]);
+            if (gray) continue;
+
+            load_luma(d, src, src_stride, 1);
+            dct_block(d, ctx->recip[0]);
+            encode_block(&w, d, &pred[0], &ctx->dc[0], &ctx->ac[0]);
+
+            if (v_samp == 2) {
+                const uint8_t* bottom = src + 8 * src_stride;
+                load_luma(d, bottom, src_stride, 0);
+                dct_block(d, ctx->recip[0]);
+                encode_block(&w, d, &pred[0], &ctx->dc[0], &ctx->ac[0]);
+
+                load_luma(d, bottom, src_stride, 1);
+                dct_block(d, ctx->recip[0]);
+                encode_block(&w, d, &pred[0], &ctx->dc[0], &ctx->ac[0]);
+
+                load_chroma_420(d, src, src_stride, 8);
+                dct_block(d, ctx->recip[1]);
+                encode_block(&w, d, &pred[1], &ctx->dc[1], &ctx->ac[1]);
+
+                load_chroma_420(d, src, src_stride, 24);
+                dct_block(d, ctx->recip[1]);
+                encode_block(&w, d, &pred[2], &ctx->dc[1], &ctx->ac[1]);
+                continue;
+            }
+
+            load_chroma(d, src, src_stride, 8);
+            dct_block(d, ctx->recip[1]);
+            encode_block(&w, d, &pred[1], &ctx->dc[1], &ctx->ac[1]);
+
+            load_chroma(d, src, src_stride, 24);
+            dct_block(d, ctx->recip[1]);
+            encode_block(&w, d, &pred[2], &ctx->dc[1], &ctx->ac[1]);
+        }
+
+        if (restart && row < rows - 1) {
+            flush_bits(&w);
+            *w.out++ = 0xFF;
+            *w.out++ = 0xD0 + (row & 7);
+            pred[0] = pred[1] = pred[2] = 0;
+        }
+
+        out->used = w.out - out->data;
+        if (restart) {
+            ctx->e.progress(encoder, out->used);
+        }
+    }
+
+    w.out = out->data + out->used;
+    flush_bits(&w);
+    *w.out++ = 0xFF;
+    *w.out++ = 0xD9;
+    out->used = w.out - out->data;
+
+    return 0;
+}
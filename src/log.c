@@ -173,7 +173,7 @@ static int makeMessage(const char* format, va_list vargs) {
         va_copy(tmpargs, vargs);
 
         /* Try to print in the allocated space */
-        n = vsnprintf(logger.strbuf, logger.strbuflen, format, vargs);
+        n = vsnprintf(logger.strbuf, logger.strbuflen, format, tmpargs);
 
         va_end(tmpargs);
 
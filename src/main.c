@@ -1,95 +1,2127 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 #include <string.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <time.h>
+#include <getopt.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
 
 #include "buffer.h"
 #include "capture.h"
+#include "client.h"
+#include "frame.h"
 #include "jpeg.h"
 #include "log.h"
+#include "memfd.h"
+#include "multicast.h"
+#include "protocol.h"
+#include "recorder.h"
+#include "ring.h"
+#include "shm.h"
+#include "trace.h"
+#include "transform.h"
+#include "variant.h"
+#include "websocket.h"
+#include "http.h"
+
+// Variants kept for the current frame
+#define VARIANT_CACHE_SIZE 8
+
+// Connections served at the same time
+#define MAX_CLIENTS 32
+
+// Seconds a client may not take any byte before being closed
+#define STALL_TIMEOUT 10
+
+// Listeners and producer notifications before the clients in the poll
+#define FIXED_FDS 3
+
+// Bytes of a frame being compressed that wake up the server
+#define STREAM_CHUNK 4096
+
+// Seconds between changes of the camera rate
+#define RATE_PERIOD 2
+
+// Seconds the encoders keep the raw frames after a request for a
+// variant compressed from them
+#define RAW_KEEP 10
+
+// Encoder threads (-e)
+#define MAX_WORKERS 8
+
+// Frames of a burst request (c)
+#define MAX_BURST 100
+
+// Burst frames kept until the server sends them, it may fall behind
+// the encoders by a few frames. Past that the encoders wait for it.
+#define BURST_SLOTS 16
+
+// Change of the frame sizes, in percent, that tunes the Huffman tables
+// again before the period (-H)
+#define HUFFMAN_SCENE_CHANGE 25
+
+// Biggest capture size asked to the driver, it takes the nearest one
+#define MAX_WIDTH 16000
+#define MAX_HEIGHT 12000
+
+// Milliseconds a published frame is still the HTTP snapshot, polling
+// clients revalidate it without a new capture
+#define SNAPSHOT_MAX_AGE 1000
+
+// Frame being compressed for the waiting clients
+typedef enum {
+    STREAM_IDLE,
+    STREAM_COMPRESSING,
+    // Compressed, until the server sends the last bytes
+    STREAM_DONE
+} StreamState;
+
+typedef struct Worker Worker;
 
 typedef struct MainContext {
     Capture* cctx;
     JPEGEncoder *jctx;
+    JPEGEncoder *vctx;
     int exit;
-    int client;
-    sem_t full;
-    sem_t empty;
+    time_t last;
+    // Last request for a variant compressed from the raw frame
+    time_t raw_wanted;
+    // In the ETags, so they don't match the frames of another run
+    time_t started;
+    JPEGTransform transform;
+
+    // Producer sync
+    pthread_mutex_t mutex;
+    pthread_cond_t demand_cond;
+    int wanted;
+    int failed;
+    // WebSocket viewers, they keep the producer running
+    int watchers;
+    // Frames requested since rate_time, for the camera rate
+    uint32_t requests;
+    // Capture size asked by a client, 0 when none. The producer sets
+    // it once the frames in flight are published.
+    int resize_width;
+    int resize_height;
+
+    Client* clients[MAX_CLIENTS];
+    int nclients;
+    int stall_timeout;
+    Buffer* stats_buffer;
+
+    // Encoders filling the frames, last frame published and frame being
+    // served. The encoders publish in sequence order.
+    Worker* workers;
+    int nworkers;
+    int inflight;
+    pthread_cond_t free_cond;
+    pthread_cond_t turn_cond;
+    uint32_t published;
+    uint32_t seq;
+    Frame* ready;
+    Frame* frame;
+    VariantCache* variants;
+
+    Recorder* recorder;
+    Buffer* record_buffer;
+
+    // Pre-event frames, the producer notifies each one
+    Ring* ring;
+    Buffer* ring_buffer;
+    int notify[2];
+
+    Multicast* multicast;
+    Shm* shm;
+
+    // Camera rate from the demand, between low_fps and max_fps, off
+    // with low_fps 0. Only the producer changes it.
+    int low_fps;
+    int max_fps;
+    time_t rate_time;
+    // The producer changes the rate without the mutex
+    int rate_changing;
+
+    // Sealed copy of the last frame sent to the local clients
+    int memfd;
+    const Buffer* memfd_data;
+    uint32_t memfd_seq;
+
+    // Trace file, dumped on SIGUSR1 and at exit
+    char* trace;
+
+    // Huffman tables tuned to the scene every huffman_period seconds,
+    // off with 0. One encoder at a time counts them from a copy of the
+    // frame it published, generation 0 are the standard ones.
+    int huffman_period;
+    JPEGHuffman huffman;
+    uint32_t huffman_generation;
+    time_t huffman_time;
+    // Size of the first frame with the tables, for the scene changes
+    uint32_t huffman_size;
+    int huffman_tuning;
+    Buffer* huffman_sample;
+
+    // Copy of the frame being compressed, row by row, for the text
+    // clients waiting for a frame. Another frame is only streamed
+    // once the server sent the last bytes of this one.
+    Buffer* stream;
+    uint32_t stream_seq;
+    StreamState stream_state;
+    uint32_t stream_notified;
+    // The compression failed after the first rows
+    int stream_failed;
+    // Clients waiting for a frame, and the text ones among them
+    int waiters;
+    int streamers;
+
+    // Clients in a burst. The encoders copy the frames up to burst_last
+    // to the slot of their sequence, the server sends them from there.
+    // A slot is only copied again once every client got its frame, up
+    // to burst_sent.
+    int bursts;
+    uint32_t burst_last;
+    uint32_t burst_sent;
+    pthread_cond_t burst_cond;
+    Frame* burst_frames[BURST_SLOTS];
+    // Rotation of the frame being sent
+    Buffer* burst_buffer;
+} MainContext;
+
+// Encoder thread, the producer hands it the frames grabbed
+struct Worker {
+    MainContext* mctx;
+    int index;
+    pthread_t thread;
+    JPEGEncoder* jctx;
+    // Frame being compressed, swapped with the published one
+    Frame* next;
+    // Grabbed frame to compress, NULL while free
+    Buffer* input;
+    pthread_cond_t cond;
+    // Copy of the tuned Huffman tables, the encoder reads them
+    JPEGHuffman huffman;
+    uint32_t huffman_generation;
+};
+
+static volatile sig_atomic_t dump_trace = 0;
+
+void request_trace_dump(int sig) {
+    dump_trace = 1;
+}
+
+// Every frame is used, at the full rate of the camera
+int every_frame(MainContext * mctx) {
+    return mctx->recorder != NULL || mctx->ring != NULL || mctx->multicast != NULL || mctx->shm != NULL
+            || mctx->watchers > 0 || mctx->bursts > 0;
+}
+
+// Frames are taken all the time, not only on demand
+int continuous(MainContext * mctx) {
+    return every_frame(mctx) || mctx->waiters > 0;
+}
+
+void swap_buffers(MainContext * mctx) {
+    Frame* tmp;
+
+    tmp = mctx->ready;
+    mctx->ready = mctx->frame;
+    mctx->frame = tmp;
+
+    // The variants belong to the previous frame
+    variant_cache_clear(mctx->variants);
+}
+
+// The producer already encodes the full frame in this mode
+int produced_variant(MainContext * mctx, const Variant* v) {
+    return mctx->jctx->mode == v->mode && v->width == 0 && v->height == 0
+            && v->transform == JPEG_TRANSFORM_NONE && v->quality == 0;
+}
+
+// Another mode or a window is compressed again from the raw frame,
+// the transforms and qualities work on an encoded frame
+int raw_variant(MainContext * mctx, const Variant* v) {
+    return mctx->jctx->mode != v->mode || v->width != 0 || v->height != 0;
+}
+
+// Window within a frame of that size
+int check_crop(const Variant* v, int width, int height) {
+    // Aligned to MCUs, the last ones can end on the frame border
+    if (v->x < 0 || v->y < 0 || v->width <= 0 || v->height <= 0
+            || v->x + v->width > width || v->y + v->height > height) {
+        LOG_WARN("Crop window out of the frame");
+        return -1;
+    }
+
+    if (v->x % JPEG_MCU_SIZE != 0 || v->y % JPEG_MCU_SIZE != 0
+            || (v->width % JPEG_MCU_SIZE != 0 && v->x + v->width != width)
+            || (v->height % JPEG_MCU_SIZE != 0 && v->y + v->height != height)) {
+        LOG_WARN("Crop window not aligned to %d pixels", JPEG_MCU_SIZE);
+        return -1;
+    }
+
+    return 0;
+}
+
+Buffer* encode_variant(MainContext * mctx, const Variant* v) {
+    if (produced_variant(mctx, v)) {
+        return mctx->frame->jpeg;
+    }
+
+    Frame* f = mctx->frame;
+    if (raw_variant(mctx, v) && f->raw->used == 0) {
+        LOG_WARN("Raw frame %u not kept", f->seq);
+        return NULL;
+    }
+    // The capture size may have changed since the window was checked
+    if (v->width != 0 && 0 != check_crop(v, f->width, f->height)) {
+        return NULL;
+    }
+
+    Buffer* out = variant_cache_get(mctx->variants, v);
+    if (out != NULL) {
+        return out;
+    }
+
+    struct timeval t;
+    if (v->quality != 0) {
+        // Requantize the same variant at full quality, both are cached
+        Variant base = *v;
+        base.quality = 0;
+        Buffer* in = encode_variant(mctx, &base);
+        if (in == NULL) {
+            return NULL;
+        }
+
+        LOG_TRACE("JPEG Requantize variant");
+        gettimeofday(&t, NULL);
+        uint64_t start = trace_now();
+        out = variant_cache_put(mctx->variants, v);
+        if (0 != jpeg_requantize(in, out, v->quality)) {
+            LOG_ERROR("Error requantizing variant");
+            variant_cache_clear(mctx->variants);
+            return NULL;
+        }
+        LOG_INFO_TIME(&t, "JPEG Requantize variant");
+        trace_span("Requantize variant", mctx->frame->seq, start);
+
+        return out;
+    }
+
+    if (v->transform != JPEG_TRANSFORM_NONE) {
+        // Transform the encoded frame, both are kept in the cache
+        Variant base = *v;
+        base.transform = JPEG_TRANSFORM_NONE;
+        Buffer* in = encode_variant(mctx, &base);
+        if (in == NULL) {
+            return NULL;
+        }
+
+        LOG_TRACE("JPEG Transform variant");
+        gettimeofday(&t, NULL);
+        uint64_t start = trace_now();
+        out = variant_cache_put(mctx->variants, v);
+        if (0 != jpeg_transform(in, out, v->transform)) {
+            LOG_ERROR("Error transforming variant");
+            variant_cache_clear(mctx->variants);
+            return NULL;
+        }
+        LOG_INFO_TIME(&t, "JPEG Transform variant");
+        trace_span("Transform variant", mctx->frame->seq, start);
+
+        return out;
+    }
+
+    LOG_TRACE("JPEG Compress variant");
+    gettimeofday(&t, NULL);
+    uint64_t start = trace_now();
+    out = variant_cache_put(mctx->variants, v);
+    mctx->vctx->width = f->width;
+    mctx->vctx->height = f->height;
+    mctx->vctx->mode = v->mode;
+    mctx->vctx->crop_x = v->x;
+    mctx->vctx->crop_y = v->y;
+    mctx->vctx->crop_width = v->width;
+    mctx->vctx->crop_height = v->height;
+    mctx->vctx->input = mctx->frame->raw;
+    mctx->vctx->output = out;
+    if (0 != jpeg_compress(mctx->vctx)) {
+        LOG_ERROR("Error compressing variant");
+        variant_cache_clear(mctx->variants);
+        return NULL;
+    }
+    LOG_INFO_TIME(&t, "JPEG Compress variant");
+    trace_span("Compress variant", mctx->frame->seq, start);
+
+    return out;
+}
+
+// Wakes up the server, for the streaming and waiting clients
+void notify_server(MainContext * mctx) {
+    if (1 != write(mctx->notify[1], "", 1)) {
+        // Full pipe, the server is already notified
+        errno = 0;
+    }
+}
+
+// Copies the rows compressed so far for the waiting clients, every
+// STREAM_CHUNK bytes the server is woken up to send them
+void stream_progress(JPEGEncoder* e, uint32_t bytes) {
+    MainContext * mctx = (MainContext *) e->progress_arg;
+
+    pthread_mutex_lock(&mctx->mutex);
+    Buffer* s = mctx->stream;
+    int wake = bytes >= mctx->stream_notified + STREAM_CHUNK;
+    if (bytes > s->used) {
+        if (0 > buffer_resize(s, bytes, 0)) {
+            LOG_ERROR("Error resizing stream buffer");
+        } else {
+            memcpy(s->data + s->used, e->output->data + s->used, bytes - s->used);
+            s->used = bytes;
+        }
+    }
+    if (wake) {
+        mctx->stream_notified = s->used;
+    }
+    pthread_mutex_unlock(&mctx->mutex);
+
+    if (wake) {
+        notify_server(mctx);
+    }
+}
+
+// Takes the last published frame without waiting
+Frame* latest_frame(MainContext * mctx) {
+    pthread_mutex_lock(&mctx->mutex);
+    if (mctx->ready->seq > mctx->frame->seq) {
+        swap_buffers(mctx);
+    }
+    pthread_mutex_unlock(&mctx->mutex);
+
+    return mctx->frame;
+}
+
+// Before the first frame only the encoder can check the window
+int request_crop(MainContext * mctx, const Variant* v) {
+    Frame* f = latest_frame(mctx);
+    if (f->seq == 0) {
+        return 0;
+    }
+    return check_crop(v, f->width, f->height);
+}
+
+// Within the size asked to the driver at startup, and only with an
+// encoder that follows the frame size
+int check_size(MainContext * mctx, int width, int height) {
+    if (!jpeg_resizable(mctx->jctx)) {
+        LOG_WARN("The encoder can't change the frame size");
+        return -1;
+    }
+    if (width <= 0 || height <= 0 || width > MAX_WIDTH || height > MAX_HEIGHT) {
+        LOG_WARN("Capture size out of %dx%d", MAX_WIDTH, MAX_HEIGHT);
+        return -1;
+    }
+    if (mctx->shm != NULL && !shm_fits(mctx->shm, width, height)) {
+        LOG_WARN("Capture size bigger than the shared memory slots");
+        return -1;
+    }
+    return 0;
+}
+
+// Qualities from the one of the producer up are the frame itself
+int check_quality(MainContext * mctx, Variant* v, int quality) {
+    if (quality < 1 || quality > 100) {
+        LOG_WARN("Quality out of 1-100");
+        return -1;
+    }
+
+    v->quality = quality < mctx->jctx->quality ? quality : 0;
+    return 0;
+}
+
+// First sequence wanted by a new request, with the mutex held
+uint32_t wanted_seq(MainContext * mctx) {
+    time_t now = time(NULL);
+
+    uint32_t min = mctx->frame->seq + 1;
+    if (now - mctx->last > 10 && !continuous(mctx)) {
+        LOG_INFO("New request after %d seconds idle", now - mctx->last);
+
+        // Flush capture buffers, the producer is idle. A rate change
+        // restarts the stream without them.
+        if (!mctx->rate_changing) {
+            LOG_INFO("Flush V4L2 buffers");
+            capture_flush(mctx->cctx);
+        }
+        // The next frame has been already processed by the producer
+        LOG_INFO("Skip old frame");
+        min = mctx->ready->seq + 1;
+    }
+    mctx->last = now;
+
+    return min;
+}
+
+// Text clients waiting for the frame of the producer get it while
+// compressed, the other variants once the frame is published
+int streamed(MainContext * mctx, const Client* c) {
+    return c->protocol == CLIENT_TEXT && produced_variant(mctx, &c->variant);
+}
+
+// Marks the client as waiting for a frame from min on, with the mutex
+// held. Binary clients get a response to cmd. The frame is encoded as
+// v, or sent as the producer encoded it when v is NULL.
+void park_client(MainContext * mctx, Client* c, uint32_t min, uint8_t cmd, const Variant* v) {
+    c->waiting = cmd;
+    c->offset = 0;
+    if (v != NULL) {
+        c->variant = *v;
+    } else {
+        memset(&c->variant, 0, sizeof (c->variant));
+        c->variant.mode = mctx->jctx->mode;
+    }
+    c->last_seq = min - 1;
+    mctx->waiters++;
+    if (streamed(mctx, c)) {
+        mctx->streamers++;
+    }
+    mctx->wanted = 1;
+    pthread_cond_signal(&mctx->demand_cond);
+}
+
+// Parks the client until a frame from min on is published, without
+// blocking the server, see serve_waiting(). With min 0 the frame is
+// the next one, or a new one after a while idle. Returns -1 when such
+// a frame is already published.
+int wait_frame(MainContext * mctx, Client* c, uint32_t min, uint8_t cmd, const Variant* v) {
+    pthread_mutex_lock(&mctx->mutex);
+    mctx->requests++;
+    if (min == 0) {
+        min = wanted_seq(mctx);
+    } else if (min > mctx->ready->seq + 1) {
+        // Unknown sequence, from a previous run
+        min = mctx->ready->seq + 1;
+    }
+    if (v != NULL && raw_variant(mctx, v)) {
+        // The encoders keep the raw frames from now on
+        mctx->raw_wanted = time(NULL);
+        if (mctx->ready->raw->used == 0 && min <= mctx->ready->seq) {
+            min = mctx->ready->seq + 1;
+        }
+    }
+    int published = mctx->ready->seq >= min;
+    if (!published) {
+        park_client(mctx, c, min, cmd, v);
+    }
+    pthread_mutex_unlock(&mctx->mutex);
+
+    return published ? -1 : 0;
+}
+
+// Asks the producer for another capture size, the client gets the
+// first frame grabbed at that size. The size is clamped by the driver.
+void wait_size(MainContext * mctx, Client* c, int width, int height) {
+    pthread_mutex_lock(&mctx->mutex);
+    mctx->requests++;
+    LOG_INFO("Capture size %dx%d requested", width, height);
+    mctx->resize_width = width;
+    mctx->resize_height = height;
+    // The frames handed to the encoders keep the previous size
+    park_client(mctx, c, mctx->seq + 1, 'm', NULL);
+    pthread_mutex_unlock(&mctx->mutex);
+}
+
+// Reserves the next count frames grabbed for the client, the encoders
+// keep a copy of each one until serve_bursts() sends it
+int start_burst(MainContext * mctx, Client* c, int count) {
+    if (count < 1 || count > MAX_BURST) {
+        LOG_WARN("Burst out of 1-%d frames", MAX_BURST);
+        return -1;
+    }
+
+    pthread_mutex_lock(&mctx->mutex);
+    mctx->requests++;
+    // The stale frames are flushed when idle
+    wanted_seq(mctx);
+    c->last_seq = mctx->seq;
+    c->burst_last = mctx->seq + count;
+    if (mctx->bursts == 0 || c->burst_last > mctx->burst_last) {
+        mctx->burst_last = c->burst_last;
+    }
+    if (mctx->bursts == 0) {
+        mctx->burst_sent = c->last_seq;
+    }
+    mctx->bursts++;
+    // Every frame is grabbed until the last one
+    pthread_cond_signal(&mctx->demand_cond);
+    pthread_mutex_unlock(&mctx->mutex);
+
+    LOG_INFO("Burst of frames %u to %u", c->last_seq + 1, c->burst_last);
+    return 0;
+}
+
+// Last frame every burst client got, with the mutex held. The encoders
+// waiting for its slot go on.
+void update_burst_sent(MainContext * mctx) {
+    uint32_t sent = mctx->burst_last;
+    int i;
+    for (i = 0; i < mctx->nclients; i++) {
+        Client* c = mctx->clients[i];
+        if (c != NULL && c->burst_last && c->last_seq < sent) {
+            sent = c->last_seq;
+        }
+    }
+    mctx->burst_sent = sent;
+    pthread_cond_broadcast(&mctx->burst_cond);
+}
+
+void end_burst(MainContext * mctx, Client* c) {
+    pthread_mutex_lock(&mctx->mutex);
+    c->burst_last = 0;
+    mctx->bursts--;
+    update_burst_sent(mctx);
+    pthread_mutex_unlock(&mctx->mutex);
+}
+
+// Copies an encoded frame, without the raw one nor the sequence
+int keep_frame(Frame* d, const Frame* s) {
+    d->timestamp = s->timestamp;
+    d->encode_time = s->encode_time;
+    d->width = s->width;
+    d->height = s->height;
+    return buffer_copy(d->jpeg, s->jpeg) < 0 ? -1 : 0;
+}
+
+void exit_server(MainContext * mctx) {
+    LOG_INFO("Exit command received");
+    pthread_mutex_lock(&mctx->mutex);
+    mctx->exit = 1;
+    // Signal Producer (TO FINISH)
+    LOG_TRACE("Signaling producer thread to finish him");
+    pthread_cond_signal(&mctx->demand_cond);
+    pthread_cond_broadcast(&mctx->burst_cond);
+    pthread_mutex_unlock(&mctx->mutex);
+}
+
+// Called by the recorder thread
+void recorded_found(Recorder* r) {
+    notify_server((MainContext *) r->found_arg);
+}
+
+// Parks the client until the recorder thread read the frame, without
+// blocking the server on the disk, see serve_recorded()
+int wait_recorded(MainContext * mctx, Client* c, uint64_t timestamp) {
+    if (mctx->recorder == NULL) {
+        LOG_WARN("Recording disabled");
+        return -1;
+    }
+
+    if (0 != recorder_lookup(mctx->recorder, timestamp, c)) {
+        return -1;
+    }
+    c->waiting = 'h';
+
+    return 0;
+}
+
+// Sealed memfd with the data. The frames served and the ring frames
+// are identified by their sequence, so every local client gets the
+// same memfd; other data gets a memfd of its own, closed by the caller.
+int local_memfd(MainContext * mctx, const Buffer* data, uint32_t seq, int* shared) {
+    *shared = (data == mctx->frame->jpeg || data == mctx->ring_buffer);
+    if (!*shared) {
+        return memfd_from_buffer("rpi-webcam", data);
+    }
+
+    if (mctx->memfd >= 0 && mctx->memfd_data == data && mctx->memfd_seq == seq) {
+        return mctx->memfd;
+    }
+
+    if (mctx->memfd >= 0) {
+        close(mctx->memfd);
+    }
+    mctx->memfd = memfd_from_buffer("rpi-webcam", data);
+    mctx->memfd_data = data;
+    mctx->memfd_seq = seq;
+    return mctx->memfd;
+}
+
+// Local clients get the header with the frame as a memfd, the cost
+// does not depend on the frame size
+int send_local(MainContext * mctx, Client* c, Response* r, const uint8_t* header, const Buffer* data, int live) {
+    // In order with the responses waiting with their descriptor
+    if (data == NULL || data->used == 0) {
+        return client_send_fd(c, header, PROTO_RESPONSE_SIZE, -1, live);
+    }
+
+    int shared;
+    int fd = local_memfd(mctx, data, r->seq, &shared);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int ret = client_send_fd(c, header, PROTO_RESPONSE_SIZE, fd, live);
+    if (!shared) {
+        close(fd);
+    }
+    return ret;
+}
+
+// Response fields of a frame encoded in the mode of the producer
+void frame_response(MainContext * mctx, Response* r, const Frame* f) {
+    r->seq = f->seq;
+    r->timestamp = (uint64_t) f->timestamp.tv_sec * 1000000 + f->timestamp.tv_usec;
+    r->encode_time = f->encode_time;
+    r->format = (mctx->jctx->mode == JPEG_MODE_GRAY) ? PROTO_FORMAT_JPEG_GRAY : PROTO_FORMAT_JPEG;
+}
+
+int send_response(MainContext * mctx, Client* c, Response* r, const Buffer* data, int live) {
+    uint64_t start = trace_now();
+    uint8_t header[PROTO_RESPONSE_SIZE];
+    r->size = data != NULL ? data->used : 0;
+    protocol_write_response(header, r);
+
+    int ret;
+    if (c->protocol == CLIENT_LOCAL) {
+        ret = send_local(mctx, c, r, header, data, live);
+    } else if (live) {
+        ret = client_push(c, header, sizeof (header), data);
+    } else {
+        ret = client_send(c, header, sizeof (header), data);
+    }
+    trace_span("Send", r->seq, start);
+
+    return ret;
+}
+
+// Sends the ring frames newer than the last one sent to the
+// client, up to the given sequence. Live frames may replace the
+// previous one when the client is slow, the window is never dropped.
+int send_ring(MainContext * mctx, Client* c, uint32_t until, int live) {
+    RingEntry e;
+    while (c->last_seq < until && 0 == ring_get(mctx->ring, c->last_seq, &e, mctx->ring_buffer)) {
+        c->last_seq = e.seq;
+
+        int r;
+        if (c->protocol == CLIENT_TEXT) {
+            uint64_t start = trace_now();
+            r = live ? client_push(c, NULL, 0, mctx->ring_buffer)
+                    : client_send(c, NULL, 0, mctx->ring_buffer);
+            trace_span("Send", e.seq, start);
+        } else {
+            Response res;
+            memset(&res, 0, sizeof (res));
+            res.cmd = 'p';
+            res.seq = e.seq;
+            res.timestamp = e.timestamp;
+            res.encode_time = e.encode_time;
+            res.format = (e.mode == JPEG_MODE_GRAY) ? PROTO_FORMAT_JPEG_GRAY : PROTO_FORMAT_JPEG;
+            if (c->streaming || e.seq < until) {
+                res.flags = PROTO_FLAG_MORE;
+            }
+            r = send_response(mctx, c, &res, mctx->ring_buffer, live);
+        }
+
+        if (0 != r) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Sends the pre-event window, and the live frames after it
+int dump_ring(MainContext * mctx, Client* c, int live) {
+    if (mctx->ring == NULL) {
+        LOG_WARN("Pre-event ring disabled");
+        return -1;
+    }
+
+    uint32_t until = ring_last_seq(mctx->ring);
+    LOG_INFO("Dump pre-event frames up to %u%s", until, live ? " and live frames" : "");
+    c->last_seq = 0;
+    c->streaming = live;
+    return send_ring(mctx, c, until, 0);
+}
+
+const char* protocol_name(ClientProtocol protocol) {
+    switch (protocol) {
+        case CLIENT_TEXT: return "text";
+        case CLIENT_BINARY: return "binary";
+        case CLIENT_WEBSOCKET: return "websocket";
+        case CLIENT_LOCAL: return "local";
+        default: return "http";
+    }
+}
+
+// One line per connection with the frames it dropped
+Buffer* client_stats(MainContext * mctx) {
+    Buffer* b = mctx->stats_buffer;
+    if (0 > buffer_resize(b, 80 * (mctx->nclients + 1), 0)) {
+        LOG_ERROR("Error Resizing stats");
+        return NULL;
+    }
+
+    b->used = sprintf((char*) b->data, "fd protocol streaming queued drops\n");
+    int i;
+    for (i = 0; i < mctx->nclients; i++) {
+        Client* c = mctx->clients[i];
+        if (c == NULL) continue;
+        b->used += sprintf((char*) b->data + b->used, "%d %s %d %u %u\n", c->fd,
+                protocol_name(c->protocol), c->streaming,
+                c->output->used - c->sent + c->pending->used, c->drops);
+    }
+
+    return b;
+}
+
+int set_watching(MainContext * mctx, Client* c, int watching) {
+    if (c->protocol != CLIENT_WEBSOCKET || c->streaming == watching) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&mctx->mutex);
+    c->streaming = watching;
+    mctx->watchers += watching ? 1 : -1;
+    // Frames are produced continuously while watched
+    pthread_cond_signal(&mctx->demand_cond);
+    pthread_mutex_unlock(&mctx->mutex);
+
+    return 0;
+}
+
+void close_client(MainContext * mctx, int i) {
+    Client* c = mctx->clients[i];
+    LOG_INFO("Closing connection (%u frames dropped)", c->drops);
+    set_watching(mctx, c, 0);
+    if (c->waiting == 'h') {
+        recorder_cancel(mctx->recorder, c);
+    } else if (c->waiting) {
+        pthread_mutex_lock(&mctx->mutex);
+        mctx->waiters--;
+        if (streamed(mctx, c)) {
+            mctx->streamers--;
+        }
+        pthread_mutex_unlock(&mctx->mutex);
+    }
+    if (c->burst_last) {
+        end_burst(mctx, c);
+    }
+    client_destroy(c);
+    mctx->clients[i] = NULL;
+}
+
+// An HTTP GET with the WebSocket upgrade, the live frames are pushed
+// from then on. Returns 1 when the connection must be closed.
+int upgrade_websocket(MainContext * mctx, Client* c) {
+    char response[256];
+    int n = websocket_handshake(c->input->data, c->input->used, response, sizeof (response));
+    if (n == 0) {
+        return c->eof;
+    }
+
+    if (n < 0) {
+        const char* bad = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n";
+        client_send(c, (const uint8_t*) bad, strlen(bad), NULL);
+        return 1;
+    }
+
+    LOG_INFO("WebSocket connection upgraded");
+    client_consume(c, n);
+    if (0 != client_send(c, (const uint8_t*) response, strlen(response), NULL)) {
+        return 1;
+    }
+
+    c->protocol = CLIENT_WEBSOCKET;
+    c->last_seq = 0;
+    set_watching(mctx, c, 1);
+
+    return 0;
+}
+
+// Only the control frames from the browser are handled
+int serve_websocket(MainContext * mctx, Client* c) {
+    WebSocketFrame f;
+    int n;
+    while ((n = websocket_parse_frame(c->input->data, c->input->used, &f)) > 0) {
+        if (f.opcode == WS_OP_CLOSE) {
+            LOG_INFO("WebSocket closed by the client");
+            uint8_t header[WS_MAX_HEADER];
+            int hlen = websocket_write_header(header, WS_OP_CLOSE, 0);
+            client_send(c, header, hlen, NULL);
+            set_watching(mctx, c, 0);
+            return 1;
+        }
+
+        if (f.opcode == WS_OP_PING && f.length <= WS_MAX_CONTROL) {
+            uint8_t pong[WS_MAX_HEADER + WS_MAX_CONTROL];
+            int hlen = websocket_write_header(pong, WS_OP_PONG, f.length);
+            memcpy(pong + hlen, f.payload, f.length);
+            if (0 != client_send(c, pong, hlen + f.length, NULL)) {
+                return 1;
+            }
+        }
+
+        client_consume(c, n);
+    }
+
+    if (n < 0) {
+        return 1;
+    }
+
+    return c->eof;
+}
+
+// The frame as an HTTP response, 304 when the client has it already.
+// No body for HEAD, r is the request with If-None-Match or NULL.
+int send_snapshot(MainContext * mctx, Client* c, const Frame* f, int head, const HttpRequest* r) {
+    char etag[32];
+    snprintf(etag, sizeof (etag), "\"%lx-%u\"", (unsigned long) mctx->started, f->seq);
+
+    int status = 200;
+    if (f->seq == 0) {
+        // Nothing captured
+        status = 503;
+    } else if (r != NULL && http_etag_matches(r, etag)) {
+        status = 304;
+    }
+
+    char header[256];
+    int length = status == 200 ? f->jpeg->used : 0;
+    int hlen = http_write_header(header, sizeof (header), status, status == 503 ? NULL : etag, length, c->keep_alive);
+    if (hlen < 0) {
+        return -1;
+    }
+
+    LOG_TRACE("HTTP %d for frame %u", status, f->seq);
+    return client_send(c, (const uint8_t*) header, hlen, status == 200 && !head ? f->jpeg : NULL);
+}
+
+// A published frame is the snapshot for a while, see SNAPSHOT_MAX_AGE
+int fresh_frame(const Frame* f) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    int64_t age = (int64_t) (now.tv_sec - f->timestamp.tv_sec) * 1000 + (now.tv_usec - f->timestamp.tv_usec) / 1000;
+    return f->seq > 0 && age < SNAPSHOT_MAX_AGE;
+}
+
+// HTTP/1.1, the snapshot on keep-alive connections. Pipelined requests
+// are answered in order. Returns 1 when the connection must be closed.
+int serve_http(MainContext * mctx, Client* c) {
+    HttpRequest r;
+    char header[256];
+    int n = 0;
+    while (client_idle(c) && !c->waiting && (n = http_parse_request(c->input->data, c->input->used, &r)) > 0) {
+        if (r.upgrade) {
+            // The handshake reads the request again
+            return upgrade_websocket(mctx, c);
+        }
+        client_consume(c, n);
+        c->keep_alive = r.keep_alive;
+
+        int head = (strcmp(r.method, "HEAD") == 0);
+        int status = 0;
+        if (!head && strcmp(r.method, "GET") != 0) {
+            status = 405;
+        } else if (strncmp(r.path, HTTP_SNAPSHOT, strlen(HTTP_SNAPSHOT)) != 0
+                || (r.path[strlen(HTTP_SNAPSHOT)] != '\0' && r.path[strlen(HTTP_SNAPSHOT)] != '?')) {
+            status = 404;
+        }
+        if (status != 0) {
+            LOG_WARN("HTTP %s %s: %d", r.method, r.path, status);
+            int hlen = http_write_header(header, sizeof (header), status, NULL, 0, c->keep_alive);
+            if (hlen < 0 || 0 != client_send(c, (const uint8_t*) header, hlen, NULL)) {
+                return 1;
+            }
+            if (!c->keep_alive) return 1;
+            continue;
+        }
+
+        LOG_INFO("HTTP snapshot request");
+        Frame* f = latest_frame(mctx);
+        if (!fresh_frame(f)) {
+            if (0 == wait_frame(mctx, c, f->seq + 1, head ? 'H' : 'G', NULL)) {
+                // Answered by serve_waiting(), a new frame never matches
+                continue;
+            }
+            f = latest_frame(mctx);
+        }
+        if (0 != send_snapshot(mctx, c, f, head, &r) || !c->keep_alive) {
+            return 1;
+        }
+    }
+
+    if (n < 0) {
+        c->keep_alive = 0;
+        int hlen = http_write_header(header, sizeof (header), 400, NULL, 0, 0);
+        if (hlen > 0) {
+            client_send(c, (const uint8_t*) header, hlen, NULL);
+        }
+        return 1;
+    }
+
+    return c->eof && client_idle(c) && !c->waiting;
+}
+
+// Text protocol: one command per connection, the frame is
+// sent raw and the connection closed. Returns 1 when done.
+int serve_text(MainContext * mctx, Client* c) {
+    uint8_t* data = c->input->data;
+    int len = c->input->used;
+    if (len == 0) {
+        return c->eof;
+    }
+
+    if (http_is_request(data, len)) {
+        c->protocol = CLIENT_HTTP;
+        return serve_http(mctx, c);
+    }
+
+    // Commands with arguments take the rest of the line
+    uint8_t cmd = data[0];
+    uint8_t* nl = memchr(data, '\n', len);
+    int line = (cmd == 'r' || cmd == 't' || cmd == 'h' || cmd == 'p' || cmd == 'n' || cmd == 'm' || cmd == 'c')
+            || (cmd == 'f' && len > 1 && data[1] == ' ');
+    if (line && nl == NULL && !c->eof) {
+        if (len > 64) {
+            LOG_WARN("Command line too long");
+            return 1;
+        }
+        return 0;
+    }
+
+    char args[64];
+    int alen = (nl != NULL ? nl - data : len) - 1;
+    if (alen >= sizeof (args)) alen = sizeof (args) - 1;
+    memcpy(args, data + 1, alen);
+    args[alen] = '\0';
+
+    Variant v;
+    memset(&v, 0, sizeof (v));
+    v.mode = mctx->jctx->mode;
+    v.transform = mctx->transform;
+
+    if (cmd == 'b') {
+        LOG_INFO("Binary protocol selected");
+        client_consume(c, 1);
+        c->protocol = CLIENT_BINARY;
+        return 0;
+    } else if (cmd == 'q') {
+        exit_server(mctx);
+        return 1;
+    } else if (cmd == 'h') {
+        LOG_INFO("Recorded frame command received");
+        double t;
+        if (1 != sscanf(args, "%lf", &t)) {
+            LOG_WARN("Timestamp expected");
+            return 1;
+        }
+        // Sent by serve_recorded()
+        client_consume(c, c->input->used);
+        return (0 != wait_recorded(mctx, c, (uint64_t) (t * 1000000)));
+    } else if (cmd == 'p') {
+        LOG_INFO("Pre-event frames command received");
+        int live = (strstr(args, "live") != NULL);
+        client_consume(c, c->input->used);
+        if (0 != dump_ring(mctx, c, live)) {
+            return 1;
+        }
+        // Streams until the client closes
+        return !live;
+    } else if (cmd == 's') {
+        LOG_INFO("Stats command received");
+        Buffer* out = client_stats(mctx);
+        if (out != NULL) {
+            client_send(c, NULL, 0, out);
+        }
+        return 1;
+    } else if (cmd == 'f') {
+        LOG_INFO("Frame command received");
+        // Optional lower quality
+        int quality;
+        if (1 == sscanf(args, "%d", &quality) && 0 != check_quality(mctx, &v, quality)) {
+            return 1;
+        }
+    } else if (cmd == 'n') {
+        LOG_INFO("Next frame command received");
+        // After the last published frame by default
+        unsigned int seq;
+        uint32_t min = 1 == sscanf(args, "%u", &seq) ? seq + 1 : UINT32_MAX;
+        client_consume(c, c->input->used);
+        if (0 == wait_frame(mctx, c, min, 'n', NULL)) {
+            return 0;
+        }
+        Frame* f = latest_frame(mctx);
+        client_send(c, NULL, 0, f->jpeg);
+        return 1;
+    } else if (cmd == 'm') {
+        LOG_INFO("Capture size command received");
+        int width, height;
+        if (2 != sscanf(args, "%d %d", &width, &height) || 0 != check_size(mctx, width, height)) {
+            LOG_WARN("Capture size expected: width height");
+            return 1;
+        }
+        client_consume(c, c->input->used);
+        wait_size(mctx, c, width, height);
+        return 0;
+    } else if (cmd == 'c') {
+        LOG_INFO("Burst command received");
+        int count;
+        if (1 != sscanf(args, "%d", &count) || 0 != start_burst(mctx, c, count)) {
+            LOG_WARN("Frame count expected");
+            return 1;
+        }
+        // Sent by serve_bursts()
+        client_consume(c, c->input->used);
+        return 0;
+    } else if (cmd == 'g') {
+        LOG_INFO("Grayscale frame command received");
+        v.mode = JPEG_MODE_GRAY;
+    } else if (cmd == 'r') {
+        LOG_INFO("Crop frame command received");
+        if (4 != sscanf(args, "%d %d %d %d", &v.x, &v.y, &v.width, &v.height)) {
+            LOG_WARN("Crop window expected: x y width height");
+            return 1;
+        }
+        if (0 != request_crop(mctx, &v)) {
+            return 1;
+        }
+    } else if (cmd == 't') {
+        LOG_INFO("Transformed frame command received");
+        if (0 != jpeg_transform_parse(args + strspn(args, " "), &v.transform)) {
+            LOG_WARN("Transform '%s' unknown", args);
+            return 1;
+        }
+    } else {
+        LOG_WARN("Command '%c' unknown", cmd);
+        return 1;
+    }
+
+    // Sent by serve_waiting(), while compressed for the frame itself,
+    // unless a frame is already there
+    client_consume(c, c->input->used);
+    if (0 == wait_frame(mctx, c, 0, cmd, &v)) {
+        return 0;
+    }
+    Frame* f = latest_frame(mctx);
+    Buffer* out = encode_variant(mctx, &v);
+    if (out != NULL) {
+        LOG_TRACE("Sending frame");
+        uint64_t start = trace_now();
+        client_send(c, NULL, 0, out);
+        trace_span("Send", f->seq, start);
+        LOG_TRACE("%u bytes sent", out->used);
+    }
+
+    return 1;
+}
+
+// Response of the binary protocol with the frame being served, in the
+// encoding the client asked for
+int send_frame(MainContext * mctx, Client* c, uint8_t cmd, const Variant* v, const Frame* f) {
+    Response res;
+    memset(&res, 0, sizeof (res));
+    res.cmd = cmd;
+
+    Buffer* out = encode_variant(mctx, v);
+    if (out != NULL) {
+        frame_response(mctx, &res, f);
+        res.format = (v->mode == JPEG_MODE_GRAY) ? PROTO_FORMAT_JPEG_GRAY : PROTO_FORMAT_JPEG;
+    } else {
+        res.status = PROTO_ERROR;
+    }
+
+    return send_response(mctx, c, &res, out, 0);
+}
+
+// Binary protocol: framed requests and responses on a long-lived
+// connection. Returns 1 when the connection must be closed.
+int serve_binary(MainContext * mctx, Client* c) {
+    Request req;
+    int n = 0;
+    // The next requests wait for the previous response to be sent
+    while (client_idle(c) && !c->waiting && !c->burst_last
+            && (n = protocol_parse_request(c->input->data, c->input->used, &req)) > 0) {
+        Response res;
+        memset(&res, 0, sizeof (res));
+        res.cmd = req.cmd;
+
+        Variant v;
+        memset(&v, 0, sizeof (v));
+        v.mode = mctx->jctx->mode;
+        v.transform = mctx->transform;
+
+        int valid = 1;
+        if (req.cmd == 'q') {
+            exit_server(mctx);
+            send_response(mctx, c, &res, NULL, 0);
+            return 1;
+        } else if (req.cmd == 'h' && req.length == 8) {
+            LOG_TRACE("Recorded frame request");
+            uint64_t timestamp = protocol_get_u64(req.payload);
+            client_consume(c, n);
+            if (0 == wait_recorded(mctx, c, timestamp)) {
+                // Answered by serve_recorded()
+                continue;
+            }
+            res.status = PROTO_ERROR;
+            if (0 != send_response(mctx, c, &res, NULL, 0)) {
+                return 1;
+            }
+            continue;
+        } else if (req.cmd == 'p') {
+            LOG_TRACE("Pre-event frames request");
+            int live = (req.flags & PROTO_FLAG_LIVE) != 0;
+            client_consume(c, n);
+            if (0 != dump_ring(mctx, c, live)) {
+                res.status = PROTO_ERROR;
+                if (0 != send_response(mctx, c, &res, NULL, 0)) {
+                    return 1;
+                }
+            } else if (!live && c->last_seq == 0) {
+                // Empty window
+                if (0 != send_response(mctx, c, &res, NULL, 0)) {
+                    return 1;
+                }
+            }
+            continue;
+        } else if (req.cmd == 's') {
+            LOG_TRACE("Stats request");
+            client_consume(c, n);
+            Buffer* out = client_stats(mctx);
+            if (out != NULL) {
+                res.format = PROTO_FORMAT_TEXT;
+            } else {
+                res.status = PROTO_ERROR;
+            }
+            if (0 != send_response(mctx, c, &res, out, 0)) {
+                return 1;
+            }
+            continue;
+        } else if (req.cmd == 'm' && req.length == 4) {
+            LOG_TRACE("Capture size request");
+            int width = protocol_get_u16(req.payload);
+            int height = protocol_get_u16(req.payload + 2);
+            client_consume(c, n);
+            if (0 == check_size(mctx, width, height)) {
+                // Answered by serve_waiting()
+                wait_size(mctx, c, width, height);
+                continue;
+            }
+            res.status = PROTO_ERROR;
+            if (0 != send_response(mctx, c, &res, NULL, 0)) {
+                return 1;
+            }
+            continue;
+        } else if (req.cmd == 'c' && req.length == 2) {
+            LOG_TRACE("Burst request");
+            client_consume(c, n);
+            if (0 == start_burst(mctx, c, protocol_get_u16(req.payload))) {
+                // Answered by serve_bursts()
+                continue;
+            }
+            res.status = PROTO_ERROR;
+            if (0 != send_response(mctx, c, &res, NULL, 0)) {
+                return 1;
+            }
+            continue;
+        } else if (req.cmd == 'n' && req.length == 4) {
+            LOG_TRACE("Next frame request");
+            client_consume(c, n);
+            if (0 == wait_frame(mctx, c, protocol_get_u32(req.payload) + 1, 'n', NULL)) {
+                // Answered by serve_waiting()
+                continue;
+            }
+            Frame* f = latest_frame(mctx);
+            frame_response(mctx, &res, f);
+            if (0 != send_response(mctx, c, &res, f->jpeg, 0)) {
+                return 1;
+            }
+            continue;
+        } else if (req.cmd == 'f') {
+            LOG_TRACE("Frame request");
+            if (req.length == 1) {
+                valid = (0 == check_quality(mctx, &v, req.payload[0]));
+            }
+        } else if (req.cmd == 'g') {
+            LOG_TRACE("Grayscale frame request");
+            v.mode = JPEG_MODE_GRAY;
+        } else if (req.cmd == 'r' && req.length == 8) {
+            LOG_TRACE("Crop frame request");
+            v.x = protocol_get_u16(req.payload);
+            v.y = protocol_get_u16(req.payload + 2);
+            v.width = protocol_get_u16(req.payload + 4);
+            v.height = protocol_get_u16(req.payload + 6);
+            valid = (0 == request_crop(mctx, &v));
+        } else if (req.cmd == 't' && req.length == 1) {
+            LOG_TRACE("Transformed frame request");
+            v.transform = req.payload[0];
+            valid = (v.transform <= JPEG_TRANSFORM_FLIP_V);
+        } else {
+            LOG_WARN("Request '%c' unknown", req.cmd);
+            valid = 0;
+        }
+
+        client_consume(c, n);
+
+        if (!valid) {
+            res.status = PROTO_ERROR;
+            if (0 != send_response(mctx, c, &res, NULL, 0)) {
+                return 1;
+            }
+            continue;
+        }
+
+        // Parked like 'n', the clients waiting share the next frame
+        if (0 == wait_frame(mctx, c, 0, req.cmd, &v)) {
+            // Answered by serve_waiting()
+            continue;
+        }
+        if (0 != send_frame(mctx, c, req.cmd, &v, latest_frame(mctx))) {
+            return 1;
+        }
+    }
+
+    if (n < 0) {
+        return 1;
+    }
+
+    return c->eof && client_idle(c) && !c->waiting && !c->burst_last;
+}
+
+int serve_client(MainContext * mctx, Client* c) {
+    if (c->protocol == CLIENT_TEXT && c->streaming) {
+        // Nothing else is expected from streaming text clients
+        client_consume(c, c->input->used);
+        return c->eof;
+    }
+
+    if (c->protocol == CLIENT_TEXT && (c->waiting || c->burst_last)) {
+        // The frame is sent even if the client closed its side
+        client_consume(c, c->input->used);
+        return 0;
+    }
+
+    if (c->protocol == CLIENT_TEXT) {
+        if (serve_text(mctx, c)) {
+            return 1;
+        }
+    }
+
+    if (c->protocol == CLIENT_BINARY || c->protocol == CLIENT_LOCAL) {
+        return serve_binary(mctx, c);
+    }
+
+    if (c->protocol == CLIENT_WEBSOCKET) {
+        return serve_websocket(mctx, c);
+    }
+
+    if (c->protocol == CLIENT_HTTP) {
+        return serve_http(mctx, c);
+    }
+
+    return 0;
+}
+
+// Pushes the last frame to a WebSocket viewer, the header goes in
+// front of the shared encoded frame without copying it
+int send_websocket(MainContext * mctx, Client* c) {
+    Variant v;
+    memset(&v, 0, sizeof (v));
+    v.mode = mctx->jctx->mode;
+    v.transform = mctx->transform;
+
+    Frame* f = latest_frame(mctx);
+    if (f->seq == c->last_seq) {
+        return 0;
+    }
+    c->last_seq = f->seq;
+
+    Buffer* out = encode_variant(mctx, &v);
+    if (out == NULL) {
+        return 0;
+    }
+
+    uint64_t start = trace_now();
+    uint8_t header[WS_MAX_HEADER];
+    int hlen = websocket_write_header(header, WS_OP_BINARY, out->used);
+    int ret = client_push(c, header, hlen, out);
+    trace_span("Send", f->seq, start);
+
+    return ret;
+}
+
+// Sends the waiting text clients the rows compressed so far, the whole
+// frame when it was not streamed, or the variant they asked for, and
+// closes them once done. The
+// binary clients get the published frame, in the variant they asked
+// for, and go on with their next requests. One notification of the
+// producer serves all of them.
+void serve_waiting(MainContext * mctx) {
+    if (mctx->waiters == 0) {
+        return;
+    }
+
+    uint64_t start = trace_now();
+    Frame* f = latest_frame(mctx);
+
+    pthread_mutex_lock(&mctx->mutex);
+    Buffer* s = mctx->stream;
+    int failed = mctx->failed;
+    mctx->failed = 0;
+    int i;
+    for (i = 0; i < mctx->nclients; i++) {
+        Client* c = mctx->clients[i];
+        // The recorded frames are served by serve_recorded()
+        if (c == NULL || !c->waiting || c->waiting == 'h') continue;
+
+        int r = 0;
+        if (f->seq > c->last_seq && !failed && raw_variant(mctx, &c->variant) && f->raw->used == 0) {
+            // Compressed before the request, the next frame has its raw one
+            c->last_seq = f->seq;
+            continue;
+        }
+        if (c->protocol != CLIENT_TEXT) {
+            if (f->seq <= c->last_seq && !failed) continue;
+            if (c->protocol == CLIENT_HTTP) {
+                r = send_snapshot(mctx, c, f, c->waiting == 'H', NULL);
+            } else {
+                // The variants are encoded once per frame, without
+                // holding the encoders
+                pthread_mutex_unlock(&mctx->mutex);
+                r = send_frame(mctx, c, c->waiting, &c->variant, f);
+                pthread_mutex_lock(&mctx->mutex);
+            }
+            c->waiting = 0;
+            mctx->waiters--;
+            // Nothing else to serve
+            c->closing = (c->eof && c->input->used == 0) || (c->protocol == CLIENT_HTTP && !c->keep_alive);
+            if (r != 0 || (c->closing && client_idle(c))) {
+                pthread_mutex_unlock(&mctx->mutex);
+                close_client(mctx, i);
+                pthread_mutex_lock(&mctx->mutex);
+            }
+            continue;
+        } else if (!streamed(mctx, c)) {
+            if (f->seq <= c->last_seq && !failed) continue;
+            // Encoded like for the binary clients, then the connection ends
+            pthread_mutex_unlock(&mctx->mutex);
+            Buffer* out = encode_variant(mctx, &c->variant);
+            r = out != NULL ? client_send(c, NULL, 0, out) : -1;
+            pthread_mutex_lock(&mctx->mutex);
+        } else if (mctx->stream_state != STREAM_IDLE && mctx->stream_seq > c->last_seq
+                && !(mctx->stream_failed && c->offset == 0)) {
+            if (mctx->stream_failed) {
+                // The rows sent can't be taken back, the reset tells
+                // the client the frame is truncated
+                LOG_WARN("Frame %u truncated, resetting the connection", mctx->stream_seq);
+                client_reset(c);
+                r = -1;
+            } else {
+                if (s->used > c->offset) {
+                    r = client_send(c, s->data + c->offset, s->used - c->offset, NULL);
+                    c->offset = s->used;
+                }
+                if (mctx->stream_state == STREAM_COMPRESSING && r == 0) continue;
+            }
+        } else if (f->seq > c->last_seq || failed) {
+            // On errors the last frame is repeated
+            r = client_send(c, NULL, 0, f->jpeg);
+        } else {
+            continue;
+        }
+
+        if (streamed(mctx, c)) {
+            mctx->streamers--;
+        }
+        c->waiting = 0;
+        c->closing = 1;
+        mctx->waiters--;
+        if (r != 0 || client_idle(c)) {
+            pthread_mutex_unlock(&mctx->mutex);
+            close_client(mctx, i);
+            pthread_mutex_lock(&mctx->mutex);
+        }
+    }
+
+    // Every client got the last bytes
+    uint32_t seq = mctx->stream_seq;
+    if (mctx->stream_state == STREAM_DONE) {
+        mctx->stream_state = STREAM_IDLE;
+    }
+    pthread_mutex_unlock(&mctx->mutex);
+
+    trace_span("Stream", seq, start);
+}
+
+// A frame of a burst, rotated like the others. A lost frame keeps its
+// place: an error response, or no bytes after the line on text.
+int send_burst(MainContext * mctx, Client* c, const Frame* f, uint32_t seq) {
+    const Buffer* out = f != NULL ? f->jpeg : NULL;
+    if (out != NULL && mctx->transform != JPEG_TRANSFORM_NONE) {
+        out = 0 == jpeg_transform(out, mctx->burst_buffer, mctx->transform) ? mctx->burst_buffer : NULL;
+    }
+
+    int r;
+    uint64_t start = trace_now();
+    if (c->protocol == CLIENT_TEXT) {
+        // Sequence, capture time and size before every frame
+        char line[64];
+        int n = snprintf(line, sizeof (line), "%u %ld.%06ld %u\n", seq,
+                out != NULL ? (long) f->timestamp.tv_sec : 0L, out != NULL ? (long) f->timestamp.tv_usec : 0L,
+                out != NULL ? out->used : 0);
+        r = client_send(c, (const uint8_t*) line, n, out);
+    } else {
+        Response res;
+        memset(&res, 0, sizeof (res));
+        res.cmd = 'c';
+        res.seq = seq;
+        if (out != NULL) {
+            frame_response(mctx, &res, f);
+        } else {
+            res.status = PROTO_ERROR;
+        }
+        if (seq < c->burst_last) {
+            res.flags = PROTO_FLAG_MORE;
+        }
+        r = send_response(mctx, c, &res, out, 0);
+    }
+    trace_span("Send burst", seq, start);
+
+    return r;
+}
+
+// Sends the burst clients the frames kept for them, in sequence, and
+// ends each burst after its last frame
+void serve_bursts(MainContext * mctx) {
+    if (mctx->bursts == 0) {
+        return;
+    }
+
+    int i;
+    for (i = 0; i < mctx->nclients; i++) {
+        Client* c = mctx->clients[i];
+        if (c == NULL || !c->burst_last) continue;
+
+        int r = 0;
+        while (r == 0 && c->last_seq < c->burst_last) {
+            uint32_t seq = c->last_seq + 1;
+            // The slot is not copied again before the client sent it
+            const Frame* kept = mctx->burst_frames[seq % BURST_SLOTS];
+            pthread_mutex_lock(&mctx->mutex);
+            uint32_t kept_seq = kept->seq;
+            pthread_mutex_unlock(&mctx->mutex);
+
+            // Not published yet
+            if (kept_seq < seq) break;
+
+            // Failed compression
+            int lost = kept_seq != seq || kept->jpeg->used == 0;
+            if (lost) {
+                LOG_WARN("Burst frame %u lost", seq);
+                c->drops++;
+            }
+            c->last_seq = seq;
+            r = send_burst(mctx, c, lost ? NULL : kept, seq);
+        }
+        if (r == 0 && c->last_seq < c->burst_last) continue;
+
+        end_burst(mctx, c);
+        // Text connections end with the burst
+        c->closing = c->protocol == CLIENT_TEXT || (c->eof && c->input->used == 0);
+        if (r != 0 || (c->closing && client_idle(c))) {
+            close_client(mctx, i);
+        }
+    }
+
+    pthread_mutex_lock(&mctx->mutex);
+    update_burst_sent(mctx);
+    pthread_mutex_unlock(&mctx->mutex);
+}
+
+// Sends the frames read by the recorder thread. The text clients are
+// closed once sent, the binary ones go on with their next requests.
+void serve_recorded(MainContext * mctx) {
+    if (mctx->recorder == NULL) {
+        return;
+    }
+
+    RecordEntry e;
+    int status;
+    Client* c;
+    while (NULL != (c = recorder_result(mctx->recorder, &e, &mctx->record_buffer, &status))) {
+        int i;
+        for (i = 0; i < mctx->nclients && mctx->clients[i] != c; i++);
+        if (i == mctx->nclients) continue;
+
+        c->waiting = 0;
+        const Buffer* out = (status == 0) ? mctx->record_buffer : NULL;
+        int r = 0;
+        if (c->protocol == CLIENT_TEXT) {
+            if (out != NULL) {
+                r = client_send(c, NULL, 0, out);
+            }
+            c->closing = 1;
+        } else {
+            Response res;
+            memset(&res, 0, sizeof (res));
+            res.cmd = 'h';
+            if (out != NULL) {
+                res.seq = e.seq;
+                res.timestamp = e.timestamp;
+                res.encode_time = e.encode_time;
+                res.format = (e.mode == JPEG_MODE_GRAY) ? PROTO_FORMAT_JPEG_GRAY : PROTO_FORMAT_JPEG;
+            } else {
+                res.status = PROTO_ERROR;
+            }
+            r = send_response(mctx, c, &res, out, 0);
+            c->closing = c->eof && c->input->used == 0;
+        }
+        if (r != 0 || (c->closing && client_idle(c))) {
+            close_client(mctx, i);
+        }
+    }
+}
+
+// Pushes the new frames to the streaming clients
+void publish_live(MainContext * mctx) {
+    uint64_t start = trace_now();
+    char drain[64];
+    while (read(mctx->notify[0], drain, sizeof (drain)) > 0);
+    errno = 0;
+
+    uint32_t until = mctx->ring != NULL ? ring_last_seq(mctx->ring) : 0;
+    int i;
+    for (i = 0; i < mctx->nclients; i++) {
+        Client* c = mctx->clients[i];
+        if (c == NULL || !c->streaming) continue;
+
+        int r;
+        if (c->protocol == CLIENT_WEBSOCKET) {
+            r = send_websocket(mctx, c);
+        } else {
+            r = send_ring(mctx, c, until, 1);
+        }
+
+        if (0 != r) {
+            close_client(mctx, i);
+        }
+    }
+
+    serve_waiting(mctx);
+    serve_bursts(mctx);
+    serve_recorded(mctx);
+
+    trace_span("Publish live", mctx->frame->seq > until ? mctx->frame->seq : until, start);
+}
+
+void accept_client(MainContext * mctx, int sock, ClientProtocol protocol) {
+    int fd = accept(sock, NULL, NULL);
+    if (fd < 0) {
+        LOG_ERROR("Error accepting connection");
+    } else if (mctx->nclients >= MAX_CLIENTS) {
+        LOG_WARN("Too many connections");
+        close(fd);
+    } else {
+        LOG_INFO("Connection established%s", protocol == CLIENT_LOCAL ? " (local)" : "");
+        Client* c = client_create(fd);
+        if (c == NULL) {
+            close(fd);
+        } else {
+            c->protocol = protocol;
+            mctx->clients[mctx->nclients++] = c;
+        }
+    }
+}
 
-    Buffer* cbuffer;
-    Buffer* jpeg_buffer;
-} MainContext;
+// Unix socket for the local clients, -1 on errors
+int listen_local(const char* path) {
+    struct sockaddr_un uaddr;
+    memset(&uaddr, 0, sizeof (uaddr));
+    uaddr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof (uaddr.sun_path)) {
+        LOG_ERROR("Unix socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(uaddr.sun_path, path);
 
-void swap_buffers(MainContext * mctx) {
-    Buffer* tmp;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        LOG_ERROR("Create Unix Socket");
+        return -1;
+    }
 
-    tmp = mctx->jctx->output;
-    mctx->jctx->output = mctx->jpeg_buffer;
-    mctx->jpeg_buffer = tmp;
+    // Left by a previous run
+    unlink(path);
+    if (0 != bind(sock, (struct sockaddr*) &uaddr, sizeof (uaddr)) || 0 != listen(sock, 10)) {
+        LOG_ERROR("Error listening Unix Socket %s", path);
+        close(sock);
+        return -1;
+    }
+
+    return sock;
 }
 
-void *producer(void * arg) {
-    logger_set_thread_name("Prod");
-    LOG_TRACE("Producer starts");
-    MainContext * mctx = (MainContext *) arg;
+// Sets the camera rate from the demand of the last period: the full
+// rate for the consumers of every frame, otherwise twice the frames
+// requested, never below low_fps. Clients asking for frames as they
+// come ramp it up, doubling it every period; it falls by halves, so a
+// pause doesn't restart the camera many times.
+void adapt_rate(MainContext * mctx) {
+    time_t now = time(NULL);
+    if (mctx->low_fps == 0 || now - mctx->rate_time < RATE_PERIOD) {
+        return;
+    }
+
+    pthread_mutex_lock(&mctx->mutex);
+    // The stream may be restarted, every buffer must be back. Only
+    // this thread hands them out.
+    if (mctx->inflight > 0) {
+        pthread_mutex_unlock(&mctx->mutex);
+        return;
+    }
+
+    int fps = mctx->max_fps;
+    if (!every_frame(mctx)) {
+        fps = mctx->requests * 2 / (now - mctx->rate_time) + 1;
+    }
+    mctx->requests = 0;
+    mctx->rate_time = now;
+
+    int current = mctx->cctx->fps;
+    // Small drops are not worth a restart of the camera
+    if (fps < current && fps > current * 2 / 3) fps = current;
+    if (fps < current / 2) fps = current / 2;
+    if (fps < mctx->low_fps) fps = mctx->low_fps;
+    if (fps > mctx->max_fps) fps = mctx->max_fps;
+
+    if (fps == current) {
+        pthread_mutex_unlock(&mctx->mutex);
+        return;
+    }
+    // The stream may restart unlocked, the server doesn't flush the
+    // capture meanwhile
+    mctx->rate_changing = 1;
+    pthread_mutex_unlock(&mctx->mutex);
+
+    LOG_INFO("Frame rate %d -> %d", current, fps);
+    int failed = 0 != capture_set_fps(mctx->cctx, fps);
+
+    pthread_mutex_lock(&mctx->mutex);
+    mctx->rate_changing = 0;
+    if (failed) {
+        LOG_WARN("Frame rate fixed at %d", mctx->cctx->fps);
+        mctx->low_fps = 0;
+    }
+    pthread_mutex_unlock(&mctx->mutex);
+}
+
+// Whether an encoder tunes the Huffman tables from the frame it
+// publishes, with the mutex held: every period, and sooner when the
+// frame sizes move away from the first one compressed with them
+int huffman_due(MainContext * mctx, Worker* w, uint32_t size) {
+    if (mctx->huffman_period == 0 || mctx->huffman_tuning) return 0;
+
+    time_t now = time(NULL);
+    if (mctx->huffman_generation == 0 || now - mctx->huffman_time >= mctx->huffman_period) return 1;
+    if (w->huffman_generation != mctx->huffman_generation) return 0;
+
+    if (mctx->huffman_size == 0) {
+        mctx->huffman_size = size;
+        return 0;
+    }
+    uint32_t change = mctx->huffman_size * HUFFMAN_SCENE_CHANGE / 100;
+    // At most once a second
+    return now != mctx->huffman_time
+            && (size > mctx->huffman_size + change || size < mctx->huffman_size - change);
+}
+
+// Counts the tables of the sample copied by huffman_due()
+void tune_huffman(MainContext * mctx, uint32_t seq) {
     struct timeval t;
+    gettimeofday(&t, NULL);
+    uint64_t start = trace_now();
+    JPEGHuffman huffman;
+    int ok = 0 == jpeg_huffman_tables(mctx->huffman_sample, &huffman);
+    trace_span("Huffman", seq, start);
 
-    while (1) {
-        // Wait to dequeue
-        LOG_TRACE("Wait buffer empty");
-        gettimeofday(&t, NULL);
-        sem_wait(&mctx->empty);
-        LOG_INFO_TIME(&t, "Wait buffer empty");
+    pthread_mutex_lock(&mctx->mutex);
+    if (ok) {
+        mctx->huffman = huffman;
+        mctx->huffman_generation++;
+        mctx->huffman_size = 0;
+    }
+    mctx->huffman_time = time(NULL);
+    mctx->huffman_tuning = 0;
+    pthread_mutex_unlock(&mctx->mutex);
 
-        // Exit condition
-        if (mctx->exit) break;
-        // Take a frame
-        LOG_TRACE("Grab frame");
-        gettimeofday(&t, NULL);
-        Buffer* frame = capture_grab(mctx->cctx);
-        if (frame == NULL) {
-            // Error repeat the last frame
-            LOG_ERROR("Error grabbing a frame");
-            sem_post(&mctx->full);
-            continue;
+    if (ok) {
+        LOG_INFO_TIME(&t, "Huffman tables tuned to frame %u", seq);
+    } else {
+        LOG_ERROR("Error tuning the Huffman tables");
+    }
+}
+
+// Compresses the frames handed by the producer and publishes them
+// when the previous sequence is published
+void *encoder(void * arg) {
+    Worker* w = (Worker*) arg;
+    MainContext * mctx = w->mctx;
+    char name[16];
+    snprintf(name, sizeof (name), "Enc%d", w->index);
+    logger_set_thread_name(name);
+    trace_set_thread_name(name);
+    LOG_TRACE("Encoder starts");
+    JPEGEncoder* jctx = w->jctx;
+    struct timeval t;
+    uint64_t start;
+
+    while (1) {
+        pthread_mutex_lock(&mctx->mutex);
+        while (w->input == NULL && !mctx->exit) {
+            pthread_cond_wait(&w->cond, &mctx->mutex);
         }
-        LOG_INFO_TIME(&t, "Grab frame");
+        Buffer* frame = w->input;
+        pthread_mutex_unlock(&mctx->mutex);
 
-        LOG_TRACE("Frame size %lu", frame->used);
+        // Exit condition, once the frames handed are published
+        if (frame == NULL) break;
+
+        Frame* next = w->next;
 
         //JPEG Compress
         LOG_TRACE("JPEG Compress");
         gettimeofday(&t, NULL);
-        mctx->jctx->input = frame;
+        start = trace_now();
+        jctx->input = frame;
+        jctx->output = next->jpeg;
+
+        // Stream it to the waiting clients, once the previous one is sent
+        pthread_mutex_lock(&mctx->mutex);
+        int stream = mctx->streamers > 0 && mctx->stream_state == STREAM_IDLE;
+        // Only the local readers and the variants use the raw frames
+        int keep_raw = mctx->shm != NULL || time(NULL) - mctx->raw_wanted < RAW_KEEP;
+        if (stream) {
+            mctx->stream->used = 0;
+            mctx->stream_seq = next->seq;
+            mctx->stream_notified = 0;
+            mctx->stream_failed = 0;
+            mctx->stream_state = STREAM_COMPRESSING;
+        }
+        if (w->huffman_generation != mctx->huffman_generation) {
+            w->huffman = mctx->huffman;
+            w->huffman_generation = mctx->huffman_generation;
+            jctx->huffman = &w->huffman;
+        }
+        pthread_mutex_unlock(&mctx->mutex);
+        jctx->progress = stream ? stream_progress : NULL;
+        jctx->progress_arg = mctx;
 
         // Write out the raw image
         /*
         FILE* f = fopen("test.yuyv", "wb");
-        fwrite(mctx->jctx->input->data, 1, mctx->jctx->input->used, f);
+        fwrite(jctx->input->data, 1, jctx->input->used, f);
         fclose(f);
          */
 
-        jpeg_compress(mctx->jctx);
+        int failed = 0 != jpeg_compress(jctx);
+        if (failed) {
+            LOG_ERROR("Error compressing frame %u", next->seq);
+            next->jpeg->used = 0;
+        }
         LOG_INFO_TIME(&t, "JPEG Compress");
+        trace_span("Compress", next->seq, start);
+
+        if (stream) {
+            stream_progress(jctx, next->jpeg->used);
+            pthread_mutex_lock(&mctx->mutex);
+            mctx->stream_state = STREAM_DONE;
+            mctx->stream_failed = failed;
+            pthread_mutex_unlock(&mctx->mutex);
+        }
 
-        LOG_TRACE("JPEG size %lu", mctx->jctx->output->used);
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        next->encode_time = (now.tv_sec - t.tv_sec) * 1000000 + (now.tv_usec - t.tv_usec);
 
-        // Notify buffer full
-        LOG_TRACE("Notify buffer available");
-        sem_post(&mctx->full);
+        LOG_TRACE("JPEG size %lu", next->jpeg->used);
 
-        // Release capture buffer
+        // Keep the raw frame for other modes
+        next->raw->used = 0;
+        if (keep_raw && 0 > buffer_copy(next->raw, frame)) {
+            LOG_ERROR("Error copying raw frame");
+            // Ignore
+        }
+
+        // Release capture buffer, the camera can fill it again
         if (0 > capture_release_buffer(mctx->cctx, frame)) {
             LOG_ERROR("Error releasing buffer");
             // Ignore
         }
+
+        // Wait the previous frames
+        start = trace_now();
+        pthread_mutex_lock(&mctx->mutex);
+        while (mctx->published + 1 != next->seq) {
+            pthread_cond_wait(&mctx->turn_cond, &mctx->mutex);
+        }
+        pthread_mutex_unlock(&mctx->mutex);
+        trace_span("Wait turn", next->seq, start);
+        start = trace_now();
+
+        // Local readers get the raw frame too
+        if (mctx->shm != NULL && !failed) {
+            shm_publish(mctx->shm, next, next->raw, jctx->mode);
+        }
+
+        if (mctx->recorder != NULL && !failed) {
+            recorder_append(mctx->recorder, next, jctx->mode);
+        }
+
+        if (mctx->ring != NULL && !failed) {
+            ring_append(mctx->ring, next, jctx->mode);
+        }
+
+        // The server may send several frames of a burst at once, its
+        // slot is free once every client sent the frame before. A
+        // failed one is kept empty and sent as lost.
+        Frame* slot = NULL;
+        pthread_mutex_lock(&mctx->mutex);
+        if (mctx->bursts > 0 && next->seq <= mctx->burst_last) {
+            while (mctx->bursts > 0 && next->seq > mctx->burst_sent + BURST_SLOTS && !mctx->exit) {
+                pthread_cond_wait(&mctx->burst_cond, &mctx->mutex);
+            }
+            slot = mctx->burst_frames[next->seq % BURST_SLOTS];
+            slot->seq = 0;
+        }
+        pthread_mutex_unlock(&mctx->mutex);
+        if (slot != NULL && 0 != keep_frame(slot, next)) {
+            LOG_ERROR("Error keeping burst frame");
+            slot->jpeg->used = 0;
+        }
+
+        // Publish the frame
+        LOG_TRACE("Notify frame available");
+        pthread_mutex_lock(&mctx->mutex);
+        if (!failed) {
+            w->next = mctx->ready;
+            mctx->ready = next;
+        } else {
+            // Like a grab error, the waiting clients get the last frame again
+            mctx->failed = 1;
+        }
+        if (slot != NULL) {
+            slot->seq = next->seq;
+        }
+        int notify = mctx->ring != NULL || mctx->watchers > 0 || mctx->waiters > 0 || mctx->bursts > 0;
+        pthread_mutex_unlock(&mctx->mutex);
+
+        if (mctx->multicast != NULL && !failed) {
+            multicast_send(mctx->multicast, next);
+        }
+
+        // Wake up the server for the streaming clients
+        if (notify) {
+            notify_server(mctx);
+        }
+
+        // Next frame in turn, and this encoder free. The frame is not
+        // reused before the next one is published, it can be copied.
+        pthread_mutex_lock(&mctx->mutex);
+        int tune = !failed && huffman_due(mctx, w, next->jpeg->used);
+        if (tune) {
+            mctx->huffman_tuning = 1;
+            if (0 > buffer_copy(mctx->huffman_sample, next->jpeg)) {
+                LOG_ERROR("Error copying Huffman sample");
+                tune = 0;
+                mctx->huffman_tuning = 0;
+            }
+        }
+        mctx->published = next->seq;
+        pthread_cond_broadcast(&mctx->turn_cond);
+        w->input = NULL;
+        mctx->inflight--;
+        pthread_cond_signal(&mctx->free_cond);
+        pthread_mutex_unlock(&mctx->mutex);
+        trace_span("Publish", next->seq, start);
+
+        // Off the path of the frames, the producer may wait for this
+        // encoder when all are busy
+        if (tune) {
+            tune_huffman(mctx, next->seq);
+        }
+    }
+
+    LOG_TRACE("Encoder exit");
+    pthread_exit(0);
+}
+
+// Switches the camera to the size asked and the encoders with it, with
+// no frame in flight. The mutex is only taken for the encoders, the
+// server keeps running meanwhile and may flush the capture.
+void resize_capture(MainContext * mctx, int width, int height) {
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    int old_width = mctx->cctx->width;
+    int old_height = mctx->cctx->height;
+    if (0 != capture_set_size(mctx->cctx, width, height)) {
+        LOG_ERROR("Error changing the capture size");
+    } else if (mctx->shm != NULL && !shm_fits(mctx->shm, mctx->cctx->width, mctx->cctx->height)) {
+        // The driver rounded up past the slots, keep the old size
+        LOG_WARN("Capture size %dx%d bigger than the shared memory slots", mctx->cctx->width, mctx->cctx->height);
+        if (0 != capture_set_size(mctx->cctx, old_width, old_height)) {
+            LOG_ERROR("Error restoring the capture size");
+        }
+    }
+    LOG_INFO_TIME(&t, "Capture size %dx%d -> %dx%d", old_width, old_height, mctx->cctx->width, mctx->cctx->height);
+
+    pthread_mutex_lock(&mctx->mutex);
+    int i;
+    for (i = 0; i < mctx->nworkers; i++) {
+        mctx->workers[i].jctx->width = mctx->cctx->width;
+        mctx->workers[i].jctx->height = mctx->cctx->height;
+    }
+    pthread_mutex_unlock(&mctx->mutex);
+}
+
+// A free encoder, with the mutex held
+Worker* free_worker(MainContext * mctx) {
+    int i;
+    for (i = 0; i < mctx->nworkers; i++) {
+        if (mctx->workers[i].input == NULL) {
+            return &mctx->workers[i];
+        }
+    }
+    return NULL;
+}
+
+// Grabs the frames on demand and hands them to the encoders, so the
+// next frame is grabbed while the previous ones are compressed
+void *producer(void * arg) {
+    logger_set_thread_name("Prod");
+    trace_set_thread_name("Prod");
+    LOG_TRACE("Producer starts");
+    MainContext * mctx = (MainContext *) arg;
+    struct timeval t;
+    uint64_t start;
+
+    int i;
+    for (i = 0; i < mctx->nworkers; i++) {
+        pthread_create(&mctx->workers[i].thread, NULL, &encoder, &mctx->workers[i]);
+    }
+
+    while (1) {
+        // Wait until a frame is wanted, always when recording
+        LOG_TRACE("Wait frame demand");
+        gettimeofday(&t, NULL);
+        start = trace_now();
+        pthread_mutex_lock(&mctx->mutex);
+        int idle = 0;
+        while (!mctx->exit && !mctx->wanted && !continuous(mctx) && !idle) {
+            if (mctx->low_fps > 0) {
+                // Wake up to lower the rate while idle
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec += RATE_PERIOD;
+                idle = (ETIMEDOUT == pthread_cond_timedwait(&mctx->demand_cond, &mctx->mutex, &ts));
+            } else {
+                pthread_cond_wait(&mctx->demand_cond, &mctx->mutex);
+            }
+        }
+        if (idle) {
+            pthread_mutex_unlock(&mctx->mutex);
+            adapt_rate(mctx);
+            continue;
+        }
+        mctx->wanted = 0;
+        int notify = mctx->ring != NULL || mctx->watchers > 0 || mctx->waiters > 0;
+        int exit = mctx->exit;
+        pthread_mutex_unlock(&mctx->mutex);
+        LOG_INFO_TIME(&t, "Wait frame demand");
+        trace_span("Wait demand", mctx->seq + 1, start);
+
+        // Exit condition
+        if (exit) break;
+        adapt_rate(mctx);
+
+        // All the encoders busy, the camera keeps the frame meanwhile
+        start = trace_now();
+        pthread_mutex_lock(&mctx->mutex);
+        Worker* w;
+        while ((w = free_worker(mctx)) == NULL) {
+            pthread_cond_wait(&mctx->free_cond, &mctx->mutex);
+        }
+        if (mctx->resize_width > 0) {
+            // The stream restarts, every buffer must be back
+            while (mctx->inflight > 0) {
+                pthread_cond_wait(&mctx->free_cond, &mctx->mutex);
+            }
+            int width = mctx->resize_width;
+            int height = mctx->resize_height;
+            mctx->resize_width = 0;
+            mctx->resize_height = 0;
+            // Only the producer hands out buffers, renegotiate unlocked
+            pthread_mutex_unlock(&mctx->mutex);
+            resize_capture(mctx, width, height);
+        } else {
+            pthread_mutex_unlock(&mctx->mutex);
+        }
+        trace_span("Wait encoder", mctx->seq + 1, start);
+
+        // Take a frame
+        LOG_TRACE("Grab frame");
+        gettimeofday(&t, NULL);
+        start = trace_now();
+        Buffer* frame = capture_grab(mctx->cctx);
+        if (frame == NULL) {
+            // Error repeat the last frame
+            LOG_ERROR("Error grabbing a frame");
+            pthread_mutex_lock(&mctx->mutex);
+            mctx->failed = 1;
+            pthread_mutex_unlock(&mctx->mutex);
+            if (notify) {
+                notify_server(mctx);
+            }
+            continue;
+        }
+        LOG_INFO_TIME(&t, "Grab frame");
+        trace_span("Grab", mctx->seq + 1, start);
+
+        LOG_TRACE("Frame size %lu", frame->used);
+
+        pthread_mutex_lock(&mctx->mutex);
+        if (mctx->resize_width > 0) {
+            // Grabbed at the previous size, after the waiting clients
+            pthread_mutex_unlock(&mctx->mutex);
+            capture_release_buffer(mctx->cctx, frame);
+            continue;
+        }
+        w->next->seq = ++mctx->seq;
+        w->next->width = mctx->cctx->width;
+        w->next->height = mctx->cctx->height;
+        gettimeofday(&w->next->timestamp, NULL);
+        w->input = frame;
+        mctx->inflight++;
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&mctx->mutex);
+    }
+
+    // The encoders finish the frames handed
+    pthread_mutex_lock(&mctx->mutex);
+    for (i = 0; i < mctx->nworkers; i++) {
+        pthread_cond_signal(&mctx->workers[i].cond);
+    }
+    pthread_mutex_unlock(&mctx->mutex);
+    for (i = 0; i < mctx->nworkers; i++) {
+        pthread_join(mctx->workers[i].thread, NULL);
     }
 
     LOG_TRACE("Producer exit");
@@ -105,19 +2137,148 @@ int main(int ac, char** av) {
     MainContext mctx;
     memset(&mctx, 0, sizeof (mctx));
 
-    // JPEG Buffer
-    mctx.jpeg_buffer = buffer_create();
+    // Options
+    JPEGMode mode = JPEG_MODE_COLOR;
+    JPEGSampling sampling = JPEG_SAMPLING_DEFAULT;
+    int opt;
+    char* record = NULL;
+    int segment_size = 64;
+    int retention = 3600;
+    int pre_event = 0;
+    int pre_event_size = 0;
+    char* multicast = NULL;
+    int multicast_rate = 0;
+    char* shm = NULL;
+    char* local = NULL;
+    char* device = NULL;
+    mctx.memfd = -1;
+    mctx.stall_timeout = STALL_TIMEOUT;
+    mctx.nworkers = 1;
+    while ((opt = getopt(ac, av, "gt:r:s:k:p:P:w:m:M:S:u:d:T:F:e:c:H:")) != -1) {
+        switch (opt) {
+            case 'g':
+                mode = JPEG_MODE_GRAY;
+                break;
+            case 't':
+                if (0 != jpeg_transform_parse(optarg, &mctx.transform)) {
+                    fprintf(stderr, "Unknown transform: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'r':
+                record = optarg;
+                break;
+            case 's':
+                segment_size = atoi(optarg);
+                break;
+            case 'k':
+                retention = atoi(optarg);
+                break;
+            case 'p':
+                pre_event = atof(optarg) * 1000;
+                break;
+            case 'P':
+                pre_event_size = atoi(optarg);
+                break;
+            case 'w':
+                mctx.stall_timeout = atoi(optarg);
+                break;
+            case 'm':
+                multicast = optarg;
+                break;
+            case 'M':
+                multicast_rate = atoi(optarg);
+                break;
+            case 'S':
+                shm = optarg;
+                break;
+            case 'u':
+                local = optarg;
+                break;
+            case 'd':
+                device = optarg;
+                break;
+            case 'T':
+                mctx.trace = optarg;
+                break;
+            case 'F':
+                mctx.low_fps = atoi(optarg);
+                break;
+            case 'e':
+                mctx.nworkers = atoi(optarg);
+                break;
+            case 'c':
+                if (0 == strcmp(optarg, "420")) {
+                    sampling = JPEG_SAMPLING_420;
+                } else if (0 == strcmp(optarg, "422")) {
+                    sampling = JPEG_SAMPLING_422;
+                } else {
+                    fprintf(stderr, "Unknown chroma subsampling: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'H':
+                mctx.huffman_period = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-d device|test] [-g] [-t 90|180|270|h|v] [-r dir] [-s segment MB] [-k retention seconds]"
+                        " [-p pre-event seconds] [-P pre-event MB] [-w stall seconds]"
+                        " [-m group:port[:interface]] [-M multicast kbit/s]"
+                        " [-S shared memory name]"
+                        " [-u unix socket] [-T trace file] [-F idle fps] [-e encoders] [-c 420|422]"
+                        " [-H Huffman seconds]\n", av[0]);
+                return -1;
+        }
+    }
+
+    // Tracing, before any thread starts
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    if (mctx.trace != NULL) {
+        LOG_INFO("Tracing to %s, dumped on SIGUSR1 and at exit", mctx.trace);
+        trace_init(TRACE_EVENTS);
+        trace_set_thread_name("Main");
+
+        // Only the main thread is interrupted
+        struct sigaction sa;
+        memset(&sa, 0, sizeof (sa));
+        sa.sa_handler = request_trace_dump;
+        sigaction(SIGUSR1, &sa, NULL);
+        pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+    }
+
+    if (mctx.nworkers < 1 || mctx.nworkers > MAX_WORKERS) {
+        fprintf(stderr, "Encoders must be between 1 and %d\n", MAX_WORKERS);
+        return -1;
+    }
+
+    // Frames
+    mctx.ready = frame_create();
+    mctx.frame = frame_create();
+    mctx.variants = variant_cache_create(VARIANT_CACHE_SIZE);
+    mctx.stats_buffer = buffer_create();
+    mctx.stream = buffer_create();
+    mctx.huffman_sample = buffer_create();
 
-    // Semaphores to sync threads
-    LOG_TRACE("Initialize semaphores");
-    sem_init(&mctx.full, 0, 0);
-    sem_init(&mctx.empty, 0, 1);
+    // Conditions to sync threads
+    LOG_TRACE("Initialize conditions");
+    pthread_mutex_init(&mctx.mutex, NULL);
+    pthread_cond_init(&mctx.demand_cond, NULL);
+    pthread_cond_init(&mctx.free_cond, NULL);
+    pthread_cond_init(&mctx.turn_cond, NULL);
+    pthread_cond_init(&mctx.burst_cond, NULL);
 
     // Capture context
     LOG_TRACE("Create Capture Context");
     mctx.cctx = capture_create();
-    mctx.cctx->width = 16000;
-    mctx.cctx->height = 12000;
+    if (device != NULL) {
+        strncpy(mctx.cctx->dev, device, sizeof (mctx.cctx->dev) - 1);
+    }
+    mctx.cctx->width = MAX_WIDTH;
+    mctx.cctx->height = MAX_HEIGHT;
+    // One frame held by each encoder, and two being filled
+    mctx.cctx->buffers = mctx.nworkers + 2;
 
     // Init the webcam
     LOG_INFO("Initialize Capture");
@@ -125,16 +2286,136 @@ int main(int ac, char** av) {
         return -1;
     }
 
+    // The rate of the camera is the highest one
+    mctx.max_fps = mctx.cctx->fps;
+    if (mctx.low_fps > 0 && mctx.max_fps <= mctx.low_fps) {
+        LOG_WARN("Camera rate %d fps, not lowered", mctx.max_fps);
+        mctx.low_fps = 0;
+    }
+    mctx.rate_time = time(NULL);
+
     // JPEG context
     LOG_TRACE("Create JPEG Context");
     mctx.jctx = jpeg_create_encoder();
     mctx.jctx->width = mctx.cctx->width;
     mctx.jctx->height = mctx.cctx->height;
     mctx.jctx->quality = 80;
-    mctx.jctx->output = buffer_create();
+    mctx.jctx->mode = mode;
+    mctx.jctx->sampling = sampling;
 
     jpeg_init(mctx.jctx);
 
+    // Encoders, the first one with the main JPEG context
+    LOG_TRACE("Create %d encoders", mctx.nworkers);
+    mctx.workers = calloc(mctx.nworkers, sizeof (Worker));
+    int i;
+    for (i = 0; i < mctx.nworkers; i++) {
+        Worker* w = &mctx.workers[i];
+        w->mctx = &mctx;
+        w->index = i;
+        w->next = frame_create();
+        pthread_cond_init(&w->cond, NULL);
+        if (i == 0) {
+            w->jctx = mctx.jctx;
+            continue;
+        }
+        w->jctx = jpeg_create_encoder();
+        w->jctx->width = mctx.jctx->width;
+        w->jctx->height = mctx.jctx->height;
+        w->jctx->quality = mctx.jctx->quality;
+        w->jctx->mode = mctx.jctx->mode;
+        w->jctx->sampling = mctx.jctx->sampling;
+        jpeg_init(w->jctx);
+    }
+
+    // Copies of the burst frames
+    for (i = 0; i < BURST_SLOTS; i++) {
+        mctx.burst_frames[i] = frame_create();
+    }
+    mctx.burst_buffer = buffer_create();
+
+    // JPEG context for the other modes
+    LOG_TRACE("Create JPEG Variant Context");
+    mctx.vctx = jpeg_create_encoder();
+    mctx.vctx->width = mctx.cctx->width;
+    mctx.vctx->height = mctx.cctx->height;
+    mctx.vctx->quality = mctx.jctx->quality;
+    mctx.vctx->mode = mode;
+    mctx.vctx->sampling = sampling;
+
+    jpeg_init(mctx.vctx);
+
+    // Recording
+    if (record != NULL) {
+        LOG_INFO("Recording to %s", record);
+        mctx.recorder = recorder_create();
+        strncpy(mctx.recorder->path, record, sizeof (mctx.recorder->path) - 1);
+        mctx.recorder->segment_size = segment_size * 1024 * 1024;
+        mctx.recorder->retention = retention;
+        mctx.recorder->found = recorded_found;
+        mctx.recorder->found_arg = &mctx;
+        if (0 != recorder_init(mctx.recorder)) {
+            return -1;
+        }
+        mctx.record_buffer = buffer_create();
+    }
+
+    // Pre-event ring
+    if (pre_event > 0 || pre_event_size > 0) {
+        LOG_INFO("Pre-event ring of %d ms, %d MB", pre_event, pre_event_size);
+        mctx.ring = ring_create();
+        mctx.ring->duration = pre_event;
+        if (pre_event_size > 0) {
+            mctx.ring->size = pre_event_size * 1024 * 1024;
+        }
+        if (0 != ring_init(mctx.ring)) {
+            return -1;
+        }
+        mctx.ring_buffer = buffer_create();
+    }
+
+    // Multicast
+    if (multicast != NULL) {
+        LOG_INFO("Multicast to %s", multicast);
+        mctx.multicast = multicast_create();
+        char* port = strchr(multicast, ':');
+        if (port == NULL) {
+            fprintf(stderr, "Multicast port expected: %s\n", multicast);
+            return -1;
+        }
+        *port++ = '\0';
+        char* interface = strchr(port, ':');
+        if (interface != NULL) {
+            *interface++ = '\0';
+            strncpy(mctx.multicast->interface, interface, sizeof (mctx.multicast->interface) - 1);
+        }
+        strncpy(mctx.multicast->address, multicast, sizeof (mctx.multicast->address) - 1);
+        mctx.multicast->port = atoi(port);
+        mctx.multicast->rate = multicast_rate;
+        if (0 != multicast_init(mctx.multicast)) {
+            return -1;
+        }
+    }
+
+    // Shared memory
+    if (shm != NULL) {
+        LOG_INFO("Shared memory %s", shm);
+        mctx.shm = shm_create();
+        strncpy(mctx.shm->name, shm, sizeof (mctx.shm->name) - 1);
+        mctx.shm->width = mctx.cctx->width;
+        mctx.shm->height = mctx.cctx->height;
+        if (0 != shm_init(mctx.shm)) {
+            return -1;
+        }
+    }
+
+    if (0 != pipe(mctx.notify)) {
+        LOG_ERROR("Creating notification pipe");
+        return -1;
+    }
+    fcntl(mctx.notify[0], F_SETFL, O_NONBLOCK);
+    fcntl(mctx.notify[1], F_SETFL, O_NONBLOCK);
+
     // Start capture thread
     LOG_TRACE("Launch producer thread");
     pthread_t prod;
@@ -172,65 +2453,111 @@ int main(int ac, char** av) {
         return -1;
     }
 
-    int r;
-    unsigned char cmd;
-    time_t last = time(NULL);
-    while (!mctx.exit) {
-        LOG_INFO("Waiting a connection...");
-        int client = accept(sock, NULL, NULL);
-        if (client < 0) {
-            LOG_ERROR("Error accepting connection");
+    int usock = -1;
+    if (local != NULL) {
+        LOG_INFO("Local clients on %s", local);
+        usock = listen_local(local);
+        if (usock < 0) {
             return -1;
         }
+    }
 
-        LOG_INFO("Connection established");
-        mctx.client = client;
-
-        r = read(mctx.client, &cmd, sizeof (unsigned char));
-        if (r <= 0) {
-            LOG_ERROR("Error reading command");
-        } else if (cmd == 'q') {
-            LOG_INFO("Exit command received");
-            mctx.exit = 1;
-            // Signal Producer (TO FINISH)
-            LOG_TRACE("Signaling producer thread to finish him");
-            sem_post(&mctx.empty);
-        } else if (cmd == 'f') {
-            LOG_INFO("Frame command received");
-            time_t now = time(NULL);
-            if (now - last > 10) {
-                LOG_INFO("New connection after %d seconds idle", now - last);
-
-                // Flush capture buffers
-                LOG_INFO("Flush V4L2 buffers");
-                capture_flush(mctx.cctx);
-                // The next frame has been already processed by the producer
-                LOG_INFO("Skip old frame");
-                sem_wait(&mctx.full);
-                LOG_TRACE("Signaling producer thread to grab a new frame");
-                sem_post(&mctx.empty);
-            }
-            last = now;
-
-            // Wait a frame
-            LOG_TRACE("Waiting for a frame buffer filled");
-            sem_wait(&mctx.full);
-            // Swap the buffers to generate a new frame while sending
-            swap_buffers(&mctx);
-            // Signal Producer
-            LOG_TRACE("Signaling producer thread to fill the buffer again");
-            sem_post(&mctx.empty);
-
-            LOG_TRACE("Sending frame");
-            ssize_t w = write(mctx.client, mctx.jpeg_buffer->data, mctx.jpeg_buffer->used);
-            LOG_TRACE("%ld bytes sent", w);
-        } else {
-            LOG_WARN("Command '%c' unknown", cmd);
+    if (mctx.trace != NULL) {
+        pthread_sigmask(SIG_UNBLOCK, &usr1, NULL);
+    }
+
+    mctx.last = time(NULL);
+    mctx.started = mctx.last;
+    // Listeners, producer notifications and clients
+    struct pollfd fds[MAX_CLIENTS + FIXED_FDS];
+    while (!mctx.exit) {
+        if (dump_trace) {
+            dump_trace = 0;
+            trace_dump(mctx.trace);
+        }
+
+        fds[0].fd = sock;
+        fds[0].events = POLLIN;
+        fds[1].fd = mctx.notify[0];
+        fds[1].events = POLLIN;
+        // Ignored by poll when disabled
+        fds[2].fd = usock;
+        fds[2].events = POLLIN;
+        int i;
+        for (i = 0; i < mctx.nclients; i++) {
+            // Requests are only read once the responses are sent
+            fds[i + FIXED_FDS].fd = mctx.clients[i]->fd;
+            Client* c = mctx.clients[i];
+            fds[i + FIXED_FDS].events = !client_idle(c) ? POLLOUT : (c->eof ? 0 : POLLIN);
+        }
+
+        // Wake up to check the stalled clients
+        if (0 > poll(fds, mctx.nclients + FIXED_FDS, 1000)) {
+            // Interrupted by SIGUSR1
+            if (errno != EINTR) {
+                LOG_ERROR("Error waiting connections");
+            }
+            errno = 0;
+            continue;
+        }
+
+        // Serve the clients with data
+        time_t now = time(NULL);
+        int nfds = mctx.nclients + FIXED_FDS;
+        for (i = FIXED_FDS; i < nfds && !mctx.exit; i++) {
+            Client* c = mctx.clients[i - FIXED_FDS];
+            int done = 0;
+            if (fds[i].revents & POLLOUT) {
+                uint64_t start = trace_now();
+                done = (0 > client_flush(c));
+                trace_span("Flush", c->streaming ? c->last_seq : 0, start);
+            } else if (fds[i].revents != 0) {
+                done = (0 > client_read(c));
+            }
+
+            if (!done && !c->closing && client_idle(c) && (fds[i].revents != 0 || c->input->used > 0)) {
+                c->closing = serve_client(&mctx, c);
+            }
+
+            if (!done && !client_idle(c) && now - c->progress > mctx.stall_timeout) {
+                LOG_WARN("Connection stalled for %d seconds", mctx.stall_timeout);
+                done = 1;
+            }
+
+            if (done || (c->closing && client_idle(c))) {
+                close_client(&mctx, i - FIXED_FDS);
+            }
+        }
+
+        // New frames for the streaming clients
+        if (fds[1].revents & POLLIN) {
+            publish_live(&mctx);
+        }
+
+        // Compact the closed clients
+        int j = 0;
+        for (i = 0; i < mctx.nclients; i++) {
+            if (mctx.clients[i] != NULL) {
+                mctx.clients[j++] = mctx.clients[i];
+            }
+        }
+        mctx.nclients = j;
+
+        if (fds[0].revents & POLLIN) {
+            accept_client(&mctx, sock, CLIENT_TEXT);
+        }
+
+        if (fds[2].revents & POLLIN) {
+            accept_client(&mctx, usock, CLIENT_LOCAL);
         }
+    }
 
-        LOG_INFO("Closing connection");
-        close(client);
+    LOG_TRACE("Close connections");
+    for (i = 0; i < mctx.nclients; i++) {
+        client_flush(mctx.clients[i]);
+        close_client(&mctx, i);
     }
+    mctx.nclients = 0;
 
     // Wait the producer to finish
     LOG_TRACE("Waiting producer to finish");
@@ -241,19 +2568,108 @@ int main(int ac, char** av) {
     LOG_TRACE("Close socket");
     close(sock);
 
-    LOG_TRACE("Free semaphores");
-    sem_destroy(&mctx.full);
-    sem_destroy(&mctx.empty);
+    if (usock >= 0) {
+        close(usock);
+        unlink(local);
+    }
+
+    if (mctx.memfd >= 0) {
+        close(mctx.memfd);
+    }
+
+    close(mctx.notify[0]);
+    close(mctx.notify[1]);
+
+    LOG_TRACE("Free conditions");
+    pthread_mutex_destroy(&mctx.mutex);
+    pthread_cond_destroy(&mctx.demand_cond);
+    pthread_cond_destroy(&mctx.free_cond);
+    pthread_cond_destroy(&mctx.turn_cond);
+    pthread_cond_destroy(&mctx.burst_cond);
+
+    if (mctx.recorder != NULL) {
+        LOG_TRACE("Close recorder");
+        recorder_destroy(mctx.recorder);
+        mctx.recorder = NULL;
+    }
+
+    if (mctx.record_buffer != NULL) {
+        buffer_destroy(mctx.record_buffer);
+        mctx.record_buffer = NULL;
+    }
+
+    if (mctx.ring != NULL) {
+        LOG_TRACE("Free pre-event ring");
+        ring_destroy(mctx.ring);
+        mctx.ring = NULL;
+    }
+
+    if (mctx.ring_buffer != NULL) {
+        buffer_destroy(mctx.ring_buffer);
+        mctx.ring_buffer = NULL;
+    }
+
+    if (mctx.multicast != NULL) {
+        LOG_TRACE("Close multicast");
+        multicast_destroy(mctx.multicast);
+        mctx.multicast = NULL;
+    }
+
+    if (mctx.shm != NULL) {
+        LOG_TRACE("Close shared memory");
+        shm_destroy(mctx.shm);
+        mctx.shm = NULL;
+    }
+
+    if (mctx.stats_buffer != NULL) {
+        buffer_destroy(mctx.stats_buffer);
+        mctx.stats_buffer = NULL;
+    }
+
+    if (mctx.stream != NULL) {
+        buffer_destroy(mctx.stream);
+        mctx.stream = NULL;
+    }
+
+    if (mctx.huffman_sample != NULL) {
+        buffer_destroy(mctx.huffman_sample);
+        mctx.huffman_sample = NULL;
+    }
+
+    for (i = 0; i < BURST_SLOTS; i++) {
+        frame_destroy(mctx.burst_frames[i]);
+        mctx.burst_frames[i] = NULL;
+    }
+    buffer_destroy(mctx.burst_buffer);
+    mctx.burst_buffer = NULL;
+
+    LOG_TRACE("Free encoders");
+    for (i = 0; i < mctx.nworkers; i++) {
+        Worker* w = &mctx.workers[i];
+        frame_destroy(w->next);
+        pthread_cond_destroy(&w->cond);
+        if (i > 0) {
+            jpeg_destroy_encoder(w->jctx);
+        }
+    }
+    free(mctx.workers);
+    mctx.workers = NULL;
 
     LOG_TRACE("Free buffers");
-    if (mctx.jpeg_buffer != NULL) {
-        buffer_destroy(mctx.jpeg_buffer);
-        mctx.jpeg_buffer = NULL;
+
+    if (mctx.ready != NULL) {
+        frame_destroy(mctx.ready);
+        mctx.ready = NULL;
+    }
+
+    if (mctx.frame != NULL) {
+        frame_destroy(mctx.frame);
+        mctx.frame = NULL;
     }
 
-    if (mctx.jctx->output != NULL) {
-        buffer_destroy(mctx.jctx->output);
-        mctx.jctx->output = NULL;
+    if (mctx.variants != NULL) {
+        variant_cache_destroy(mctx.variants);
+        mctx.variants = NULL;
     }
 
     LOG_TRACE("Free capture context");
@@ -268,6 +2684,16 @@ int main(int ac, char** av) {
         return -1;
     }
 
+    if (0 != jpeg_destroy_encoder(mctx.vctx)) {
+        LOG_WARN("Error cleaning JPEG variant context");
+        return -1;
+    }
+
+    if (mctx.trace != NULL) {
+        trace_dump(mctx.trace);
+        trace_destroy();
+    }
+
     LOG_TRACE("Close logger");
     logger_destroy();
 
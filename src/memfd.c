@@ -0,0 +1,42 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "memfd.h"
+#include "log.h"
+
+// Copies the buffer to a new memfd and seals it, the receivers can
+// map it but nobody can change it any more. Returns the fd or -1.
+int memfd_from_buffer(const char* name, const Buffer* b) {
+    int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        LOG_ERROR("Error creating memfd");
+        return -1;
+    }
+
+    uint32_t written = 0;
+    while (written < b->used) {
+        ssize_t w = write(fd, b->data + written, b->used - written);
+        if (w < 0) {
+            if (errno == EINTR) {
+                errno = 0;
+                continue;
+            }
+            LOG_ERROR("Error writing memfd");
+            close(fd);
+            return -1;
+        }
+        written += w;
+    }
+
+    if (0 != fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) {
+        LOG_ERROR("Error sealing memfd");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
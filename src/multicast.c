@@ -0,0 +1,334 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "multicast.h"
+#include "log.h"
+#include "trace.h"
+
+// A sender thread fragments the last frame given and sends the
+// datagrams in bursts with sendmmsg, sleeping between bursts to keep
+// the rate. A frame given while another one is waiting replaces it.
+
+// Datagrams per sendmmsg
+#define MCAST_BURST 32
+
+typedef struct IMulticast IMulticast;
+
+struct IMulticast {
+    Multicast m;
+
+    int fd;
+    struct sockaddr_in addr;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int running;
+    int stop;
+
+    // Frame waiting and frame being sent
+    Buffer* pending;
+    MulticastHeader pending_header;
+    Buffer* sending;
+    MulticastHeader sending_header;
+    uint32_t drops;
+    uint32_t packet;
+
+    // Pacing
+    struct timespec next;
+};
+
+static uint8_t* put_u16(uint8_t* p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+    return p + 2;
+}
+
+static uint8_t* put_u32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+static uint32_t get_u32(const uint8_t* p) {
+    return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+int multicast_write_header(uint8_t* out, const MulticastHeader* h) {
+    uint8_t* p = out;
+    p = put_u32(p, MCAST_MAGIC);
+    p = put_u32(p, h->packet);
+    p = put_u32(p, h->seq);
+    p = put_u32(p, h->timestamp >> 32);
+    p = put_u32(p, h->timestamp);
+    p = put_u32(p, h->size);
+    p = put_u16(p, h->index);
+    p = put_u16(p, h->count);
+    return p - out;
+}
+
+int multicast_parse_header(const uint8_t* data, int len, MulticastHeader* h) {
+    if (len < MCAST_HEADER_SIZE || get_u32(data) != MCAST_MAGIC) {
+        return -1;
+    }
+
+    h->packet = get_u32(data + 4);
+    h->seq = get_u32(data + 8);
+    h->timestamp = ((uint64_t) get_u32(data + 12) << 32) | get_u32(data + 16);
+    h->size = get_u32(data + 20);
+    h->index = (data[24] << 8) | data[25];
+    h->count = (data[26] << 8) | data[27];
+
+    if (h->index >= h->count) {
+        return -1;
+    }
+
+    return MCAST_HEADER_SIZE;
+}
+
+// Waits until the bytes already sent fit the rate
+static void pace(IMulticast* im, uint32_t bytes) {
+    if (im->m.rate <= 0) return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > im->next.tv_sec || (now.tv_sec == im->next.tv_sec && now.tv_nsec > im->next.tv_nsec)) {
+        // Idle, no credit is kept
+        im->next = now;
+    }
+
+    uint64_t ns = (uint64_t) bytes * 8 * 1000000 / im->m.rate;
+    im->next.tv_nsec += ns % 1000000000;
+    im->next.tv_sec += ns / 1000000000 + im->next.tv_nsec / 1000000000;
+    im->next.tv_nsec %= 1000000000;
+
+    while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &im->next, NULL));
+}
+
+static int send_frame(IMulticast* im) {
+    MulticastHeader h = im->sending_header;
+    uint8_t headers[MCAST_BURST][MCAST_HEADER_SIZE];
+    struct iovec iov[MCAST_BURST][2];
+    struct mmsghdr msgs[MCAST_BURST];
+
+    uint32_t index = 0;
+    while (index < h.count) {
+        // Header and payload point to the frame, nothing is copied
+        int n = 0;
+        uint32_t bytes = 0;
+        memset(msgs, 0, sizeof (msgs));
+        while (n < MCAST_BURST && index < h.count) {
+            uint32_t offset = index * MCAST_PAYLOAD_SIZE;
+            uint32_t len = h.size - offset < MCAST_PAYLOAD_SIZE ? h.size - offset : MCAST_PAYLOAD_SIZE;
+            h.index = index;
+            h.packet = im->packet++;
+            multicast_write_header(headers[n], &h);
+            iov[n][0].iov_base = headers[n];
+            iov[n][0].iov_len = MCAST_HEADER_SIZE;
+            iov[n][1].iov_base = im->sending->data + offset;
+            iov[n][1].iov_len = len;
+            msgs[n].msg_hdr.msg_name = &im->addr;
+            msgs[n].msg_hdr.msg_namelen = sizeof (im->addr);
+            msgs[n].msg_hdr.msg_iov = iov[n];
+            msgs[n].msg_hdr.msg_iovlen = 2;
+            bytes += MCAST_HEADER_SIZE + len;
+            n++;
+            index++;
+        }
+
+        int sent = 0;
+        while (sent < n) {
+            int r = sendmmsg(im->fd, msgs + sent, n - sent, 0);
+            if (r < 0) {
+                if (errno == EINTR) {
+                    errno = 0;
+                    continue;
+                }
+                LOG_ERROR("Error sending datagrams");
+                return -1;
+            }
+            sent += r;
+        }
+
+        pace(im, bytes);
+    }
+
+    return 0;
+}
+
+static void* sender(void* arg) {
+    logger_set_thread_name("Mcast");
+    trace_set_thread_name("Mcast");
+    IMulticast* im = (IMulticast*) arg;
+
+    pthread_mutex_lock(&im->mutex);
+    while (1) {
+        while (!im->stop && im->pending->used == 0) {
+            pthread_cond_wait(&im->cond, &im->mutex);
+        }
+        if (im->stop) break;
+
+        Buffer* tmp = im->sending;
+        im->sending = im->pending;
+        im->sending_header = im->pending_header;
+        im->pending = tmp;
+        im->pending->used = 0;
+        pthread_mutex_unlock(&im->mutex);
+
+        uint64_t start = trace_now();
+        send_frame(im);
+        trace_span("Multicast", im->sending_header.seq, start);
+
+        pthread_mutex_lock(&im->mutex);
+    }
+    pthread_mutex_unlock(&im->mutex);
+
+    return NULL;
+}
+
+Multicast* multicast_create() {
+    LOG_TRACE("Create Multicast");
+    IMulticast* im = calloc(1, sizeof (IMulticast));
+    if (im == NULL) {
+        LOG_ERROR("Creating Multicast");
+        return NULL;
+    }
+    im->fd = -1;
+    im->m.ttl = 1;
+    pthread_mutex_init(&im->mutex, NULL);
+    pthread_cond_init(&im->cond, NULL);
+    return (Multicast*) im;
+}
+
+int multicast_init(Multicast* m) {
+    IMulticast* im = (IMulticast*) m;
+
+    LOG_TRACE("Init Multicast: %s:%d, %d kbit/s", m->address, m->port, m->rate);
+    memset(&im->addr, 0, sizeof (im->addr));
+    im->addr.sin_family = AF_INET;
+    im->addr.sin_port = htons(m->port);
+    if (1 != inet_pton(AF_INET, m->address, &im->addr.sin_addr)) {
+        LOG_ERROR("Invalid multicast address: %s", m->address);
+        return -1;
+    }
+
+    im->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (im->fd < 0) {
+        LOG_ERROR("Error creating multicast socket");
+        return -1;
+    }
+
+    if (IN_MULTICAST(ntohl(im->addr.sin_addr.s_addr))) {
+        unsigned char ttl = m->ttl;
+        unsigned char loop = 1;
+        if (0 != setsockopt(im->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof (ttl))
+                || 0 != setsockopt(im->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof (loop))) {
+            LOG_ERROR("Error configuring multicast socket");
+            return -1;
+        }
+
+        if (m->interface[0] != '\0') {
+            struct in_addr ifaddr;
+            if (1 != inet_pton(AF_INET, m->interface, &ifaddr)
+                    || 0 != setsockopt(im->fd, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof (ifaddr))) {
+                LOG_ERROR("Invalid multicast interface: %s", m->interface);
+                return -1;
+            }
+        }
+    }
+
+    // Room for a few bursts
+    int sndbuf = MCAST_BURST * MCAST_DATAGRAM_SIZE * 4;
+    setsockopt(im->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof (sndbuf));
+
+    im->pending = buffer_create();
+    im->sending = buffer_create();
+    if (im->pending == NULL || im->sending == NULL) {
+        LOG_ERROR("Creating Multicast buffers");
+        return -1;
+    }
+
+    if (0 != pthread_create(&im->thread, NULL, sender, im)) {
+        LOG_ERROR("Error creating multicast thread");
+        return -1;
+    }
+    im->running = 1;
+
+    return 0;
+}
+
+int multicast_send(Multicast* m, const Frame* f) {
+    IMulticast* im = (IMulticast*) m;
+    uint32_t count = (f->jpeg->used + MCAST_PAYLOAD_SIZE - 1) / MCAST_PAYLOAD_SIZE;
+
+    if (count == 0 || count > 0xFFFF) {
+        LOG_WARN("Frame size not valid for multicast: %u", f->jpeg->used);
+        return -1;
+    }
+
+    pthread_mutex_lock(&im->mutex);
+
+    if (im->pending->used > 0) {
+        im->drops++;
+        LOG_DEBUG("Multicast frame dropped (%u)", im->drops);
+    }
+
+    if (0 > buffer_copy(im->pending, f->jpeg)) {
+        LOG_ERROR("Error copying multicast frame");
+        pthread_mutex_unlock(&im->mutex);
+        return -1;
+    }
+
+    im->pending_header.seq = f->seq;
+    im->pending_header.timestamp = (uint64_t) f->timestamp.tv_sec * 1000000 + f->timestamp.tv_usec;
+    im->pending_header.size = f->jpeg->used;
+    im->pending_header.index = 0;
+    im->pending_header.count = count;
+
+    pthread_cond_signal(&im->cond);
+    pthread_mutex_unlock(&im->mutex);
+
+    return 0;
+}
+
+int multicast_destroy(Multicast* m) {
+    IMulticast* im = (IMulticast*) m;
+
+    LOG_TRACE("Destroy Multicast");
+    if (im->running) {
+        pthread_mutex_lock(&im->mutex);
+        im->stop = 1;
+        pthread_cond_signal(&im->cond);
+        pthread_mutex_unlock(&im->mutex);
+        pthread_join(im->thread, NULL);
+    }
+
+    if (im->fd >= 0) {
+        close(im->fd);
+    }
+
+    if (im->pending != NULL) {
+        buffer_destroy(im->pending);
+    }
+
+    if (im->sending != NULL) {
+        buffer_destroy(im->sending);
+    }
+
+    pthread_mutex_destroy(&im->mutex);
+    pthread_cond_destroy(&im->cond);
+    free(im);
+
+    return 0;
+}
@@ -0,0 +1,67 @@
+#include <string.h>
+
+#include "protocol.h"
+#include "log.h"
+
+uint16_t protocol_get_u16(const uint8_t* p) {
+    return (p[0] << 8) | p[1];
+}
+
+uint32_t protocol_get_u32(const uint8_t* p) {
+    return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+uint64_t protocol_get_u64(const uint8_t* p) {
+    uint64_t v = 0;
+    int i;
+    for (i = 0; i < 8; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static uint8_t* put_u32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+static uint8_t* put_u64(uint8_t* p, uint64_t v) {
+    p = put_u32(p, v >> 32);
+    return put_u32(p, v);
+}
+
+int protocol_parse_request(const uint8_t* data, int len, Request* r) {
+    // Wait the full header
+    if (len < PROTO_REQUEST_SIZE) return 0;
+
+    r->cmd = data[0];
+    r->flags = data[1];
+    r->length = protocol_get_u16(data + 2);
+    if (r->length > PROTO_MAX_PAYLOAD) {
+        LOG_WARN("Request payload too big: %d", r->length);
+        return -1;
+    }
+
+    // Wait the full payload
+    if (len < PROTO_REQUEST_SIZE + r->length) return 0;
+
+    r->payload = data + PROTO_REQUEST_SIZE;
+    return PROTO_REQUEST_SIZE + r->length;
+}
+
+int protocol_write_response(uint8_t* out, const Response* r) {
+    uint8_t* p = out;
+    p = put_u32(p, PROTO_MAGIC);
+    *p++ = r->cmd;
+    *p++ = r->status;
+    *p++ = r->format;
+    *p++ = r->flags;
+    p = put_u32(p, r->seq);
+    p = put_u64(p, r->timestamp);
+    p = put_u32(p, r->encode_time);
+    p = put_u32(p, r->size);
+    return p - out;
+}
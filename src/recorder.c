@@ -0,0 +1,637 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "recorder.h"
+#include "log.h"
+#include "trace.h"
+
+// Frames are appended to fixed size segment files by a writer thread,
+// in batches, and synced periodically. The index is a ring of entries
+// sorted by time in a mmap'd file, so a lookup is a binary search.
+
+#define RECORDER_MAGIC 0x52574931
+// Flush the batch when it reaches this size or after the interval
+#define RECORDER_BATCH_SIZE (512 * 1024)
+#define RECORDER_FLUSH_INTERVAL 100000
+#define RECORDER_SYNC_INTERVAL 1000000
+// Index entries per second of retention
+#define RECORDER_MAX_FPS 60
+// Frames looked up at once
+#define RECORDER_MAX_LOOKUPS 16
+
+typedef enum {
+    LOOKUP_FREE,
+    LOOKUP_QUEUED,
+    LOOKUP_READING,
+    LOOKUP_DONE
+} LookupState;
+
+typedef struct {
+    LookupState state;
+    // NULL once canceled
+    void* owner;
+    uint64_t timestamp;
+    int status;
+    RecordEntry entry;
+    Buffer* data;
+} RecordLookup;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t capacity;
+    uint32_t start;
+    uint32_t count;
+    // Last segment opened and oldest segment on disk
+    uint32_t segment;
+    uint32_t first_segment;
+} RecordIndex;
+
+typedef struct IRecorder IRecorder;
+
+struct IRecorder {
+    Recorder r;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int running;
+    int stop;
+
+    // Frames appended by the producer and frames being written
+    Buffer* batch;
+    RecordEntry* entries;
+    int nentries;
+    int centries;
+    Buffer* wbatch;
+    RecordEntry* wentries;
+    int nwentries;
+    int cwentries;
+
+    // Index
+    int index_fd;
+    size_t index_len;
+    RecordIndex* index;
+    RecordEntry* ring;
+
+    // Current segment
+    int seg_fd;
+    uint32_t seg_offset;
+    uint64_t last_sync;
+
+    // Frames read for the clients, between the batches
+    RecordLookup lookups[RECORDER_MAX_LOOKUPS];
+    int queued;
+};
+
+static uint64_t now_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void segment_path(IRecorder* ir, uint32_t segment, char* path, int len) {
+    snprintf(path, len, "%s/%08u.seg", ir->r.path, segment);
+}
+
+static RecordEntry* index_entry(IRecorder* ir, uint32_t i) {
+    return &ir->ring[(ir->index->start + i) % ir->index->capacity];
+}
+
+Recorder* recorder_create() {
+    LOG_TRACE("Create Recorder");
+    IRecorder* ir = calloc(1, sizeof (IRecorder));
+    if (ir == NULL) {
+        LOG_ERROR("Creating Recorder");
+        return NULL;
+    }
+    strcpy(ir->r.path, "recordings");
+    ir->r.segment_size = 64 * 1024 * 1024;
+    ir->r.retention = 3600;
+    ir->index_fd = -1;
+    ir->seg_fd = -1;
+    pthread_mutex_init(&ir->mutex, NULL);
+    pthread_cond_init(&ir->cond, NULL);
+    return (Recorder*) ir;
+}
+
+static int index_open(IRecorder* ir) {
+    char path[300];
+    snprintf(path, sizeof (path), "%s/index", ir->r.path);
+
+    uint32_t capacity = ir->r.retention * RECORDER_MAX_FPS + 1;
+    ir->index_len = sizeof (RecordIndex) + (size_t) capacity * sizeof (RecordEntry);
+
+    LOG_TRACE("Open index: %s", path);
+    ir->index_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (ir->index_fd < 0) {
+        LOG_ERROR("Opening index");
+        return -1;
+    }
+
+    struct stat st;
+    if (0 != fstat(ir->index_fd, &st)) {
+        LOG_ERROR("Reading index size");
+        return -1;
+    }
+    int resume = (st.st_size == ir->index_len);
+
+    if (0 != ftruncate(ir->index_fd, ir->index_len)) {
+        LOG_ERROR("Resizing index");
+        return -1;
+    }
+
+    ir->index = mmap(NULL, ir->index_len, PROT_READ | PROT_WRITE, MAP_SHARED, ir->index_fd, 0);
+    if (ir->index == MAP_FAILED) {
+        ir->index = NULL;
+        LOG_ERROR("Mapping index");
+        return -1;
+    }
+    ir->ring = (RecordEntry*) (ir->index + 1);
+
+    if (!resume || ir->index->magic != RECORDER_MAGIC || ir->index->capacity != capacity) {
+        LOG_INFO("New recording index");
+        memset(ir->index, 0, sizeof (RecordIndex));
+        ir->index->magic = RECORDER_MAGIC;
+        ir->index->capacity = capacity;
+        ir->index->first_segment = 1;
+    } else {
+        LOG_INFO("Resume recording index with %u frames", ir->index->count);
+    }
+
+    return 0;
+}
+
+static void drop_oldest(IRecorder* ir) {
+    ir->index->start = (ir->index->start + 1) % ir->index->capacity;
+    ir->index->count--;
+}
+
+static void apply_retention(IRecorder* ir) {
+    uint64_t cutoff = now_us() - (uint64_t) ir->r.retention * 1000000;
+
+    pthread_mutex_lock(&ir->mutex);
+    while (ir->index->count > 0 && index_entry(ir, 0)->timestamp < cutoff) {
+        drop_oldest(ir);
+    }
+    uint32_t keep = ir->index->count > 0 ? index_entry(ir, 0)->segment : ir->index->segment;
+    uint32_t first = ir->index->first_segment;
+    if (keep > first) {
+        ir->index->first_segment = keep;
+    }
+    pthread_mutex_unlock(&ir->mutex);
+
+    // Remove the segments without indexed frames
+    char path[300];
+    for (; first < keep; first++) {
+        segment_path(ir, first, path, sizeof (path));
+        LOG_DEBUG("Remove segment %s", path);
+        if (0 != unlink(path) && errno != ENOENT) {
+            LOG_WARN("Removing segment %s", path);
+        }
+        errno = 0;
+    }
+}
+
+static int segment_sync(IRecorder* ir) {
+    if (ir->seg_fd >= 0 && 0 != fdatasync(ir->seg_fd)) {
+        LOG_ERROR("Syncing segment");
+        return -1;
+    }
+    if (0 != msync(ir->index, ir->index_len, MS_SYNC)) {
+        LOG_ERROR("Syncing index");
+        return -1;
+    }
+    ir->last_sync = now_us();
+    return 0;
+}
+
+static int segment_next(IRecorder* ir) {
+    if (ir->seg_fd >= 0) {
+        segment_sync(ir);
+        close(ir->seg_fd);
+        ir->seg_fd = -1;
+    }
+
+    pthread_mutex_lock(&ir->mutex);
+    uint32_t segment = ++ir->index->segment;
+    pthread_mutex_unlock(&ir->mutex);
+
+    char path[300];
+    segment_path(ir, segment, path, sizeof (path));
+    LOG_DEBUG("Open segment %s", path);
+    ir->seg_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (ir->seg_fd < 0) {
+        LOG_ERROR("Opening segment %s", path);
+        return -1;
+    }
+    ir->seg_offset = 0;
+
+    apply_retention(ir);
+
+    return 0;
+}
+
+static int write_all(int fd, const uint8_t* data, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, data, len);
+        if (w < 0) {
+            if (errno == EINTR) {
+                errno = 0;
+                continue;
+            }
+            return -1;
+        }
+        data += w;
+        len -= w;
+    }
+    return 0;
+}
+
+static int write_batch(IRecorder* ir) {
+    uint32_t pos = 0;
+    int i = 0;
+    while (i < ir->nwentries) {
+        RecordEntry* e = &ir->wentries[i];
+        if (ir->seg_fd < 0 || (ir->seg_offset > 0 && ir->seg_offset + e->size > ir->r.segment_size)) {
+            if (0 != segment_next(ir)) {
+                return -1;
+            }
+        }
+
+        // The frames that fit in this segment go in one write
+        int j = i;
+        uint32_t run = 0;
+        while (j < ir->nwentries && (ir->seg_offset + run == 0
+                || ir->seg_offset + run + ir->wentries[j].size <= ir->r.segment_size)) {
+            run += ir->wentries[j].size;
+            j++;
+        }
+
+        if (0 != write_all(ir->seg_fd, ir->wbatch->data + pos, run)) {
+            LOG_ERROR("Writing segment");
+            return -1;
+        }
+
+        pthread_mutex_lock(&ir->mutex);
+        for (; i < j; i++) {
+            e = &ir->wentries[i];
+            e->segment = ir->index->segment;
+            e->offset = ir->seg_offset;
+            ir->seg_offset += e->size;
+            if (ir->index->count == ir->index->capacity) {
+                drop_oldest(ir);
+            }
+            *index_entry(ir, ir->index->count) = *e;
+            ir->index->count++;
+        }
+        pthread_mutex_unlock(&ir->mutex);
+
+        pos += run;
+    }
+
+    if (now_us() - ir->last_sync >= RECORDER_SYNC_INTERVAL) {
+        segment_sync(ir);
+    }
+
+    return 0;
+}
+
+static int read_frame(IRecorder* ir, uint64_t timestamp, RecordEntry* e, Buffer* out) {
+    // Last frame captured at or before the timestamp
+    pthread_mutex_lock(&ir->mutex);
+    uint32_t lo = 0;
+    uint32_t hi = ir->index->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (index_entry(ir, mid)->timestamp <= timestamp) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        pthread_mutex_unlock(&ir->mutex);
+        LOG_DEBUG("No recorded frame at %llu", (unsigned long long) timestamp);
+        return -1;
+    }
+    *e = *index_entry(ir, lo - 1);
+    pthread_mutex_unlock(&ir->mutex);
+
+    char path[300];
+    segment_path(ir, e->segment, path, sizeof (path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOG_ERROR("Opening segment %s", path);
+        return -1;
+    }
+
+    if (0 > buffer_resize(out, e->size, 0)) {
+        close(fd);
+        return -1;
+    }
+
+    ssize_t n = pread(fd, out->data, e->size, e->offset);
+    close(fd);
+    if (n != e->size) {
+        LOG_ERROR("Reading recorded frame");
+        return -1;
+    }
+    out->used = e->size;
+
+    return 0;
+}
+
+// Reads the frames looked up, with the mutex held
+static void serve_lookups(IRecorder* ir) {
+    int done = 0;
+    int i;
+    for (i = 0; i < RECORDER_MAX_LOOKUPS && ir->queued > 0; i++) {
+        RecordLookup* l = &ir->lookups[i];
+        if (l->state != LOOKUP_QUEUED) continue;
+
+        l->state = LOOKUP_READING;
+        ir->queued--;
+        pthread_mutex_unlock(&ir->mutex);
+        int status = read_frame(ir, l->timestamp, &l->entry, l->data);
+        pthread_mutex_lock(&ir->mutex);
+        l->status = status;
+        l->state = (l->owner != NULL) ? LOOKUP_DONE : LOOKUP_FREE;
+        done = 1;
+    }
+
+    if (done && ir->r.found != NULL) {
+        ir->r.found(&ir->r);
+    }
+}
+
+static void* recorder_thread(void* arg) {
+    logger_set_thread_name("Rec");
+    trace_set_thread_name("Rec");
+    IRecorder* ir = (IRecorder*) arg;
+
+    pthread_mutex_lock(&ir->mutex);
+    while (!ir->stop || ir->nentries > 0) {
+        if (!ir->stop && ir->batch->used < RECORDER_BATCH_SIZE && ir->queued == 0) {
+            struct timeval tv;
+            struct timespec ts;
+            gettimeofday(&tv, NULL);
+            uint64_t us = tv.tv_usec + RECORDER_FLUSH_INTERVAL;
+            ts.tv_sec = tv.tv_sec + us / 1000000;
+            ts.tv_nsec = (us % 1000000) * 1000;
+            pthread_cond_timedwait(&ir->cond, &ir->mutex, &ts);
+        }
+
+        serve_lookups(ir);
+        if (ir->nentries == 0) continue;
+
+        // Swap the batches, the producer keeps appending meanwhile
+        Buffer* tmp = ir->batch;
+        ir->batch = ir->wbatch;
+        ir->wbatch = tmp;
+        RecordEntry* etmp = ir->entries;
+        ir->entries = ir->wentries;
+        ir->wentries = etmp;
+        int ctmp = ir->centries;
+        ir->centries = ir->cwentries;
+        ir->cwentries = ctmp;
+        ir->nwentries = ir->nentries;
+        ir->nentries = 0;
+        ir->batch->used = 0;
+        pthread_mutex_unlock(&ir->mutex);
+
+        LOG_TRACE("Write %d frames, %u bytes", ir->nwentries, ir->wbatch->used);
+        uint64_t start = trace_now();
+        if (0 != write_batch(ir)) {
+            LOG_ERROR("Error writing recording batch");
+        }
+        // Keyed by the last frame of the batch
+        trace_span("Record", ir->wentries[ir->nwentries - 1].seq, start);
+
+        pthread_mutex_lock(&ir->mutex);
+    }
+    pthread_mutex_unlock(&ir->mutex);
+
+    pthread_exit(0);
+}
+
+int recorder_init(Recorder* r) {
+    IRecorder* ir = (IRecorder*) r;
+
+    LOG_TRACE("Init Recorder: %s", r->path);
+    if (0 != mkdir(r->path, 0755) && errno != EEXIST) {
+        LOG_ERROR("Creating recordings directory");
+        return -1;
+    }
+    errno = 0;
+
+    if (0 != index_open(ir)) {
+        return -1;
+    }
+
+    ir->batch = buffer_create();
+    ir->wbatch = buffer_create();
+    if (ir->batch == NULL || ir->wbatch == NULL
+            || 0 > buffer_resize(ir->batch, RECORDER_BATCH_SIZE, 0)
+            || 0 > buffer_resize(ir->wbatch, RECORDER_BATCH_SIZE, 0)) {
+        LOG_ERROR("Allocating recording batches");
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < RECORDER_MAX_LOOKUPS; i++) {
+        ir->lookups[i].data = buffer_create();
+        if (ir->lookups[i].data == NULL) {
+            LOG_ERROR("Allocating recorded frames");
+            return -1;
+        }
+    }
+
+    if (0 != pthread_create(&ir->thread, NULL, &recorder_thread, ir)) {
+        LOG_ERROR("Launching recorder thread");
+        return -1;
+    }
+    ir->running = 1;
+
+    return 0;
+}
+
+int recorder_append(Recorder* r, const Frame* f, int mode) {
+    IRecorder* ir = (IRecorder*) r;
+
+    pthread_mutex_lock(&ir->mutex);
+
+    if (ir->nentries == ir->centries) {
+        int c = ir->centries > 0 ? ir->centries * 2 : 64;
+        RecordEntry* e = realloc(ir->entries, c * sizeof (RecordEntry));
+        if (e == NULL) {
+            pthread_mutex_unlock(&ir->mutex);
+            LOG_ERROR("Growing recording batch");
+            return -1;
+        }
+        ir->entries = e;
+        ir->centries = c;
+    }
+
+    Buffer* b = ir->batch;
+    if (0 > buffer_resize(b, b->used + f->jpeg->used, 0)) {
+        pthread_mutex_unlock(&ir->mutex);
+        LOG_ERROR("Growing recording batch");
+        return -1;
+    }
+    memcpy(b->data + b->used, f->jpeg->data, f->jpeg->used);
+    b->used += f->jpeg->used;
+
+    RecordEntry* e = &ir->entries[ir->nentries++];
+    memset(e, 0, sizeof (RecordEntry));
+    e->timestamp = (uint64_t) f->timestamp.tv_sec * 1000000 + f->timestamp.tv_usec;
+    e->seq = f->seq;
+    e->size = f->jpeg->used;
+    e->encode_time = f->encode_time;
+    e->mode = mode;
+
+    if (b->used >= RECORDER_BATCH_SIZE) {
+        pthread_cond_signal(&ir->cond);
+    }
+
+    pthread_mutex_unlock(&ir->mutex);
+
+    return 0;
+}
+
+int recorder_lookup(Recorder* r, uint64_t timestamp, void* owner) {
+    IRecorder* ir = (IRecorder*) r;
+
+    pthread_mutex_lock(&ir->mutex);
+    int i;
+    for (i = 0; i < RECORDER_MAX_LOOKUPS; i++) {
+        RecordLookup* l = &ir->lookups[i];
+        if (l->state != LOOKUP_FREE) continue;
+
+        l->state = LOOKUP_QUEUED;
+        l->owner = owner;
+        l->timestamp = timestamp;
+        ir->queued++;
+        pthread_cond_signal(&ir->cond);
+        pthread_mutex_unlock(&ir->mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&ir->mutex);
+
+    LOG_WARN("Too many recorded frames looked up");
+    return -1;
+}
+
+// Takes a finished lookup, returns its owner or NULL when none. On
+// success status is 0 and the frame is swapped with *data.
+void* recorder_result(Recorder* r, RecordEntry* e, Buffer** data, int* status) {
+    IRecorder* ir = (IRecorder*) r;
+    void* owner = NULL;
+
+    pthread_mutex_lock(&ir->mutex);
+    int i;
+    for (i = 0; i < RECORDER_MAX_LOOKUPS; i++) {
+        RecordLookup* l = &ir->lookups[i];
+        if (l->state != LOOKUP_DONE) continue;
+
+        owner = l->owner;
+        *status = l->status;
+        if (l->status == 0) {
+            *e = l->entry;
+            Buffer* tmp = *data;
+            *data = l->data;
+            l->data = tmp;
+        }
+        l->state = LOOKUP_FREE;
+        l->owner = NULL;
+        break;
+    }
+    pthread_mutex_unlock(&ir->mutex);
+
+    return owner;
+}
+
+void recorder_cancel(Recorder* r, void* owner) {
+    IRecorder* ir = (IRecorder*) r;
+
+    pthread_mutex_lock(&ir->mutex);
+    int i;
+    for (i = 0; i < RECORDER_MAX_LOOKUPS; i++) {
+        RecordLookup* l = &ir->lookups[i];
+        if (l->owner != owner) continue;
+
+        // The frame being read is dropped by the writer thread
+        if (l->state == LOOKUP_QUEUED) {
+            ir->queued--;
+        }
+        if (l->state != LOOKUP_READING) {
+            l->state = LOOKUP_FREE;
+        }
+        l->owner = NULL;
+    }
+    pthread_mutex_unlock(&ir->mutex);
+}
+
+int recorder_destroy(Recorder* r) {
+    IRecorder* ir = (IRecorder*) r;
+
+    LOG_TRACE("Destroy Recorder");
+    if (ir->running) {
+        pthread_mutex_lock(&ir->mutex);
+        ir->stop = 1;
+        pthread_cond_signal(&ir->cond);
+        pthread_mutex_unlock(&ir->mutex);
+        pthread_join(ir->thread, NULL);
+        ir->running = 0;
+    }
+
+    if (ir->seg_fd >= 0) {
+        segment_sync(ir);
+        close(ir->seg_fd);
+        ir->seg_fd = -1;
+    }
+
+    if (ir->index != NULL) {
+        munmap(ir->index, ir->index_len);
+        ir->index = NULL;
+    }
+
+    if (ir->index_fd >= 0) {
+        close(ir->index_fd);
+        ir->index_fd = -1;
+    }
+
+    if (ir->batch != NULL) {
+        buffer_destroy(ir->batch);
+        ir->batch = NULL;
+    }
+
+    if (ir->wbatch != NULL) {
+        buffer_destroy(ir->wbatch);
+        ir->wbatch = NULL;
+    }
+
+    free(ir->entries);
+    free(ir->wentries);
+
+    int i;
+    for (i = 0; i < RECORDER_MAX_LOOKUPS; i++) {
+        if (ir->lookups[i].data != NULL) {
+            buffer_destroy(ir->lookups[i].data);
+        }
+    }
+
+    pthread_mutex_destroy(&ir->mutex);
+    pthread_cond_destroy(&ir->cond);
+
+    free(ir);
+
+    return 0;
+}
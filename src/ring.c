@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ring.h"
+#include "log.h"
+
+// Recent encoded frames stored one after another in a preallocated
+// arena, wrapping to the start when a frame does not fit at the end.
+// The oldest frames are evicted when their bytes are needed, when
+// they get older than the duration or when the entries run out.
+
+// Smallest frame expected, to size the entries
+#define RING_MIN_FRAME 1024
+
+typedef struct IRing IRing;
+
+struct IRing {
+    Ring r;
+    pthread_mutex_t mutex;
+    uint8_t* arena;
+    RingEntry* entries;
+    uint32_t capacity;
+    uint32_t start;
+    uint32_t count;
+    uint32_t wpos;
+};
+
+static RingEntry* ring_entry(IRing* ir, uint32_t i) {
+    return &ir->entries[(ir->start + i) % ir->capacity];
+}
+
+static void evict_oldest(IRing* ir) {
+    ir->start = (ir->start + 1) % ir->capacity;
+    ir->count--;
+}
+
+Ring* ring_create() {
+    LOG_TRACE("Create Ring");
+    IRing* ir = calloc(1, sizeof (IRing));
+    if (ir == NULL) {
+        LOG_ERROR("Creating Ring");
+        return NULL;
+    }
+    ir->r.size = 16 * 1024 * 1024;
+    pthread_mutex_init(&ir->mutex, NULL);
+    return (Ring*) ir;
+}
+
+int ring_init(Ring* r) {
+    IRing* ir = (IRing*) r;
+
+    LOG_TRACE("Init Ring: %u bytes, %d ms", r->size, r->duration);
+    ir->arena = malloc(r->size);
+    ir->capacity = r->size / RING_MIN_FRAME + 1;
+    ir->entries = calloc(ir->capacity, sizeof (RingEntry));
+    if (ir->arena == NULL || ir->entries == NULL) {
+        LOG_ERROR("Allocating Ring arena");
+        return -1;
+    }
+
+    return 0;
+}
+
+int ring_append(Ring* r, const Frame* f, int mode) {
+    IRing* ir = (IRing*) r;
+    uint32_t n = f->jpeg->used;
+
+    if (n > r->size) {
+        LOG_WARN("Frame bigger than the ring");
+        return -1;
+    }
+
+    uint64_t timestamp = (uint64_t) f->timestamp.tv_sec * 1000000 + f->timestamp.tv_usec;
+
+    pthread_mutex_lock(&ir->mutex);
+
+    uint32_t pos = ir->wpos;
+    if (pos + n > r->size) {
+        // Wrap, the frames at the end are the oldest ones
+        while (ir->count > 0 && ring_entry(ir, 0)->offset >= pos) {
+            evict_oldest(ir);
+        }
+        pos = 0;
+    }
+
+    // Free the bytes of the new frame
+    while (ir->count > 0) {
+        RingEntry* e = ring_entry(ir, 0);
+        if (e->offset < pos + n && e->offset + e->size > pos) {
+            evict_oldest(ir);
+        } else {
+            break;
+        }
+    }
+
+    // Out of time or out of entries
+    while (ir->count > 0 && (ir->count == ir->capacity || (r->duration > 0
+            && ring_entry(ir, 0)->timestamp + (uint64_t) r->duration * 1000 < timestamp))) {
+        evict_oldest(ir);
+    }
+
+    memcpy(ir->arena + pos, f->jpeg->data, n);
+
+    RingEntry* e = ring_entry(ir, ir->count);
+    e->seq = f->seq;
+    e->timestamp = timestamp;
+    e->encode_time = f->encode_time;
+    e->mode = mode;
+    e->offset = pos;
+    e->size = n;
+    ir->count++;
+    ir->wpos = pos + n;
+
+    pthread_mutex_unlock(&ir->mutex);
+
+    return 0;
+}
+
+uint32_t ring_last_seq(Ring* r) {
+    IRing* ir = (IRing*) r;
+
+    pthread_mutex_lock(&ir->mutex);
+    uint32_t seq = ir->count > 0 ? ring_entry(ir, ir->count - 1)->seq : 0;
+    pthread_mutex_unlock(&ir->mutex);
+
+    return seq;
+}
+
+int ring_get(Ring* r, uint32_t after, RingEntry* e, Buffer* out) {
+    IRing* ir = (IRing*) r;
+
+    pthread_mutex_lock(&ir->mutex);
+
+    // First frame newer than the sequence
+    uint32_t lo = 0;
+    uint32_t hi = ir->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (ring_entry(ir, mid)->seq <= after) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == ir->count) {
+        pthread_mutex_unlock(&ir->mutex);
+        return -1;
+    }
+
+    *e = *ring_entry(ir, lo);
+    if (0 > buffer_resize(out, e->size, 0)) {
+        pthread_mutex_unlock(&ir->mutex);
+        return -1;
+    }
+    memcpy(out->data, ir->arena + e->offset, e->size);
+    out->used = e->size;
+
+    pthread_mutex_unlock(&ir->mutex);
+
+    return 0;
+}
+
+int ring_destroy(Ring* r) {
+    IRing* ir = (IRing*) r;
+
+    LOG_TRACE("Destroy Ring");
+    free(ir->arena);
+    free(ir->entries);
+    pthread_mutex_destroy(&ir->mutex);
+    free(ir);
+
+    return 0;
+}
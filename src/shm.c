@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shm.h"
+#include "log.h"
+
+// Writer side of the shared memory ring. The slots are written in
+// turn, never waiting for the readers; a reader has the time of
+// slots - 1 frames to use one before it is overwritten.
+
+typedef struct IShm IShm;
+
+struct IShm {
+    Shm s;
+    int fd;
+    uint8_t* map;
+    size_t len;
+    ShmHeader* header;
+    uint32_t next;
+};
+
+static uint32_t page_align(uint32_t n) {
+    return (n + SHM_PAGE - 1) / SHM_PAGE * SHM_PAGE;
+}
+
+Shm* shm_create() {
+    LOG_TRACE("Create Shm");
+    IShm* is = calloc(1, sizeof (IShm));
+    if (is == NULL) {
+        LOG_ERROR("Creating Shm");
+        return NULL;
+    }
+    is->fd = -1;
+    is->s.slots = 4;
+    return (Shm*) is;
+}
+
+int shm_init(Shm* s) {
+    IShm* is = (IShm*) s;
+
+    uint32_t raw_capacity = s->width * s->height * 2;
+    // JPEGs bigger than the YUYV frame are not published
+    uint32_t jpeg_capacity = raw_capacity;
+    uint32_t slot_size = SHM_PAGE + page_align(raw_capacity) + page_align(jpeg_capacity);
+    is->len = SHM_PAGE + (size_t) s->slots * slot_size;
+
+    LOG_TRACE("Init Shm: %s, %d slots of %u bytes", s->name, s->slots, slot_size);
+    // Readers of a previous run keep the old memory, not a truncated one
+    shm_unlink(s->name);
+    is->fd = shm_open(s->name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (is->fd < 0) {
+        LOG_ERROR("Error opening shared memory %s", s->name);
+        return -1;
+    }
+
+    if (0 != ftruncate(is->fd, is->len)) {
+        LOG_ERROR("Error sizing shared memory");
+        return -1;
+    }
+
+    is->map = mmap(NULL, is->len, PROT_READ | PROT_WRITE, MAP_SHARED, is->fd, 0);
+    if (is->map == MAP_FAILED) {
+        is->map = NULL;
+        LOG_ERROR("Error mapping shared memory");
+        return -1;
+    }
+
+    ShmHeader* h = (ShmHeader*) is->map;
+    h->slots = s->slots;
+    h->slot_size = slot_size;
+    h->width = s->width;
+    h->height = s->height;
+    h->format = SHM_FORMAT_YUYV;
+    h->raw_capacity = page_align(raw_capacity);
+    h->jpeg_capacity = page_align(jpeg_capacity);
+    // Nothing published yet
+    h->latest = s->slots;
+    h->version = SHM_VERSION;
+    __atomic_store_n(&h->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    is->header = h;
+
+    return 0;
+}
+
+// Whether frames of that size fit the slots sized at startup
+int shm_fits(Shm* s, int width, int height) {
+    IShm* is = (IShm*) s;
+    return (size_t) width * height * 2 <= is->header->raw_capacity;
+}
+
+int shm_publish(Shm* s, const Frame* f, const Buffer* raw, int mode) {
+    IShm* is = (IShm*) s;
+    ShmHeader* h = is->header;
+
+    if (raw->used > h->raw_capacity || f->jpeg->used > h->jpeg_capacity) {
+        LOG_WARN("Frame bigger than the shared memory slot");
+        return -1;
+    }
+
+    ShmSlot* slot = (ShmSlot*) (is->map + SHM_PAGE + (size_t) is->next * h->slot_size);
+    uint8_t* data = (uint8_t*) slot + SHM_PAGE;
+
+    // Odd while writing, the readers retry or discard what they read
+    uint32_t lock = slot->lock;
+    __atomic_store_n(&slot->lock, lock + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->seq = f->seq;
+    slot->timestamp = (uint64_t) f->timestamp.tv_sec * 1000000 + f->timestamp.tv_usec;
+    slot->encode_time = f->encode_time;
+    slot->mode = mode;
+    slot->raw_size = raw->used;
+    slot->jpeg_size = f->jpeg->used;
+    slot->width = f->width;
+    slot->height = f->height;
+    memcpy(data, raw->data, raw->used);
+    memcpy(data + h->raw_capacity, f->jpeg->data, f->jpeg->used);
+
+    __atomic_store_n(&slot->lock, lock + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->latest, is->next, __ATOMIC_RELEASE);
+
+    is->next = (is->next + 1) % h->slots;
+
+    return 0;
+}
+
+int shm_destroy(Shm* s) {
+    IShm* is = (IShm*) s;
+
+    LOG_TRACE("Destroy Shm");
+    if (is->map != NULL) {
+        munmap(is->map, is->len);
+    }
+
+    if (is->fd >= 0) {
+        close(is->fd);
+        shm_unlink(s->name);
+    }
+
+    free(is);
+
+    return 0;
+}
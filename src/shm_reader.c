@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shm_reader.h"
+
+// Client library, it does not depend on the rest of the server so
+// it can be linked alone.
+
+// Retries while the slots are overwritten under the reader
+#define SHM_RETRIES 16
+
+struct ShmReader {
+    int fd;
+    uint8_t* map;
+    size_t len;
+    const ShmHeader* header;
+};
+
+static const ShmSlot* slot_at(ShmReader* r, uint32_t i) {
+    return (const ShmSlot*) (r->map + SHM_PAGE + (size_t) i * r->header->slot_size);
+}
+
+ShmReader* shm_reader_open(const char* name) {
+    ShmReader* r = calloc(1, sizeof (ShmReader));
+    if (r == NULL) {
+        return NULL;
+    }
+
+    r->fd = shm_open(name, O_RDONLY, 0);
+    struct stat st;
+    if (r->fd < 0 || 0 != fstat(r->fd, &st) || st.st_size < SHM_PAGE) {
+        shm_reader_close(r);
+        return NULL;
+    }
+
+    r->len = st.st_size;
+    r->map = mmap(NULL, r->len, PROT_READ, MAP_SHARED, r->fd, 0);
+    if (r->map == MAP_FAILED) {
+        r->map = NULL;
+        shm_reader_close(r);
+        return NULL;
+    }
+
+    r->header = (const ShmHeader*) r->map;
+    if (r->header->magic != SHM_MAGIC || r->header->version != SHM_VERSION
+            || SHM_PAGE + (size_t) r->header->slots * r->header->slot_size > r->len) {
+        shm_reader_close(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+// Returns 0 with the last frame, -1 when no frame was published yet
+// or the writer keeps overwriting it
+int shm_reader_latest(ShmReader* r, ShmFrame* f) {
+    const ShmHeader* h = r->header;
+    int i;
+    for (i = 0; i < SHM_RETRIES; i++) {
+        uint32_t latest = __atomic_load_n(&h->latest, __ATOMIC_ACQUIRE);
+        if (latest >= h->slots) {
+            return -1;
+        }
+
+        const ShmSlot* s = slot_at(r, latest);
+        uint32_t lock = __atomic_load_n(&s->lock, __ATOMIC_ACQUIRE);
+        if (lock == 0 || (lock & 1)) {
+            continue;
+        }
+
+        f->seq = s->seq;
+        f->timestamp = s->timestamp;
+        f->encode_time = s->encode_time;
+        f->mode = s->mode;
+        f->width = s->width;
+        f->height = s->height;
+        f->raw_size = s->raw_size;
+        f->jpeg_size = s->jpeg_size;
+        f->raw = (const uint8_t*) s + SHM_PAGE;
+        f->jpeg = f->raw + h->raw_capacity;
+        f->slot = s;
+        f->lock = lock;
+
+        if (f->raw_size <= h->raw_capacity && f->jpeg_size <= h->jpeg_capacity
+                && 0 == shm_reader_check(r, f)) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+// Returns 0 when the frame data read so far was not overwritten
+int shm_reader_check(ShmReader* r, const ShmFrame* f) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&f->slot->lock, __ATOMIC_RELAXED) == f->lock ? 0 : -1;
+}
+
+int shm_reader_close(ShmReader* r) {
+    if (r->map != NULL) {
+        munmap(r->map, r->len);
+    }
+
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+
+    free(r);
+
+    return 0;
+}
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "buffer.h"
+#include "capture.h"
+#include "jpeg.h"
+#include "transform.h"
+#include "log.h"
+
+// Encodes the same YUYV frame many times with the JPEG encoder of the
+// build (MODE=...), to compare them. The frame comes from a raw file
+// or from the test pattern of the capture.
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int read_frame(const char* path, Buffer* b, int size) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Error opening %s\n", path);
+        return -1;
+    }
+
+    if (0 > buffer_resize(b, size, 0)) {
+        fclose(f);
+        return -1;
+    }
+    b->used = fread(b->data, 1, size, f);
+    fclose(f);
+
+    if (b->used != size) {
+        fprintf(stderr, "%s has %u bytes, %d expected\n", path, b->used, size);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int ac, char** av) {
+    logger_init(LEVEL_WARN, stderr);
+
+    const char* input = NULL;
+    const char* output = NULL;
+    int width = 1280;
+    int height = 720;
+    int frames = 100;
+    int quality = 80;
+    JPEGMode mode = JPEG_MODE_COLOR;
+    JPEGSampling sampling = JPEG_SAMPLING_DEFAULT;
+    int tune = 0;
+    int opt;
+    while ((opt = getopt(ac, av, "i:o:W:H:n:q:gc:u")) != -1) {
+        switch (opt) {
+            case 'i':
+                input = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'W':
+                width = atoi(optarg);
+                break;
+            case 'H':
+                height = atoi(optarg);
+                break;
+            case 'n':
+                frames = atoi(optarg);
+                break;
+            case 'q':
+                quality = atoi(optarg);
+                break;
+            case 'g':
+                mode = JPEG_MODE_GRAY;
+                break;
+            case 'c':
+                sampling = atoi(optarg) == 420 ? JPEG_SAMPLING_420 : JPEG_SAMPLING_422;
+                break;
+            case 'u':
+                tune = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-i frame.yuyv -W width -H height] [-n frames] [-q quality] [-g] [-c 420|422] [-u]"
+                        " [-o frame.jpeg]\n", av[0]);
+                return -1;
+        }
+    }
+
+    Buffer* frame = buffer_create();
+    Capture* c = NULL;
+    if (input != NULL) {
+        if (0 != read_frame(input, frame, width * height * 2)) {
+            return -1;
+        }
+    } else {
+        c = capture_create();
+        strcpy(c->dev, "test");
+        c->width = width;
+        c->height = height;
+        if (0 != capture_init(c)) {
+            return -1;
+        }
+        width = c->width;
+        height = c->height;
+        Buffer* b = capture_grab(c);
+        if (b == NULL || 0 > buffer_copy(frame, b)) {
+            return -1;
+        }
+        capture_release_buffer(c, b);
+    }
+
+    JPEGEncoder* e = jpeg_create_encoder();
+    e->width = width;
+    e->height = height;
+    e->quality = quality;
+    e->mode = mode;
+    e->sampling = sampling;
+    e->input = frame;
+    e->output = buffer_create();
+    if (0 != jpeg_init(e)) {
+        return -1;
+    }
+
+    // Warm up the caches and the output buffer
+    jpeg_compress(e);
+
+    // Huffman tables tuned to the frame, the server tunes them the same
+    JPEGHuffman huffman;
+    if (tune) {
+        uint32_t standard = e->output->used;
+        double t = now_ms();
+        jpeg_huffman_tables(e->output, &huffman);
+        e->huffman = &huffman;
+        printf("Huffman tables tuned in %.2f ms, %u bytes with the standard ones\n", now_ms() - t, standard);
+    }
+
+    double min = 1e9;
+    double start = now_ms();
+    int i;
+    for (i = 0; i < frames; i++) {
+        double t = now_ms();
+        if (0 != jpeg_compress(e)) {
+            fprintf(stderr, "Error compressing\n");
+            return -1;
+        }
+        t = now_ms() - t;
+        if (t < min) min = t;
+    }
+    double mean = (now_ms() - start) / frames;
+
+    printf("%dx%d %s q%d: %.2f ms/frame (min %.2f), %.1f Mpixel/s, %u bytes\n",
+            width, height, mode == JPEG_MODE_GRAY ? "gray" : "color", quality,
+            mean, min, width * height / mean / 1000, e->output->used);
+
+    if (output != NULL) {
+        FILE* f = fopen(output, "wb");
+        if (f == NULL || e->output->used != fwrite(e->output->data, 1, e->output->used, f)) {
+            fprintf(stderr, "Error writing %s\n", output);
+            return -1;
+        }
+        fclose(f);
+    }
+
+    buffer_destroy(e->output);
+    jpeg_destroy_encoder(e);
+    if (c != NULL) {
+        capture_destroy(c);
+    }
+    buffer_destroy(frame);
+    logger_destroy();
+
+    return 0;
+}
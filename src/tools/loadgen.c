@@ -0,0 +1,564 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "protocol.h"
+
+// Load generator: opens N connections against the server, sends
+// requests at the rate given or follows the live streams, checks
+// every JPEG and reports the latency percentiles, frames/s and bytes/s.
+
+#define MAX_CONNECTIONS 1024
+#define READ_SIZE 65536
+// Microseconds before connecting again after an error, doubled on
+// each error in a row
+#define RECONNECT_DELAY 100000
+#define RECONNECT_MAX 2000000
+// Microseconds between error messages, the others are only counted
+#define ERROR_INTERVAL 1000000
+
+typedef enum {
+    // One connection per request, closed by the server
+    MODE_TEXT,
+    // Persistent connections, one request in flight each
+    MODE_BINARY,
+    // Pre-event frames and live frames, needs -p on the server
+    MODE_LIVE,
+    // WebSocket viewers
+    MODE_WS
+} Mode;
+
+typedef enum {
+    CONN_IDLE,
+    CONN_CONNECTING,
+    CONN_WAITING,
+    CONN_STREAMING
+} State;
+
+typedef struct {
+    int fd;
+    State state;
+    uint8_t* buf;
+    size_t len;
+    size_t cap;
+    // Microseconds, when the request was due
+    uint64_t due;
+    int upgraded;
+    // Microseconds, no new connection before
+    uint64_t retry;
+    uint64_t backoff;
+} Conn;
+
+typedef struct {
+    uint64_t requests;
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t invalid;
+    uint64_t errors;
+} Stats;
+
+static volatile int stop = 0;
+
+static Mode mode = MODE_BINARY;
+static char cmd = 'f';
+static struct sockaddr_storage server;
+static socklen_t server_len;
+
+static Conn conns[MAX_CONNECTIONS];
+static int nconns = 8;
+
+static Stats total;
+static Stats period;
+
+// Microseconds, capture to reception for the live frames
+static uint64_t* latencies;
+static size_t nlatencies;
+static size_t clatencies;
+
+// Realtime when the test started, older live frames are the window
+static uint64_t start_realtime;
+
+static uint64_t last_message;
+static uint64_t skipped_messages;
+
+static void on_signal(int sig) {
+    stop = 1;
+}
+
+static uint64_t now_us() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static uint64_t realtime_us() {
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return (uint64_t) t.tv_sec * 1000000 + t.tv_usec;
+}
+
+static uint32_t get_u32(const uint8_t* p) {
+    return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint64_t get_u64(const uint8_t* p) {
+    return ((uint64_t) get_u32(p) << 32) | get_u32(p + 4);
+}
+
+static void add_latency(uint64_t us) {
+    if (nlatencies == clatencies) {
+        clatencies = clatencies ? clatencies * 2 : 4096;
+        latencies = realloc(latencies, clatencies * sizeof (uint64_t));
+        if (latencies == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(-1);
+        }
+    }
+    latencies[nlatencies++] = us;
+}
+
+static void count(uint64_t* t, uint64_t* p, uint64_t n) {
+    *t += n;
+    *p += n;
+}
+
+static void frame(const uint8_t* data, size_t len) {
+    count(&total.frames, &period.frames, 1);
+    count(&total.bytes, &period.bytes, len);
+    if (len < 4 || data[0] != 0xFF || data[1] != 0xD8 || data[len - 2] != 0xFF || data[len - 1] != 0xD9) {
+        count(&total.invalid, &period.invalid, 1);
+    }
+}
+
+static void conn_close(Conn* c) {
+    if (c->fd >= 0) {
+        close(c->fd);
+    }
+    c->fd = -1;
+    c->state = CONN_IDLE;
+    c->len = 0;
+    c->upgraded = 0;
+}
+
+static void conn_error(Conn* c, const char* what) {
+    uint64_t now = now_us();
+    if (!stop) {
+        if (now - last_message >= ERROR_INTERVAL) {
+            if (skipped_messages > 0) {
+                fprintf(stderr, "%lu more errors\n", (unsigned long) skipped_messages);
+            }
+            fprintf(stderr, "%s: %s\n", what, errno ? strerror(errno) : "protocol error");
+            last_message = now;
+            skipped_messages = 0;
+        } else {
+            skipped_messages++;
+        }
+        count(&total.errors, &period.errors, 1);
+    }
+    errno = 0;
+    conn_close(c);
+
+    c->backoff = c->backoff > 0 ? c->backoff * 2 : RECONNECT_DELAY;
+    if (c->backoff > RECONNECT_MAX) {
+        c->backoff = RECONNECT_MAX;
+    }
+    c->retry = now + c->backoff;
+}
+
+static int send_all(Conn* c, const void* data, size_t len) {
+    // Requests are tiny, the socket buffer takes them at once
+    if (len != send(c->fd, data, len, MSG_NOSIGNAL)) {
+        conn_error(c, "Sending request");
+        return -1;
+    }
+    return 0;
+}
+
+static int conn_open(Conn* c) {
+    c->fd = socket(server.ss_family, SOCK_STREAM, 0);
+    if (c->fd < 0) {
+        conn_error(c, "Creating socket");
+        return -1;
+    }
+    fcntl(c->fd, F_SETFL, O_NONBLOCK);
+    int on = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+
+    if (0 != connect(c->fd, (struct sockaddr*) &server, server_len) && errno != EINPROGRESS) {
+        conn_error(c, "Connecting");
+        return -1;
+    }
+    errno = 0;
+    c->state = CONN_CONNECTING;
+    return 0;
+}
+
+// First bytes once connected
+static int conn_start(Conn* c) {
+    c->backoff = 0;
+    if (mode == MODE_TEXT) {
+        char line[3] = {cmd, '\n', '\0'};
+        c->state = CONN_WAITING;
+        return send_all(c, line, 2);
+    }
+
+    if (mode == MODE_BINARY) {
+        c->state = CONN_IDLE;
+        return send_all(c, "b", 1);
+    }
+
+    if (mode == MODE_LIVE) {
+        uint8_t req[1 + PROTO_REQUEST_SIZE] = {'b', 'p', PROTO_FLAG_LIVE, 0, 0};
+        c->state = CONN_STREAMING;
+        return send_all(c, req, sizeof (req));
+    }
+
+    const char* upgrade = "GET / HTTP/1.1\r\nHost: rpi-webcam\r\nUpgrade: websocket\r\n"
+            "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+            "Sec-WebSocket-Version: 13\r\n\r\n";
+    c->state = CONN_STREAMING;
+    return send_all(c, upgrade, strlen(upgrade));
+}
+
+static void consume(Conn* c, size_t n) {
+    memmove(c->buf, c->buf + n, c->len - n);
+    c->len -= n;
+}
+
+// Parses the complete messages received, returns -1 on errors
+static int conn_parse(Conn* c) {
+    if (mode == MODE_BINARY || mode == MODE_LIVE) {
+        while (c->len >= PROTO_RESPONSE_SIZE) {
+            if (get_u32(c->buf) != PROTO_MAGIC) {
+                return -1;
+            }
+            uint32_t size = get_u32(c->buf + 24);
+            if (c->len < PROTO_RESPONSE_SIZE + size) {
+                break;
+            }
+
+            uint8_t status = c->buf[5];
+            if (status != PROTO_OK) {
+                count(&total.errors, &period.errors, 1);
+            } else if (size > 0) {
+                frame(c->buf + PROTO_RESPONSE_SIZE, size);
+            }
+
+            if (mode == MODE_BINARY) {
+                add_latency(now_us() - c->due);
+                c->state = CONN_IDLE;
+            } else {
+                // Capture to reception, same clock on loopback
+                uint64_t timestamp = get_u64(c->buf + 12);
+                uint64_t now = realtime_us();
+                if (timestamp >= start_realtime && now >= timestamp) {
+                    add_latency(now - timestamp);
+                }
+            }
+
+            consume(c, PROTO_RESPONSE_SIZE + size);
+        }
+        return 0;
+    }
+
+    if (mode == MODE_WS) {
+        if (!c->upgraded) {
+            uint8_t* end = memmem(c->buf, c->len, "\r\n\r\n", 4);
+            if (end == NULL) {
+                return 0;
+            }
+            if (c->len < 12 || memcmp(c->buf + 9, "101", 3) != 0) {
+                return -1;
+            }
+            c->upgraded = 1;
+            consume(c, end + 4 - c->buf);
+        }
+
+        while (c->len >= 2) {
+            uint64_t length = c->buf[1] & 0x7F;
+            size_t hlen = 2;
+            if (length == 126) {
+                if (c->len < 4) break;
+                length = (c->buf[2] << 8) | c->buf[3];
+                hlen = 4;
+            } else if (length == 127) {
+                if (c->len < 10) break;
+                length = get_u64(c->buf + 2);
+                hlen = 10;
+            }
+            if (c->len < hlen + length) {
+                break;
+            }
+            if ((c->buf[0] & 0x0F) == 0x2) {
+                frame(c->buf + hlen, length);
+            }
+            consume(c, hlen + length);
+        }
+    }
+
+    return 0;
+}
+
+static void conn_read(Conn* c) {
+    while (1) {
+        if (c->cap - c->len < READ_SIZE) {
+            c->cap = c->len + READ_SIZE * 4;
+            c->buf = realloc(c->buf, c->cap);
+            if (c->buf == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(-1);
+            }
+        }
+
+        ssize_t r = recv(c->fd, c->buf + c->len, c->cap - c->len, 0);
+        if (r < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                errno = 0;
+                break;
+            }
+            conn_error(c, "Receiving");
+            return;
+        }
+
+        if (r == 0) {
+            // The text responses end with the connection
+            if (mode == MODE_TEXT && c->state == CONN_WAITING) {
+                frame(c->buf, c->len);
+                add_latency(now_us() - c->due);
+                conn_close(c);
+            } else {
+                conn_error(c, "Connection closed by the server");
+            }
+            return;
+        }
+
+        c->len += r;
+    }
+
+    if (mode != MODE_TEXT && 0 != conn_parse(c)) {
+        conn_error(c, "Parsing response");
+    }
+}
+
+// Sends a request on an idle connection
+static int conn_request(Conn* c, uint64_t due) {
+    count(&total.requests, &period.requests, 1);
+    c->due = due;
+
+    if (mode == MODE_TEXT) {
+        return conn_open(c);
+    }
+
+    uint8_t req[PROTO_REQUEST_SIZE] = {cmd, 0, 0, 0};
+    c->state = CONN_WAITING;
+    return send_all(c, req, sizeof (req));
+}
+
+static int compare(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char* label, const Stats* s, double seconds) {
+    printf("%s: %lu requests, %lu frames (%.1f/s), %.2f MB/s, %lu invalid, %lu errors\n", label,
+            (unsigned long) s->requests, (unsigned long) s->frames, s->frames / seconds,
+            s->bytes / 1048576.0 / seconds, (unsigned long) s->invalid, (unsigned long) s->errors);
+    fflush(stdout);
+}
+
+static void report_latency() {
+    if (nlatencies == 0) {
+        printf("latency: no samples\n");
+        return;
+    }
+
+    qsort(latencies, nlatencies, sizeof (uint64_t), compare);
+    printf("latency ms (%s, %lu samples): p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f max %.2f\n",
+            mode == MODE_LIVE ? "capture to reception" : "request to response", (unsigned long) nlatencies,
+            latencies[nlatencies * 50 / 100] / 1000.0, latencies[nlatencies * 90 / 100] / 1000.0,
+            latencies[nlatencies * 99 / 100] / 1000.0, latencies[nlatencies * 999 / 1000] / 1000.0,
+            latencies[nlatencies - 1] / 1000.0);
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-H host] [-p port] [-c connections] [-r requests/s] [-t seconds]"
+            " [-m text|binary|live|ws] [-q f|g]\n", name);
+}
+
+int main(int ac, char** av) {
+    const char* host = "127.0.0.1";
+    const char* port = "9000";
+    double rate = 0;
+    double duration = 10;
+
+    int opt;
+    while ((opt = getopt(ac, av, "H:p:c:r:t:m:q:")) != -1) {
+        switch (opt) {
+            case 'H':
+                host = optarg;
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            case 'c':
+                nconns = atoi(optarg);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 't':
+                duration = atof(optarg);
+                break;
+            case 'm':
+                if (strcmp(optarg, "text") == 0) mode = MODE_TEXT;
+                else if (strcmp(optarg, "binary") == 0) mode = MODE_BINARY;
+                else if (strcmp(optarg, "live") == 0) mode = MODE_LIVE;
+                else if (strcmp(optarg, "ws") == 0) mode = MODE_WS;
+                else {
+                    usage(av[0]);
+                    return -1;
+                }
+                break;
+            case 'q':
+                cmd = optarg[0];
+                break;
+            default:
+                usage(av[0]);
+                return -1;
+        }
+    }
+
+    if (nconns <= 0 || nconns > MAX_CONNECTIONS || (cmd != 'f' && cmd != 'g')) {
+        usage(av[0]);
+        return -1;
+    }
+
+    struct addrinfo hints;
+    struct addrinfo* ai;
+    memset(&hints, 0, sizeof (hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (0 != getaddrinfo(host, port, &hints, &ai)) {
+        fprintf(stderr, "Unknown host %s:%s\n", host, port);
+        return -1;
+    }
+    memcpy(&server, ai->ai_addr, ai->ai_addrlen);
+    server_len = ai->ai_addrlen;
+    freeaddrinfo(ai);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof (sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    int i;
+    for (i = 0; i < nconns; i++) {
+        conns[i].fd = -1;
+        if (mode != MODE_TEXT) {
+            conn_open(&conns[i]);
+        }
+    }
+
+    static struct pollfd fds[MAX_CONNECTIONS];
+    uint64_t start = now_us();
+    uint64_t end = start + (uint64_t) (duration * 1000000);
+    uint64_t last = start;
+    uint64_t issued = 0;
+    start_realtime = realtime_us();
+
+    while (!stop) {
+        uint64_t now = now_us();
+        if (now >= end) {
+            break;
+        }
+
+        // Requests due, sent on the idle connections
+        int streaming = (mode == MODE_LIVE || mode == MODE_WS);
+        uint64_t due = rate > 0 ? start + (uint64_t) (issued * 1000000 / rate) : now;
+        for (i = 0; i < nconns && !streaming && due <= now; i++) {
+            Conn* c = &conns[i];
+            int idle = (mode == MODE_TEXT) ? (c->fd < 0 && now >= c->retry) : (c->state == CONN_IDLE && c->fd >= 0);
+            if (!idle) continue;
+            conn_request(c, due);
+            issued++;
+            due = rate > 0 ? start + (uint64_t) (issued * 1000000 / rate) : now;
+        }
+
+        // Reconnect the persistent connections lost, once their delay passed
+        for (i = 0; i < nconns && mode != MODE_TEXT; i++) {
+            if (conns[i].fd < 0 && now >= conns[i].retry) {
+                conn_open(&conns[i]);
+            }
+        }
+
+        for (i = 0; i < nconns; i++) {
+            fds[i].fd = conns[i].fd;
+            fds[i].events = conns[i].state == CONN_CONNECTING ? POLLOUT : POLLIN;
+            fds[i].revents = 0;
+        }
+
+        int timeout = 100;
+        if (!streaming && rate > 0 && due > now && (due - now) / 1000 < timeout) {
+            timeout = (due - now) / 1000;
+        }
+        if (0 > poll(fds, nconns, timeout) && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        errno = 0;
+
+        for (i = 0; i < nconns; i++) {
+            Conn* c = &conns[i];
+            if (c->fd < 0 || fds[i].revents == 0) continue;
+
+            if (c->state == CONN_CONNECTING) {
+                int err = 0;
+                socklen_t len = sizeof (err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) {
+                    errno = err;
+                    conn_error(c, "Connecting");
+                    continue;
+                }
+                conn_start(c);
+                continue;
+            }
+
+            conn_read(c);
+        }
+
+        now = now_us();
+        if (now - last >= 1000000) {
+            report("last second", &period, (now - last) / 1e6);
+            memset(&period, 0, sizeof (period));
+            last = now;
+        }
+    }
+
+    double seconds = (now_us() - start) / 1e6;
+    report("total", &total, seconds);
+    report_latency();
+
+    for (i = 0; i < nconns; i++) {
+        stop = 1;
+        conn_close(&conns[i]);
+        free(conns[i].buf);
+    }
+    free(latencies);
+
+    return total.invalid > 0 || total.errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,331 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "buffer.h"
+#include "log.h"
+#include "multicast.h"
+
+// Reference receiver of the multicast frames: reassembles them from
+// the datagrams and reports the datagrams and frames lost, and the
+// frames the sender skipped to keep its rate.
+
+// Frames being reassembled at the same time
+#define SLOTS 4
+// Datagrams per recvmmsg
+#define BATCH 32
+
+typedef struct {
+    int used;
+    MulticastHeader h;
+    uint32_t received;
+    uint8_t* got;
+    Buffer* data;
+} Slot;
+
+typedef struct {
+    uint32_t frames;
+    uint64_t bytes;
+    uint32_t invalid;
+    uint32_t skipped;
+    uint32_t lost_frames;
+    uint32_t lost_datagrams;
+} Stats;
+
+static volatile int stop = 0;
+
+static void on_signal(int sig) {
+    stop = 1;
+}
+
+static Slot slots[SLOTS];
+static Stats total;
+static Stats period;
+// Highest sequence seen, older frames already gone are ignored
+static uint32_t highest = 0;
+static uint32_t oldest = 0;
+static int started = 0;
+static uint32_t next_packet = 0;
+static const char* output = NULL;
+
+static void count(uint32_t* total_field, uint32_t* period_field, uint32_t n) {
+    *total_field += n;
+    *period_field += n;
+}
+
+static void release(Slot* s) {
+    s->used = 0;
+    if (s->h.seq >= oldest) {
+        oldest = s->h.seq + 1;
+    }
+}
+
+static void complete(Slot* s) {
+    Buffer* b = s->data;
+    if (b->used < 4 || b->data[0] != 0xFF || b->data[1] != 0xD8
+            || b->data[b->used - 2] != 0xFF || b->data[b->used - 1] != 0xD9) {
+        total.invalid++;
+        period.invalid++;
+    }
+
+    total.frames++;
+    period.frames++;
+    total.bytes += b->used;
+    period.bytes += b->used;
+
+    if (output != NULL) {
+        FILE* f = fopen(output, "wb");
+        if (f != NULL) {
+            fwrite(b->data, 1, b->used, f);
+            fclose(f);
+        }
+    }
+
+    release(s);
+}
+
+static Slot* find_slot(const MulticastHeader* h) {
+    int i;
+    Slot* old = NULL;
+    for (i = 0; i < SLOTS; i++) {
+        if (slots[i].used && slots[i].h.seq == h->seq) {
+            return &slots[i];
+        }
+    }
+
+    // Frames never sent
+    if (h->seq > highest + 1 && highest > 0) {
+        count(&total.skipped, &period.skipped, h->seq - highest - 1);
+    }
+    if (h->seq > highest) {
+        highest = h->seq;
+    }
+
+    // Frames that far behind will never complete
+    for (i = 0; i < SLOTS; i++) {
+        if (slots[i].used && slots[i].h.seq + SLOTS <= highest) {
+            count(&total.lost_frames, &period.lost_frames, 1);
+            release(&slots[i]);
+        }
+    }
+
+    for (i = 0; i < SLOTS; i++) {
+        if (!slots[i].used) {
+            old = &slots[i];
+            break;
+        }
+        if (old == NULL || slots[i].h.seq < old->h.seq) {
+            old = &slots[i];
+        }
+    }
+
+    // The oldest frame being reassembled will never complete
+    if (old->used) {
+        count(&total.lost_frames, &period.lost_frames, 1);
+        release(old);
+    }
+
+    if (0 > buffer_resize(old->data, h->size, 0)) {
+        return NULL;
+    }
+    free(old->got);
+    old->got = calloc(h->count, 1);
+    if (old->got == NULL) {
+        return NULL;
+    }
+    old->used = 1;
+    old->h = *h;
+    old->received = 0;
+    old->data->used = h->size;
+
+    return old;
+}
+
+static void receive(const uint8_t* data, int len) {
+    MulticastHeader h;
+    if (0 > multicast_parse_header(data, len, &h)) {
+        return;
+    }
+
+    // Gaps in the packet numbers are datagrams lost
+    if (started && (int32_t) (h.packet - next_packet) > 0) {
+        count(&total.lost_datagrams, &period.lost_datagrams, h.packet - next_packet);
+    }
+    if (!started || (int32_t) (h.packet - next_packet) >= 0) {
+        next_packet = h.packet + 1;
+    }
+    started = 1;
+
+    // Late datagram of a frame already completed or lost
+    if (h.seq < oldest) {
+        return;
+    }
+
+    uint32_t offset = h.index * MCAST_PAYLOAD_SIZE;
+    uint32_t plen = len - MCAST_HEADER_SIZE;
+    if (offset + plen > h.size) {
+        return;
+    }
+
+    Slot* s = find_slot(&h);
+    if (s == NULL || s->h.size != h.size || s->h.count != h.count || s->got[h.index]) {
+        return;
+    }
+
+    memcpy(s->data->data + offset, data + MCAST_HEADER_SIZE, plen);
+    s->got[h.index] = 1;
+    s->received++;
+    if (s->received == s->h.count) {
+        complete(s);
+    }
+}
+
+static void report(const char* label, const Stats* s, double seconds) {
+    printf("%s: %u frames (%.1f/s), %.1f kB/s, %u skipped by the sender, %u lost frames, %u lost datagrams, %u invalid\n",
+            label, s->frames, s->frames / seconds, s->bytes / 1024.0 / seconds,
+            s->skipped, s->lost_frames, s->lost_datagrams, s->invalid);
+    fflush(stdout);
+}
+
+int main(int ac, char** av) {
+    logger_init(LEVEL_WARN, stderr);
+
+    const char* interface = NULL;
+    int opt;
+    while ((opt = getopt(ac, av, "i:o:")) != -1) {
+        switch (opt) {
+            case 'i':
+                interface = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                optind = ac;
+                break;
+        }
+    }
+
+    if (optind != ac - 1 || strchr(av[optind], ':') == NULL) {
+        fprintf(stderr, "Usage: %s [-i interface] [-o last frame file] group:port\n", av[0]);
+        return -1;
+    }
+
+    char address[64];
+    strncpy(address, av[optind], sizeof (address) - 1);
+    address[sizeof (address) - 1] = '\0';
+    char* port = strchr(address, ':');
+    *port++ = '\0';
+
+    struct in_addr group;
+    if (1 != inet_pton(AF_INET, address, &group)) {
+        fprintf(stderr, "Invalid address: %s\n", address);
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof (rcvbuf));
+
+    struct sockaddr_in saddr;
+    memset(&saddr, 0, sizeof (saddr));
+    saddr.sin_family = AF_INET;
+    saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    saddr.sin_port = htons(atoi(port));
+    if (0 != bind(fd, (struct sockaddr*) &saddr, sizeof (saddr))) {
+        LOG_ERROR("Error binding socket");
+        return -1;
+    }
+
+    if (IN_MULTICAST(ntohl(group.s_addr))) {
+        struct ip_mreq mreq;
+        mreq.imr_multiaddr = group;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (interface != NULL && 1 != inet_pton(AF_INET, interface, &mreq.imr_interface)) {
+            fprintf(stderr, "Invalid interface: %s\n", interface);
+            return -1;
+        }
+        if (0 != setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof (mreq))) {
+            LOG_ERROR("Error joining the group");
+            return -1;
+        }
+    }
+
+    // Wake up every second to report
+    struct timeval tv = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof (sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    int i;
+    for (i = 0; i < SLOTS; i++) {
+        slots[i].data = buffer_create();
+    }
+
+    static uint8_t datagrams[BATCH][MCAST_DATAGRAM_SIZE];
+    struct iovec iov[BATCH];
+    struct mmsghdr msgs[BATCH];
+
+    struct timespec start, last, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    last = start;
+    while (!stop) {
+        memset(msgs, 0, sizeof (msgs));
+        for (i = 0; i < BATCH; i++) {
+            iov[i].iov_base = datagrams[i];
+            iov[i].iov_len = MCAST_DATAGRAM_SIZE;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int n = recvmmsg(fd, msgs, BATCH, MSG_WAITFORONE, NULL);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            LOG_ERROR("Error receiving datagrams");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            receive(datagrams[i], msgs[i].msg_len);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+        if (elapsed >= 1.0) {
+            report("last second", &period, elapsed);
+            memset(&period, 0, sizeof (period));
+            last = now;
+        }
+    }
+
+    for (i = 0; i < SLOTS; i++) {
+        if (slots[i].used) {
+            count(&total.lost_frames, &period.lost_frames, 1);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    report("total", &total, (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9);
+
+    for (i = 0; i < SLOTS; i++) {
+        buffer_destroy(slots[i].data);
+        free(slots[i].got);
+    }
+    close(fd);
+    logger_destroy();
+
+    return 0;
+}
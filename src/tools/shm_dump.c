@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "shm_reader.h"
+
+// Example reader of the shared memory ring: follows the last frame,
+// checks the JPEG markers and reports the frames seen every second.
+
+static volatile int stop = 0;
+
+static void on_signal(int sig) {
+    stop = 1;
+}
+
+int main(int ac, char** av) {
+    const char* output = NULL;
+    int opt;
+    while ((opt = getopt(ac, av, "o:")) != -1) {
+        switch (opt) {
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                optind = ac;
+                break;
+        }
+    }
+
+    if (optind != ac - 1) {
+        fprintf(stderr, "Usage: %s [-o last frame file] name\n", av[0]);
+        return -1;
+    }
+
+    ShmReader* r = shm_reader_open(av[optind]);
+    if (r == NULL) {
+        fprintf(stderr, "Error opening shared memory %s\n", av[optind]);
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof (sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    uint32_t last_seq = 0;
+    uint32_t frames = 0, skipped = 0, torn = 0, invalid = 0;
+    time_t last = time(NULL);
+    ShmFrame f;
+    while (!stop) {
+        if (0 != shm_reader_latest(r, &f) || f.seq == last_seq) {
+            usleep(1000);
+        } else {
+            // Used in place, then checked
+            int valid = f.jpeg_size >= 4 && f.jpeg[0] == 0xFF && f.jpeg[1] == 0xD8
+                    && f.jpeg[f.jpeg_size - 2] == 0xFF && f.jpeg[f.jpeg_size - 1] == 0xD9;
+            if (0 != shm_reader_check(r, &f)) {
+                torn++;
+            } else {
+                if (last_seq != 0 && f.seq > last_seq + 1) {
+                    skipped += f.seq - last_seq - 1;
+                }
+                last_seq = f.seq;
+                frames++;
+                if (!valid) {
+                    invalid++;
+                }
+            }
+        }
+
+        time_t now = time(NULL);
+        if (now != last) {
+            printf("seq %u: %u frames, %u skipped, %u overwritten while read, %u invalid, %ux%u raw %u bytes, jpeg %u bytes\n",
+                    last_seq, frames, skipped, torn, invalid, f.width, f.height, f.raw_size, f.jpeg_size);
+            fflush(stdout);
+            frames = skipped = torn = invalid = 0;
+            last = now;
+        }
+    }
+
+    // A copy, the slot is overwritten soon
+    if (output != NULL && 0 == shm_reader_latest(r, &f)) {
+        uint8_t* copy = malloc(f.jpeg_size);
+        memcpy(copy, f.jpeg, f.jpeg_size);
+        if (0 == shm_reader_check(r, &f)) {
+            FILE* out = fopen(output, "wb");
+            if (out != NULL) {
+                fwrite(copy, 1, f.jpeg_size, out);
+                fclose(out);
+            }
+        }
+        free(copy);
+    }
+
+    shm_reader_close(r);
+
+    return 0;
+}
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "log.h"
+
+typedef struct TraceEvent TraceEvent;
+
+struct TraceEvent {
+    const char* name;
+    uint32_t seq;
+    uint64_t start;
+    uint64_t duration;
+    // Number of the event plus one once written, 0 while writing
+    uint32_t index;
+};
+
+typedef struct TraceThread TraceThread;
+
+struct TraceThread {
+    char name[16];
+    int tid;
+    TraceEvent* events;
+    // Events written
+    uint32_t head;
+    // Set once the events are allocated
+    int ready;
+};
+
+static int init = 0;
+static uint32_t capacity;
+static TraceThread threads[TRACE_THREADS];
+static int nthreads;
+static __thread TraceThread* current;
+
+uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int trace_init(int events) {
+    if (init) return 0;
+    memset(threads, 0, sizeof (threads));
+    nthreads = 0;
+    capacity = events > 0 ? events : TRACE_EVENTS;
+    LOG_TRACE("Init trace: %u spans per thread", capacity);
+    init = 1;
+    return 0;
+}
+
+int trace_set_thread_name(const char* name) {
+    if (!init || current != NULL) return 0;
+
+    int i = __atomic_fetch_add(&nthreads, 1, __ATOMIC_RELAXED);
+    if (i >= TRACE_THREADS) {
+        LOG_WARN("Too many threads traced, %s ignored", name);
+        return -1;
+    }
+
+    TraceThread* t = &threads[i];
+    t->events = calloc(capacity, sizeof (TraceEvent));
+    if (t->events == NULL) {
+        LOG_ERROR("Creating trace buffer");
+        return -1;
+    }
+    strncpy(t->name, name, sizeof (t->name) - 1);
+    t->tid = syscall(SYS_gettid);
+    __atomic_store_n(&t->ready, 1, __ATOMIC_RELEASE);
+    current = t;
+
+    return 0;
+}
+
+void trace_span(const char* name, uint32_t seq, uint64_t start) {
+    TraceThread* t = current;
+    if (t == NULL) return;
+
+    uint32_t n = t->head;
+    TraceEvent* e = &t->events[n % capacity];
+
+    // Like a sequence lock, a dump skips the event while it changes
+    __atomic_store_n(&e->index, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->name = name;
+    e->seq = seq;
+    e->start = start;
+    e->duration = trace_now() - start;
+    __atomic_store_n(&e->index, n + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&t->head, n + 1, __ATOMIC_RELEASE);
+}
+
+static int dump_thread(FILE* f, const TraceThread* t, int* first) {
+    fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            *first ? "" : ",", t->tid, t->name);
+    *first = 0;
+
+    int count = 0;
+    uint32_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+    uint32_t n = head > capacity ? head - capacity : 0;
+    for (; n < head; n++) {
+        TraceEvent* e = &t->events[n % capacity];
+        if (__atomic_load_n(&e->index, __ATOMIC_ACQUIRE) != n + 1) continue;
+        TraceEvent copy = *e;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        // Overwritten meanwhile
+        if (__atomic_load_n(&e->index, __ATOMIC_RELAXED) != n + 1) continue;
+
+        fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%llu,\"dur\":%llu",
+                copy.name, t->tid, (unsigned long long) copy.start, (unsigned long long) copy.duration);
+        if (copy.seq != 0) {
+            fprintf(f, ",\"args\":{\"seq\":%u}", copy.seq);
+        }
+        fprintf(f, "}");
+        count++;
+    }
+
+    return count;
+}
+
+int trace_dump(const char* path) {
+    if (!init) return -1;
+
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        LOG_ERROR("Error opening trace file %s", path);
+        return -1;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    int first = 1;
+    int count = 0;
+    int n = __atomic_load_n(&nthreads, __ATOMIC_RELAXED);
+    int i;
+    for (i = 0; i < n && i < TRACE_THREADS; i++) {
+        if (!__atomic_load_n(&threads[i].ready, __ATOMIC_ACQUIRE)) continue;
+        count += dump_thread(f, &threads[i], &first);
+    }
+    fprintf(f, "\n]}\n");
+
+    if (0 != fclose(f)) {
+        LOG_ERROR("Error writing trace file %s", path);
+        return -1;
+    }
+
+    LOG_INFO("%d spans dumped to %s", count, path);
+    return 0;
+}
+
+// The traced threads must be finished
+int trace_destroy() {
+    if (!init) return 0;
+    LOG_TRACE("Destroy trace");
+
+    int i;
+    for (i = 0; i < nthreads && i < TRACE_THREADS; i++) {
+        free(threads[i].events);
+        threads[i].events = NULL;
+        threads[i].ready = 0;
+    }
+    current = NULL;
+    init = 0;
+
+    return 0;
+}
@@ -0,0 +1,490 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+
+#include "transform.h"
+#include "log.h"
+
+// Lossless transforms in the DCT domain, like jpegtran does.
+// Every transform is a transposition followed by flips, a flip
+// mirrors the blocks and negates the odd frequencies on that axis.
+// Partial MCUs on a flipped edge can not be moved, they are trimmed.
+// Lower qualities are made in the DCT domain too, requantizing the
+// coefficients of the encoded frame, and the Huffman tables tuned to a
+// scene are counted from them.
+
+typedef struct {
+    int transpose;
+    int flip_h;
+    int flip_v;
+} TransformOps;
+
+typedef struct {
+    struct jpeg_destination_mgr mgr;
+    Buffer* output;
+} transform_destination_mgr;
+
+static void get_ops(JPEGTransform t, TransformOps* ops) {
+    memset(ops, 0, sizeof (TransformOps));
+    switch (t) {
+        case JPEG_TRANSFORM_ROT90:
+            ops->transpose = 1;
+            ops->flip_h = 1;
+            break;
+        case JPEG_TRANSFORM_ROT180:
+            ops->flip_h = 1;
+            ops->flip_v = 1;
+            break;
+        case JPEG_TRANSFORM_ROT270:
+            ops->transpose = 1;
+            ops->flip_v = 1;
+            break;
+        case JPEG_TRANSFORM_FLIP_H:
+            ops->flip_h = 1;
+            break;
+        case JPEG_TRANSFORM_FLIP_V:
+            ops->flip_v = 1;
+            break;
+        default:
+            break;
+    }
+}
+
+int jpeg_transform_parse(const char* name, JPEGTransform* t) {
+    if (strcmp(name, "90") == 0) {
+        *t = JPEG_TRANSFORM_ROT90;
+    } else if (strcmp(name, "180") == 0) {
+        *t = JPEG_TRANSFORM_ROT180;
+    } else if (strcmp(name, "270") == 0) {
+        *t = JPEG_TRANSFORM_ROT270;
+    } else if (strcmp(name, "h") == 0) {
+        *t = JPEG_TRANSFORM_FLIP_H;
+    } else if (strcmp(name, "v") == 0) {
+        *t = JPEG_TRANSFORM_FLIP_V;
+    } else if (strcmp(name, "0") == 0) {
+        *t = JPEG_TRANSFORM_NONE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static void buf_init_destination(j_compress_ptr cinfo) {
+    transform_destination_mgr* dst = (transform_destination_mgr*) cinfo->dest;
+    buffer_resize(dst->output, 1024, 0);
+    dst->output->used = 0;
+    cinfo->dest->next_output_byte = dst->output->data;
+    cinfo->dest->free_in_buffer = dst->output->size;
+}
+
+static boolean buf_empty_output_buffer(j_compress_ptr cinfo) {
+    transform_destination_mgr* dst = (transform_destination_mgr*) cinfo->dest;
+    size_t oldsize = dst->output->size;
+    buffer_resize(dst->output, oldsize * 2, 0);
+    cinfo->dest->free_in_buffer = oldsize;
+    cinfo->dest->next_output_byte = dst->output->data + oldsize;
+    return TRUE;
+}
+
+static void buf_term_destination(j_compress_ptr cinfo) {
+    transform_destination_mgr* dst = (transform_destination_mgr*) cinfo->dest;
+    dst->output->used = dst->output->size - cinfo->dest->free_in_buffer;
+}
+
+static int round_up(int n, int m) {
+    return ((n + m - 1) / m) * m;
+}
+
+static int comp_blocks(int pixels, int samp, int max_samp) {
+    int blocks = (pixels * samp + max_samp * DCTSIZE - 1) / (max_samp * DCTSIZE);
+    return round_up(blocks, samp);
+}
+
+static void transform_block(JCOEFPTR src, JCOEFPTR dst, const TransformOps* ops) {
+    int u, v;
+    for (v = 0; v < DCTSIZE; v++) {
+        for (u = 0; u < DCTSIZE; u++) {
+            JCOEF c = ops->transpose ? src[u * DCTSIZE + v] : src[v * DCTSIZE + u];
+            if ((ops->flip_h && (u & 1)) ^ (ops->flip_v && (v & 1))) {
+                c = -c;
+            }
+            dst[v * DCTSIZE + u] = c;
+        }
+    }
+}
+
+static void transpose_quant_tables(j_compress_ptr cinfo) {
+    int i, u, v;
+    for (i = 0; i < NUM_QUANT_TBLS; i++) {
+        JQUANT_TBL* q = cinfo->quant_tbl_ptrs[i];
+        if (q == NULL) continue;
+        for (v = 0; v < DCTSIZE; v++) {
+            for (u = v + 1; u < DCTSIZE; u++) {
+                UINT16 tmp = q->quantval[v * DCTSIZE + u];
+                q->quantval[v * DCTSIZE + u] = q->quantval[u * DCTSIZE + v];
+                q->quantval[u * DCTSIZE + v] = tmp;
+            }
+        }
+    }
+}
+
+int jpeg_transform(const Buffer* input, Buffer* output, JPEGTransform t) {
+    TransformOps ops;
+    get_ops(t, &ops);
+
+    struct jpeg_decompress_struct sinfo;
+    struct jpeg_compress_struct dinfo;
+    struct jpeg_error_mgr jsrcerr, jdsterr;
+
+    sinfo.err = jpeg_std_error(&jsrcerr);
+    jpeg_create_decompress(&sinfo);
+    dinfo.err = jpeg_std_error(&jdsterr);
+    jpeg_create_compress(&dinfo);
+
+    jpeg_mem_src(&sinfo, input->data, input->used);
+    jpeg_read_header(&sinfo, TRUE);
+
+    // Trim the partial MCUs on the flipped source axes
+    int mcu_w = sinfo.max_h_samp_factor * DCTSIZE;
+    int mcu_h = sinfo.max_v_samp_factor * DCTSIZE;
+    int src_w = sinfo.image_width;
+    int src_h = sinfo.image_height;
+    int trim_x = ops.transpose ? ops.flip_v : ops.flip_h;
+    int trim_y = ops.transpose ? ops.flip_h : ops.flip_v;
+    if (trim_x) src_w -= src_w % mcu_w;
+    if (trim_y) src_h -= src_h % mcu_h;
+    if (src_w == 0 || src_h == 0) {
+        LOG_ERROR("Frame smaller than a MCU");
+        jpeg_destroy_compress(&dinfo);
+        jpeg_destroy_decompress(&sinfo);
+        return -1;
+    }
+
+    int dst_w = ops.transpose ? src_h : src_w;
+    int dst_h = ops.transpose ? src_w : src_h;
+    int dst_max_h = ops.transpose ? sinfo.max_v_samp_factor : sinfo.max_h_samp_factor;
+    int dst_max_v = ops.transpose ? sinfo.max_h_samp_factor : sinfo.max_v_samp_factor;
+
+    // The destination arrays are realized with the source ones
+    int c;
+    jvirt_barray_ptr* dst_coef = (jvirt_barray_ptr*) (*sinfo.mem->alloc_small)
+            ((j_common_ptr) & sinfo, JPOOL_IMAGE, sizeof (jvirt_barray_ptr) * sinfo.num_components);
+    for (c = 0; c < sinfo.num_components; c++) {
+        jpeg_component_info* comp = sinfo.comp_info + c;
+        int h_samp = ops.transpose ? comp->v_samp_factor : comp->h_samp_factor;
+        int v_samp = ops.transpose ? comp->h_samp_factor : comp->v_samp_factor;
+        dst_coef[c] = (*sinfo.mem->request_virt_barray)
+                ((j_common_ptr) & sinfo, JPOOL_IMAGE, FALSE,
+                comp_blocks(dst_w, h_samp, dst_max_h),
+                comp_blocks(dst_h, v_samp, dst_max_v),
+                v_samp);
+    }
+
+    jvirt_barray_ptr* src_coef = jpeg_read_coefficients(&sinfo);
+
+    for (c = 0; c < sinfo.num_components; c++) {
+        jpeg_component_info* comp = sinfo.comp_info + c;
+        int h_samp = ops.transpose ? comp->v_samp_factor : comp->h_samp_factor;
+        int v_samp = ops.transpose ? comp->h_samp_factor : comp->v_samp_factor;
+        int w_blocks = comp_blocks(dst_w, h_samp, dst_max_h);
+        int h_blocks = comp_blocks(dst_h, v_samp, dst_max_v);
+
+        int bx, by;
+        for (by = 0; by < h_blocks; by++) {
+            JBLOCKARRAY drow = (*sinfo.mem->access_virt_barray)
+                    ((j_common_ptr) & sinfo, dst_coef[c], by, 1, TRUE);
+            int ty = ops.flip_v ? h_blocks - 1 - by : by;
+            for (bx = 0; bx < w_blocks; bx++) {
+                int tx = ops.flip_h ? w_blocks - 1 - bx : bx;
+                int sx = ops.transpose ? ty : tx;
+                int sy = ops.transpose ? tx : ty;
+                JBLOCKARRAY srow = (*sinfo.mem->access_virt_barray)
+                        ((j_common_ptr) & sinfo, src_coef[c], sy, 1, FALSE);
+                transform_block(srow[0][sx], drow[0][bx], &ops);
+            }
+        }
+    }
+
+    jpeg_copy_critical_parameters(&sinfo, &dinfo);
+    dinfo.image_width = dst_w;
+    dinfo.image_height = dst_h;
+    if (ops.transpose) {
+        for (c = 0; c < dinfo.num_components; c++) {
+            jpeg_component_info* comp = dinfo.comp_info + c;
+            int tmp = comp->h_samp_factor;
+            comp->h_samp_factor = comp->v_samp_factor;
+            comp->v_samp_factor = tmp;
+        }
+        transpose_quant_tables(&dinfo);
+    }
+
+    transform_destination_mgr dst;
+    dst.output = output;
+    dst.mgr.init_destination = buf_init_destination;
+    dst.mgr.empty_output_buffer = buf_empty_output_buffer;
+    dst.mgr.term_destination = buf_term_destination;
+    dinfo.dest = (struct jpeg_destination_mgr*) &dst;
+
+    jpeg_write_coefficients(&dinfo, dst_coef);
+    jpeg_finish_compress(&dinfo);
+    jpeg_destroy_compress(&dinfo);
+
+    jpeg_finish_decompress(&sinfo);
+    jpeg_destroy_decompress(&sinfo);
+
+    return 0;
+}
+
+// Every coefficient goes from the source step to the nearest one of
+// the destination step, most of them are zero
+static void requantize_block(JCOEFPTR block, const UINT16* src, const UINT16* dst) {
+    int k;
+    for (k = 0; k < DCTSIZE2; k++) {
+        if (block[k] == 0) continue;
+        int c = block[k] * src[k];
+        int half = dst[k] / 2;
+        block[k] = c >= 0 ? (c + half) / dst[k] : -((half - c) / dst[k]);
+    }
+}
+
+int jpeg_requantize(const Buffer* input, Buffer* output, int quality) {
+    struct jpeg_decompress_struct sinfo;
+    struct jpeg_compress_struct dinfo;
+    struct jpeg_error_mgr jsrcerr, jdsterr;
+
+    sinfo.err = jpeg_std_error(&jsrcerr);
+    jpeg_create_decompress(&sinfo);
+    dinfo.err = jpeg_std_error(&jdsterr);
+    jpeg_create_compress(&dinfo);
+
+    jpeg_mem_src(&sinfo, input->data, input->used);
+    jpeg_read_header(&sinfo, TRUE);
+
+    // Only the entropy decoding, the coefficients are kept
+    jvirt_barray_ptr* coef = jpeg_read_coefficients(&sinfo);
+
+    // Same tables as the encoders, scaled to the quality
+    jpeg_copy_critical_parameters(&sinfo, &dinfo);
+    jpeg_set_quality(&dinfo, quality, TRUE);
+
+    int c;
+    for (c = 0; c < sinfo.num_components; c++) {
+        jpeg_component_info* comp = sinfo.comp_info + c;
+        const UINT16* src = comp->quant_table->quantval;
+        const UINT16* dst = dinfo.quant_tbl_ptrs[dinfo.comp_info[c].quant_tbl_no]->quantval;
+        int bx, by;
+        for (by = 0; by < comp->height_in_blocks; by++) {
+            JBLOCKARRAY row = (*sinfo.mem->access_virt_barray)
+                    ((j_common_ptr) & sinfo, coef[c], by, 1, TRUE);
+            for (bx = 0; bx < comp->width_in_blocks; bx++) {
+                requantize_block(row[0][bx], src, dst);
+            }
+        }
+    }
+
+    transform_destination_mgr dst;
+    dst.output = output;
+    dst.mgr.init_destination = buf_init_destination;
+    dst.mgr.empty_output_buffer = buf_empty_output_buffer;
+    dst.mgr.term_destination = buf_term_destination;
+    dinfo.dest = (struct jpeg_destination_mgr*) &dst;
+
+    jpeg_write_coefficients(&dinfo, coef);
+    jpeg_finish_compress(&dinfo);
+    jpeg_destroy_compress(&dinfo);
+
+    jpeg_finish_decompress(&sinfo);
+    jpeg_destroy_decompress(&sinfo);
+
+    return 0;
+}
+
+// Natural index of each zigzag position
+static const uint8_t zigzag[DCTSIZE2] = {
+    0, 1, 8, 16, 9, 2, 3, 10,
+    17, 24, 32, 25, 18, 11, 4, 5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+static int bit_size(int v) {
+    int a = v < 0 ? -v : v;
+    return a == 0 ? 0 : 32 - __builtin_clz(a);
+}
+
+// Symbols of a block, as a baseline encoder writes them
+static void count_block(JCOEFPTR block, int* pred, long* dc, long* ac) {
+    dc[bit_size(block[0] - *pred)]++;
+    *pred = block[0];
+
+    int run = 0;
+    int k;
+    for (k = 1; k < DCTSIZE2; k++) {
+        int v = block[zigzag[k]];
+        if (v == 0) {
+            run++;
+            continue;
+        }
+        for (; run > 15; run -= 16) {
+            ac[0xF0]++;
+        }
+        ac[(run << 4) | bit_size(v)]++;
+        run = 0;
+    }
+    if (run > 0) {
+        // End of block
+        ac[0x00]++;
+    }
+}
+
+// Code lengths from the counts, JPEG Annex K.2 like libjpeg: the two
+// least frequent symbols are merged until one is left, the lengths
+// over 16 bits are moved up the tree. The extra symbol 256 takes the
+// code of all ones, which is not allowed.
+static void build_table(long* freq, JPEGHuffmanTable* t) {
+    int codesize[257];
+    int others[257];
+    int bits[258];
+    int i, j;
+
+    memset(codesize, 0, sizeof (codesize));
+    memset(bits, 0, sizeof (bits));
+    for (i = 0; i < 257; i++) {
+        others[i] = -1;
+    }
+    freq[256] = 1;
+
+    while (1) {
+        int c1 = -1;
+        int c2 = -1;
+        long v1 = 0;
+        long v2 = 0;
+        for (i = 0; i < 257; i++) {
+            if (freq[i] == 0) continue;
+            if (c1 < 0 || freq[i] <= v1) {
+                c2 = c1;
+                v2 = v1;
+                c1 = i;
+                v1 = freq[i];
+            } else if (c2 < 0 || freq[i] <= v2) {
+                c2 = i;
+                v2 = freq[i];
+            }
+        }
+        if (c2 < 0) break;
+
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+
+        // Both branches one bit longer, c2 chained after c1
+        codesize[c1]++;
+        while (others[c1] >= 0) {
+            c1 = others[c1];
+            codesize[c1]++;
+        }
+        others[c1] = c2;
+        codesize[c2]++;
+        while (others[c2] >= 0) {
+            c2 = others[c2];
+            codesize[c2]++;
+        }
+    }
+
+    for (i = 0; i < 257; i++) {
+        if (codesize[i] > 0) {
+            bits[codesize[i]]++;
+        }
+    }
+
+    for (i = 257; i > 16; i--) {
+        while (bits[i] > 0) {
+            // A prefix one level up takes a pair of the longest codes
+            j = i - 2;
+            while (bits[j] == 0) {
+                j--;
+            }
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+
+    // Without the extra symbol, the longest code
+    for (i = 16; bits[i] == 0; i--);
+    bits[i]--;
+
+    for (i = 0; i < 16; i++) {
+        t->bits[i] = bits[i + 1];
+    }
+    int n = 0;
+    for (i = 1; i <= 257; i++) {
+        for (j = 0; j < 256; j++) {
+            if (codesize[j] == i) {
+                t->values[n++] = j;
+            }
+        }
+    }
+}
+
+int jpeg_huffman_tables(const Buffer* input, JPEGHuffman* h) {
+    struct jpeg_decompress_struct sinfo;
+    struct jpeg_error_mgr jsrcerr;
+    // DC and AC counts of the luma and the chroma
+    long dc[2][257];
+    long ac[2][257];
+
+    sinfo.err = jpeg_std_error(&jsrcerr);
+    jpeg_create_decompress(&sinfo);
+    jpeg_mem_src(&sinfo, input->data, input->used);
+    jpeg_read_header(&sinfo, TRUE);
+    jvirt_barray_ptr* coef = jpeg_read_coefficients(&sinfo);
+
+    // Every baseline symbol counts once, the next frames may need it
+    int t, i;
+    for (t = 0; t < 2; t++) {
+        memset(dc[t], 0, sizeof (dc[t]));
+        memset(ac[t], 0, sizeof (ac[t]));
+        for (i = 0; i < 12; i++) {
+            dc[t][i] = 1;
+        }
+        ac[t][0x00] = 1;
+        ac[t][0xF0] = 1;
+        for (i = 0; i < 16 * 16; i++) {
+            if ((i & 15) >= 1 && (i & 15) <= 10) {
+                ac[t][i] = 1;
+            }
+        }
+    }
+
+    // The DC differences in raster order, close to the order of the MCUs
+    int c;
+    for (c = 0; c < sinfo.num_components; c++) {
+        jpeg_component_info* comp = sinfo.comp_info + c;
+        t = c > 0;
+        int pred = 0;
+        int bx, by;
+        for (by = 0; by < comp->height_in_blocks; by++) {
+            JBLOCKARRAY row = (*sinfo.mem->access_virt_barray)
+                    ((j_common_ptr) & sinfo, coef[c], by, 1, FALSE);
+            for (bx = 0; bx < comp->width_in_blocks; bx++) {
+                count_block(row[0][bx], &pred, dc[t], ac[t]);
+            }
+        }
+    }
+
+    jpeg_finish_decompress(&sinfo);
+    jpeg_destroy_decompress(&sinfo);
+
+    for (t = 0; t < 2; t++) {
+        build_table(dc[t], &h->dc[t]);
+        build_table(ac[t], &h->ac[t]);
+    }
+
+    return 0;
+}
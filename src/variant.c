@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "variant.h"
+#include "log.h"
+
+typedef struct {
+    Variant v;
+    Buffer* jpeg;
+    int valid;
+    unsigned int used;
+} VariantEntry;
+
+typedef struct IVariantCache IVariantCache;
+
+struct IVariantCache {
+    VariantCache c;
+    VariantEntry* entries;
+    unsigned int clock;
+};
+
+VariantCache* variant_cache_create(int size) {
+    LOG_TRACE("Create Variant Cache");
+    IVariantCache* ic = calloc(1, sizeof (IVariantCache));
+    if (ic == NULL) {
+        LOG_ERROR("Creating Variant Cache");
+        return NULL;
+    }
+    ic->c.size = size;
+
+    ic->entries = calloc(size, sizeof (VariantEntry));
+    if (ic->entries == NULL) {
+        LOG_ERROR("Allocating Variant Cache entries");
+        free(ic);
+        return NULL;
+    }
+
+    int i;
+    for (i = 0; i < size; i++) {
+        ic->entries[i].jpeg = buffer_create();
+        if (ic->entries[i].jpeg == NULL) {
+            LOG_ERROR("Allocating Variant Buffer[%d]", i);
+            variant_cache_destroy((VariantCache*) ic);
+            return NULL;
+        }
+    }
+
+    return (VariantCache*) ic;
+}
+
+static int variant_equals(const Variant* a, const Variant* b) {
+    return a->mode == b->mode
+            && a->x == b->x
+            && a->y == b->y
+            && a->width == b->width
+            && a->height == b->height
+            && a->transform == b->transform
+            && a->quality == b->quality;
+}
+
+Buffer* variant_cache_get(VariantCache* c, const Variant* v) {
+    IVariantCache* ic = (IVariantCache*) c;
+
+    int i;
+    for (i = 0; i < c->size; i++) {
+        VariantEntry* e = &ic->entries[i];
+        if (e->valid && variant_equals(&e->v, v)) {
+            LOG_TRACE("Variant cache hit [%d]", i);
+            e->used = ++ic->clock;
+            return e->jpeg;
+        }
+    }
+
+    return NULL;
+}
+
+Buffer* variant_cache_put(VariantCache* c, const Variant* v) {
+    IVariantCache* ic = (IVariantCache*) c;
+
+    // Take a free entry or the least recently used
+    int i;
+    int lru = 0;
+    for (i = 0; i < c->size; i++) {
+        VariantEntry* e = &ic->entries[i];
+        if (!e->valid) {
+            lru = i;
+            break;
+        }
+        if (e->used < ic->entries[lru].used) {
+            lru = i;
+        }
+    }
+
+    LOG_TRACE("Variant cache store [%d]", lru);
+    VariantEntry* e = &ic->entries[lru];
+    e->v = *v;
+    e->valid = 1;
+    e->used = ++ic->clock;
+    e->jpeg->used = 0;
+
+    return e->jpeg;
+}
+
+int variant_cache_clear(VariantCache* c) {
+    IVariantCache* ic = (IVariantCache*) c;
+
+    // Keep the buffers allocated for the next frame
+    int i;
+    for (i = 0; i < c->size; i++) {
+        ic->entries[i].valid = 0;
+    }
+
+    return 0;
+}
+
+int variant_cache_destroy(VariantCache* c) {
+    IVariantCache* ic = (IVariantCache*) c;
+
+    LOG_TRACE("Destroy Variant Cache");
+    if (ic->entries != NULL) {
+        int i;
+        for (i = 0; i < c->size; i++) {
+            if (ic->entries[i].jpeg != NULL) {
+                buffer_destroy(ic->entries[i].jpeg);
+                ic->entries[i].jpeg = NULL;
+            }
+        }
+        free(ic->entries);
+        ic->entries = NULL;
+    }
+
+    free(ic);
+
+    return 0;
+}
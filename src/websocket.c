@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "websocket.h"
+#include "http.h"
+#include "log.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+// Biggest upgrade request accepted
+#define WS_MAX_REQUEST 4096
+
+static uint32_t rol(uint32_t v, int n) {
+    return (v << n) | (v >> (32 - n));
+}
+
+static void sha1_block(uint32_t* h, const uint8_t* p) {
+    uint32_t w[80];
+    int i;
+    for (i = 0; i < 16; i++) {
+        w[i] = (p[4 * i] << 24) | (p[4 * i + 1] << 16) | (p[4 * i + 2] << 8) | p[4 * i + 3];
+    }
+    for (i = 16; i < 80; i++) {
+        w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        uint32_t t = rol(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rol(b, 30);
+        b = a;
+        a = t;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+// Only for the short handshake keys
+static void sha1(const uint8_t* data, int len, uint8_t* digest) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    uint8_t block[64];
+    int i;
+
+    for (i = 0; i + 64 <= len; i += 64) {
+        sha1_block(h, data + i);
+    }
+
+    // Padding and length in bits
+    int rest = len - i;
+    memset(block, 0, sizeof (block));
+    memcpy(block, data + i, rest);
+    block[rest] = 0x80;
+    if (rest >= 56) {
+        sha1_block(h, block);
+        memset(block, 0, sizeof (block));
+    }
+    uint64_t bits = (uint64_t) len * 8;
+    for (i = 0; i < 8; i++) {
+        block[63 - i] = bits >> (8 * i);
+    }
+    sha1_block(h, block);
+
+    for (i = 0; i < 20; i++) {
+        digest[i] = h[i / 4] >> (24 - 8 * (i % 4));
+    }
+}
+
+static int base64(const uint8_t* data, int len, char* out) {
+    static const char* table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int i, n = 0;
+    for (i = 0; i < len; i += 3) {
+        uint32_t v = data[i] << 16;
+        if (i + 1 < len) v |= data[i + 1] << 8;
+        if (i + 2 < len) v |= data[i + 2];
+        out[n++] = table[(v >> 18) & 0x3F];
+        out[n++] = table[(v >> 12) & 0x3F];
+        out[n++] = i + 1 < len ? table[(v >> 6) & 0x3F] : '=';
+        out[n++] = i + 2 < len ? table[v & 0x3F] : '=';
+    }
+    out[n] = '\0';
+    return n;
+}
+
+int websocket_handshake(const uint8_t* data, int len, char* response, int size) {
+    // Wait the full request
+    const uint8_t* end = NULL;
+    int i;
+    for (i = 0; i + 4 <= len; i++) {
+        if (memcmp(data + i, "\r\n\r\n", 4) == 0) {
+            end = data + i + 4;
+            break;
+        }
+    }
+    if (end == NULL) {
+        if (len > WS_MAX_REQUEST) {
+            LOG_WARN("Upgrade request too long");
+            return -1;
+        }
+        return 0;
+    }
+
+    char request[WS_MAX_REQUEST + 1];
+    int rlen = end - data;
+    if (rlen > WS_MAX_REQUEST) {
+        LOG_WARN("Upgrade request too long");
+        return -1;
+    }
+    memcpy(request, data, rlen);
+    request[rlen] = '\0';
+
+    int vlen;
+    const char* upgrade = http_header(request, "Upgrade", &vlen);
+    if (upgrade == NULL || vlen != 9 || strncasecmp(upgrade, "websocket", 9) != 0) {
+        LOG_WARN("Not a WebSocket upgrade");
+        return -1;
+    }
+
+    const char* key = http_header(request, "Sec-WebSocket-Key", &vlen);
+    if (key == NULL || vlen == 0 || vlen > 64) {
+        LOG_WARN("WebSocket key expected");
+        return -1;
+    }
+
+    // Accept = base64(sha1(key + GUID))
+    uint8_t concat[64 + sizeof (WS_GUID)];
+    memcpy(concat, key, vlen);
+    memcpy(concat + vlen, WS_GUID, sizeof (WS_GUID) - 1);
+    uint8_t digest[20];
+    sha1(concat, vlen + sizeof (WS_GUID) - 1, digest);
+    char accept[32];
+    base64(digest, sizeof (digest), accept);
+
+    int n = snprintf(response, size, "HTTP/1.1 101 Switching Protocols\r\n"
+            "Upgrade: websocket\r\n"
+            "Connection: Upgrade\r\n"
+            "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    if (n >= size) {
+        LOG_ERROR("Upgrade response too long");
+        return -1;
+    }
+
+    return rlen;
+}
+
+int websocket_write_header(uint8_t* out, uint8_t opcode, uint64_t length) {
+    // Whole messages, never fragmented
+    out[0] = 0x80 | opcode;
+    if (length < 126) {
+        out[1] = length;
+        return 2;
+    }
+
+    if (length <= 0xFFFF) {
+        out[1] = 126;
+        out[2] = length >> 8;
+        out[3] = length;
+        return 4;
+    }
+
+    out[1] = 127;
+    int i;
+    for (i = 0; i < 8; i++) {
+        out[2 + i] = length >> (56 - 8 * i);
+    }
+    return 10;
+}
+
+int websocket_parse_frame(uint8_t* data, int len, WebSocketFrame* f) {
+    if (len < 2) return 0;
+
+    f->opcode = data[0] & 0x0F;
+    int masked = (data[1] & 0x80) != 0;
+    uint64_t length = data[1] & 0x7F;
+    int hlen = 2;
+    if (length == 126) {
+        if (len < 4) return 0;
+        length = (data[2] << 8) | data[3];
+        hlen = 4;
+    } else if (length == 127) {
+        if (len < 10) return 0;
+        length = 0;
+        int i;
+        for (i = 0; i < 8; i++) {
+            length = (length << 8) | data[2 + i];
+        }
+        hlen = 10;
+    }
+
+    // Browsers only send control frames and small messages
+    if (length > WS_MAX_REQUEST) {
+        LOG_WARN("WebSocket message too big: %llu", (unsigned long long) length);
+        return -1;
+    }
+
+    uint8_t* mask = data + hlen;
+    if (masked) hlen += 4;
+    if (len < hlen + length) return 0;
+
+    f->length = length;
+    f->payload = data + hlen;
+    if (masked) {
+        uint64_t i;
+        for (i = 0; i < length; i++) {
+            f->payload[i] ^= mask[i % 4];
+        }
+    }
+
+    return hlen + length;
+}